@@ -66,6 +66,11 @@
 #endif
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <errno.h>
 #ifdef __linux__
 #undef __OPTIMIZE__
@@ -78,12 +83,21 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 #include <agent_config.h>
 #include <config.h>
+#include "findif_lpm.h"
+#include "findif_netlink.h"
+#include "findif_proc.h"
 
 #define DEBUG 0
 #define	EOS			'\0'
 #define	PROCROUTE	"/proc/net/route"
+#define	PROCROUTE6	"/proc/net/ipv6_route"
+#define	FINDIF_SOCKET	HA_VARRUNDIR "/" PACKAGE "/rsctmp/findif.sock"
 #define ROUTEPARM	"-n get"
 
 #ifndef HAVE_STRNLEN
@@ -110,6 +124,31 @@
 
 static int OutputInCIDR=0;
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * The interfaces of the host, from one link dump taken on first use and
+ * kept for the life of the process.  link_cache is NULL until then, or
+ * if netlink cannot be used, in which case the interfaces are looked up
+ * one at a time with ioctls.
+ */
+static struct link_table link_snapshot;
+static struct link_table *link_cache = NULL;
+static int link_cache_loaded = 0;
+
+static struct link_table *
+LinkCache(void)
+{
+	if (!link_cache_loaded) {
+		link_cache_loaded = 1;
+		link_table_init(&link_snapshot);
+		if (link_table_load(&link_snapshot) == 0) {
+			link_cache = &link_snapshot;
+		}
+	}
+	return link_cache;
+}
+#endif
+
 
 /*
  * Different OSes offer different mechnisms to obtain this information.
@@ -128,19 +167,46 @@ typedef int SearchRoute (char *address, struct in_addr *in
 ,        unsigned long *best_netmask, char *errmsg
 ,	int errmsglen);
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+static SearchRoute SearchUsingNetlink;
+#endif
 static SearchRoute SearchUsingProcRoute;
 static SearchRoute SearchUsingRouteCmd;
 
 static SearchRoute *search_mechs[] = {
+#ifdef HAVE_LINUX_RTNETLINK_H
+	&SearchUsingNetlink,
+#endif
 	&SearchUsingProcRoute,
 	&SearchUsingRouteCmd,
 	NULL
 };
 
+/*
+ * The same for IPv6, with the prefix length of the route in *prefixlen.
+ */
+typedef int SearchRoute6 (char *address, struct in6_addr *in6
+,	char *best_if, size_t best_iflen, int *prefixlen
+,	char *errmsg, int errmsglen);
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+static SearchRoute6 SearchUsingNetlink6;
+#endif
+static SearchRoute6 SearchUsingProcRoute6;
+
+static SearchRoute6 *search6_mechs[] = {
+#ifdef HAVE_LINUX_RTNETLINK_H
+	&SearchUsingNetlink6,
+#endif
+	&SearchUsingProcRoute6,
+	NULL
+};
+
 void GetAddress (char **address, char **netmaskbits
 ,	 char **bcast_arg, char **if_specified);
 
-void ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask);
+int ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask
+,	char *errmsg, int errmsglen);
 
 int ValidateIFName (const char *ifname, struct ifreq *ifr);
 
@@ -168,66 +234,352 @@ void usage(int ec);
 #define	BAD_BROADCAST	(0L)
 #define	MAXSTR	128
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * Ask the kernel FIB which route it would use for the address, with one
+ * RTM_GETROUTE request.  This costs a single round-trip however large the
+ * routing table is, and it honours policy routing rules since the kernel
+ * does the complete lookup.
+ *
+ * RTM_F_FIB_MATCH makes the kernel report the matching FIB entry with its
+ * real prefix length instead of a cloned /32 host route.  Kernels which do
+ * not know the flag answer with a cloned route; we then report the
+ * mechanism as invalid so that the next one is tried.  The same is done
+ * for any answer which is not a plain unicast route.
+ */
+#ifndef RTM_F_FIB_MATCH
+#define RTM_F_FIB_MATCH	0x2000
+#endif
+
 static int
-SearchUsingProcRoute (char *address, struct in_addr *in
-, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
-,	unsigned long *best_netmask
+NetlinkGetRoute (int family, const void *addr, char *address
+,	char *best_if, size_t best_iflen, int *prefixlen
 ,	char *errmsg, int errmsglen)
 {
-	unsigned long	flags, refcnt, use, gw, mask;
-	unsigned long   dest;
-	long		metric = LONG_MAX;
-	long		best_metric = LONG_MAX;
-	int		rc = OCF_SUCCESS;
-	
-	char	buf[2048];
-	char	interface[MAXSTR];
-	FILE *routefd = NULL;
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rt;
+		char		attrs[RTA_SPACE(sizeof(struct in6_addr))];
+	} req;
+	size_t			addrlen = family == AF_INET
+				?	sizeof(struct in_addr)
+				:	sizeof(struct in6_addr);
+	struct sockaddr_nl	sanl;
+	struct rtattr *		rta;
+	struct nlmsghdr *	nh;
+	struct rtmsg *		rtm;
+	char			buf[8192];
+	char			ifname[IF_NAMESIZE];
+	int			oif = 0;
+	int			attrlen;
+	ssize_t			len;
+	int			sock;
+	int			rc = -1;
+
+	if ((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		return -1;
+	}
 
-	if ((routefd = fopen(PROCROUTE, "r")) == NULL) {
-		snprintf(errmsg, errmsglen
-		,	"Cannot open %s for reading"
-		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = 1;
+	req.rt.rtm_family = family;
+	req.rt.rtm_dst_len = addrlen * 8;
+	req.rt.rtm_flags = RTM_F_FIB_MATCH;
+	rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+	rta->rta_type = RTA_DST;
+	rta->rta_len = RTA_LENGTH(addrlen);
+	memcpy(RTA_DATA(rta), addr, addrlen);
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + rta->rta_len;
+
+	memset(&sanl, 0, sizeof(sanl));
+	sanl.nl_family = AF_NETLINK;
+	if (sendto(sock, &req, req.nh.nlmsg_len, 0
+	,	(struct sockaddr *)&sanl, sizeof(sanl)) < 0) {
+		goto out;
+	}
+	do {
+		len = recv(sock, buf, sizeof(buf), 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		goto out;
 	}
 
-	/* Skip first (header) line */
-	if (fgets(buf, sizeof(buf), routefd) == NULL) {
-		snprintf(errmsg, errmsglen
-		,	"Cannot skip first line from %s"
-		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
+	nh = (struct nlmsghdr *)buf;
+	if (!NLMSG_OK(nh, (size_t)len)) {
+		goto out;
 	}
-	while (fgets(buf, sizeof(buf), routefd) != NULL) {
-		if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
-		,	interface, &dest, &gw, &flags, &refcnt, &use
-		,	&metric, &mask)
-		!= 8) {
-			snprintf(errmsg, errmsglen, "Bad line in %s: %s"
-			,	PROCROUTE, buf);
-			rc = OCF_ERR_GENERIC; goto out;
+	if (nh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *err = NLMSG_DATA(nh);
+		if (err->error == -ENETUNREACH || err->error == -EHOSTUNREACH) {
+			snprintf(errmsg, errmsglen, "No route to %s\n", address);
+			rc = OCF_ERR_GENERIC;
 		}
-		if ( (in->s_addr&mask) == (in_addr_t)(dest&mask)
-		&&	metric < best_metric) {
-			best_metric = metric;
-			*best_netmask = mask;
-			strncpy(best_if, interface, best_iflen);
+		/* anything else: let the next mechanism try */
+		goto out;
+	}
+	if (nh->nlmsg_type != RTM_NEWROUTE) {
+		goto out;
+	}
+
+	rtm = NLMSG_DATA(nh);
+	if (rtm->rtm_flags & RTM_F_CLONED) {
+		/* RTM_F_FIB_MATCH not supported: no prefix length */
+		goto out;
+	}
+	if (rtm->rtm_type != RTN_UNICAST) {
+		/*
+		 * Addresses configured on this host match their host route
+		 * in the local table first; the subnet we are after lives
+		 * in the main table, which the next mechanism reads.
+		 */
+		goto out;
+	}
+
+	attrlen = RTM_PAYLOAD(nh);
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		if (rta->rta_type == RTA_OIF) {
+			oif = *(int *)RTA_DATA(rta);
 		}
 	}
+	if (oif == 0 || if_indextoname(oif, ifname) == NULL) {
+		/* e.g. a multipath route: leave it to the next mechanism */
+		goto out;
+	}
+
+	*prefixlen = rtm->rtm_dst_len;
+	strncpy(best_if, ifname, best_iflen);
+	rc = OCF_SUCCESS;
 
-	if (best_metric == LONG_MAX) {
+  out:
+	close(sock);
+	return rc;
+}
+static int
+SearchUsingNetlink (char *address, struct in_addr *in
+,	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	int	prefixlen;
+	int	rc;
+
+	rc = NetlinkGetRoute(AF_INET, &in->s_addr, address
+	,	best_if, best_iflen, &prefixlen, errmsg, errmsglen);
+	if (rc == OCF_SUCCESS) {
+		*best_netmask = prefixlen == 0 ? 0
+		:	htonl(0xffffffffUL << (32 - prefixlen));
+	}
+	return rc;
+}
+
+static int
+SearchUsingNetlink6 (char *address, struct in6_addr *in6
+,	char *best_if, size_t best_iflen, int *prefixlen
+,	char *errmsg, int errmsglen)
+{
+	return NetlinkGetRoute(AF_INET6, in6, address
+	,	best_if, best_iflen, prefixlen, errmsg, errmsglen);
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+/*
+ * Load the IPv4 routes of PROCROUTE, or of the file named by
+ * $FINDIF_PROCROUTE, into a longest-prefix-match table.
+ * Returns OCF_SUCCESS, or an error code with errmsg filled in.
+ */
+static int
+LoadProcRoute (struct lpm_table *table, char *errmsg, int errmsglen)
+{
+	const char	*path = getenv("FINDIF_PROCROUTE");
+
+	if (path == NULL || *path == EOS) {
+		path = PROCROUTE;
+	}
+	if (proc_route_load(table, path, errmsg, errmsglen) < 0) {
+		return(OCF_ERR_GENERIC);
+	}
+	return(OCF_SUCCESS);
+}
+
+/*
+ * Look the address up in a route snapshot.
+ */
+static int
+LookupRoute (const struct lpm_table *table, char *address
+,	struct in_addr *in, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask, char *errmsg, int errmsglen)
+{
+	const struct lpm_route	*route;
+
+	route = lpm_lookup(table, &in->s_addr);
+	if (route == NULL) {
 		snprintf(errmsg, errmsglen, "No route to %s\n", address);
-		rc = OCF_ERR_GENERIC; 
+		return OCF_ERR_GENERIC;
 	}
+	*best_netmask = route->prefixlen == 0 ? 0
+	:	htonl(0xffffffffUL << (32 - route->prefixlen));
+	strncpy(best_if, route->ifname, best_iflen);
+	return OCF_SUCCESS;
+}
 
-  out:
-	if (routefd) {
-		fclose(routefd);
+/*
+ * Pick the most specific route to the address from PROCROUTE.  The routes
+ * are indexed in a prefix trie, so that the longest prefix wins and the
+ * metric only breaks ties between routes of the same prefix.
+ */
+static int
+SearchUsingProcRoute (char *address, struct in_addr *in
+, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	struct lpm_table	table;
+	int			rc;
+
+	lpm_init(&table, 32);
+	rc = LoadProcRoute(&table, errmsg, errmsglen);
+	if (rc == OCF_SUCCESS) {
+		rc = LookupRoute(&table, address, in, best_if, best_iflen
+		,	best_netmask, errmsg, errmsglen);
+	}
+	lpm_free(&table);
+	return(rc);
+}
+
+/*
+ * Load the routes of PROCROUTE6, or of $FINDIF_PROCROUTE6, into a table
+ * of 128 bit prefixes.
+ */
+static int
+LoadProcRoute6 (struct lpm_table *table, char *errmsg, int errmsglen)
+{
+	const char	*path = getenv("FINDIF_PROCROUTE6");
+
+	if (path == NULL || *path == EOS) {
+		path = PROCROUTE6;
+	}
+	if (proc_route6_load(table, path, errmsg, errmsglen) < 0) {
+		return(OCF_ERR_GENERIC);
 	}
+	return(OCF_SUCCESS);
+}
 
+static int
+LookupRoute6 (const struct lpm_table *table, char *address
+,	struct in6_addr *in6, char *best_if, size_t best_iflen
+,	int *prefixlen, char *errmsg, int errmsglen)
+{
+	const struct lpm_route	*route;
+
+	route = lpm_lookup(table, in6->s6_addr);
+	if (route == NULL) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return OCF_ERR_GENERIC;
+	}
+	*prefixlen = route->prefixlen;
+	strncpy(best_if, route->ifname, best_iflen);
+	return OCF_SUCCESS;
+}
+
+static int
+SearchUsingProcRoute6 (char *address, struct in6_addr *in6
+,	char *best_if, size_t best_iflen, int *prefixlen
+,	char *errmsg, int errmsglen)
+{
+	struct lpm_table	table;
+	int			rc;
+
+	lpm_init(&table, 128);
+	rc = LoadProcRoute6(&table, errmsg, errmsglen);
+	if (rc == OCF_SUCCESS) {
+		rc = LookupRoute6(&table, address, in6, best_if, best_iflen
+		,	prefixlen, errmsg, errmsglen);
+	}
+	lpm_free(&table);
 	return(rc);
 }
 
+/*
+ * Batch mode looks every address up in one snapshot of the routing table,
+ * taken before the first query.  Resident mode keeps the snapshot current.
+ */
+static struct lpm_table route_snapshot;
+
+static int
+SearchUsingSnapshot (char *address, struct in_addr *in
+, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	return LookupRoute(&route_snapshot, address, in, best_if, best_iflen
+	,	best_netmask, errmsg, errmsglen);
+}
+
+static SearchRoute *snapshot_mechs[] = {
+	&SearchUsingSnapshot,
+	NULL
+};
+
+/*
+ * The IPv6 snapshot is only taken when there is an IPv6 query, as many
+ * hosts have no IPv6 routes worth loading, or no IPv6 at all.
+ */
+static struct lpm_table route_snapshot6;
+static int route_snapshot6_loaded = 0;
+
+static int
+LoadRouteSnapshot6 (char *errmsg, int errmsglen)
+{
+	lpm_init(&route_snapshot6, 128);
+	route_snapshot6_loaded = 1;
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (route_table_load(&route_snapshot6, AF_INET6, LinkCache()) == 0) {
+		return OCF_SUCCESS;
+	}
+#endif
+	return LoadProcRoute6(&route_snapshot6, errmsg, errmsglen);
+}
+
+static int
+SearchUsingSnapshot6 (char *address, struct in6_addr *in6
+,	char *best_if, size_t best_iflen, int *prefixlen
+,	char *errmsg, int errmsglen)
+{
+	int	rc;
+
+	if (!route_snapshot6_loaded
+	&&	(rc = LoadRouteSnapshot6(errmsg, errmsglen)) != OCF_SUCCESS) {
+		return rc;
+	}
+	return LookupRoute6(&route_snapshot6, address, in6, best_if
+	,	best_iflen, prefixlen, errmsg, errmsglen);
+}
+
+static SearchRoute6 *snapshot6_mechs[] = {
+	&SearchUsingSnapshot6,
+	NULL
+};
+
+/*
+ * Take the route snapshot for batch mode: from netlink if possible,
+ * else from PROCROUTE.
+ */
+static int
+LoadRouteSnapshot (char *errmsg, int errmsglen)
+{
+	lpm_init(&route_snapshot, 32);
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (route_table_load(&route_snapshot, AF_INET, LinkCache()) == 0) {
+		return OCF_SUCCESS;
+	}
+#endif
+	return LoadProcRoute(&route_snapshot, errmsg, errmsglen);
+}
+
 static int
 SearchUsingRouteCmd (char *address, struct in_addr *in
 ,	struct in_addr *addr_out, char *best_if, size_t best_iflen
@@ -370,8 +722,9 @@ GetAddress (char **address, char **netmaskbits
 	*if_specified = getenv("OCF_RESKEY_nic");
 }
 
-void
-ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
+int
+ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask
+,	char *errmsg, int errmsglen)
 {
 	if (netmaskbits != NULL && *netmaskbits != EOS) {
 		size_t	nmblen = strnlen(netmaskbits, 3);
@@ -380,20 +733,17 @@ ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
 
 		if (nmblen > 2 || nmblen == 0
 		||	(strspn(netmaskbits, "0123456789") != nmblen)) {
-			fprintf(stderr, "Invalid netmask specification"
+			snprintf(errmsg, errmsglen, "Invalid netmask specification"
 			" [%s]", netmaskbits);
-			usage(OCF_ERR_CONFIGURED);
-			/*not reached */
+			return -1;
 		}else{
 			unsigned long	bits = atoi(netmaskbits);
 
 			if (bits < 1 || bits > 32) {
-				fprintf(stderr
+				snprintf(errmsg, errmsglen
 				,	"Invalid netmask specification [%s]"
 				,	netmaskbits);
-				usage(OCF_ERR_CONFIGURED);
-				/*not reached */
-				exit(1);
+				return -1;
 			}
 
 			bits = 32 - bits;
@@ -402,19 +752,20 @@ ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
 			*netmask = htonl(*netmask);
 		}
 	}
+	return 0;
 }
 
+/*
+ * Names are looked up in the link cache.  Alias names ("eth0:1") are not
+ * links, so they, and all names when there is no link cache, are checked
+ * with an ioctl, on a socket kept for the life of the process.
+ */
 int
 ValidateIFName(const char *ifname, struct ifreq *ifr) 
 {
- 	int skfd = -1;
+	static int skfd = -1;
 	char *colonptr;
 
- 	if ( (skfd = socket(PF_INET, SOCK_DGRAM, 0)) == -1 ) {
- 		fprintf(stderr, "%s\n", strerror(errno));
- 		return -2;
- 	}
- 
 	strncpy(ifr->ifr_name, ifname, IFNAMSIZ);
 
 	/* Contain a ":"?  Probably an error, but treat as warning at present */
@@ -423,14 +774,28 @@ ValidateIFName(const char *ifname, struct ifreq *ifr)
 		  ifr->ifr_name);
 	}
  
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (colonptr == NULL && LinkCache() != NULL) {
+		const struct link_entry *l = link_by_name(link_cache, ifname);
+
+		if (l == NULL) {
+			fprintf(stderr, "%s: unknown interface\n", ifr->ifr_name);
+			return -1;
+		}
+		ifr->ifr_flags = l->flags;
+		return 0;
+	}
+#endif
+ 	if (skfd == -1 && (skfd = socket(PF_INET, SOCK_DGRAM, 0)) == -1 ) {
+ 		fprintf(stderr, "%s\n", strerror(errno));
+ 		return -2;
+ 	}
  	if (ioctl(skfd, SIOCGIFFLAGS, ifr) < 0) {
  		fprintf(stderr, "%s: unknown interface: %s\n"
  			, ifr->ifr_name, strerror(errno));
- 		close(skfd);
 		/* return -1 only if ifname is known to be invalid */
 		return -1;
  	}
- 	close(skfd);
  	return 0;
 } 
 
@@ -462,6 +827,19 @@ get_first_loopback_netdev(char * output)
 		goto out;
 	}
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (LinkCache() != NULL) {
+		const struct link_entry *l = link_by_flags(link_cache
+		,	IFF_LOOPBACK);
+
+		if (l != NULL) {
+			strncpy(output, l->name, IFNAMSIZ);
+			rc = output;
+		}
+		goto out;
+	}
+#endif
+
 	fd = fopen(PATH_PROC_NET_DEV, "r");
 	if (!fd) {
 		fprintf(stderr, "Warning: cannot open %s (%s).\n",
@@ -556,105 +934,199 @@ int ConvertQuadToInt(char *dest)
         return (bits);
 }
 
-int
-main(int argc, char ** argv) {
+/*
+ * Find the interface, netmask and broadcast address for one address and
+ * format them as findif prints them.  The route is searched with the
+ * mechanisms in active_mechs.
+ *
+ * On error, errmsg is filled in and *badarg tells whether the error is
+ * in the arguments (as opposed to the routing lookup).
+ */
+static SearchRoute **active_mechs = search_mechs;
+static SearchRoute6 **active6_mechs = search6_mechs;
 
-	char *	address = NULL;
-	char *	bcast_arg = NULL;
-	char *	netmaskbits = NULL;
+/*
+ * IPv6 addresses have no broadcast address (one given is ignored), and
+ * their netmask is always given and printed as a prefix length:
+ *
+ *	<interface>\tnetmask <prefix length>
+ */
+static int
+FindInterface6 (char *address, char *netmaskbits, char *bcast_arg
+,	char *if_specified, char *result, size_t resultlen
+,	char *errmsg, int errmsglen, int *badarg)
+{
+	struct in6_addr	in6;
+	struct ifreq	ifr;
+	char	best_if[MAXSTR];
+	int	prefixlen = -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	*badarg = 1;
+
+	if (inet_pton(AF_INET6, address, &in6) <= 0) {
+		snprintf(errmsg, errmsglen, "IP address [%s] not valid.", address);
+		return(OCF_ERR_CONFIGURED);
+	}
+
+	if (netmaskbits != NULL && *netmaskbits != EOS) {
+		char	*end;
+		long	bits = strtol(netmaskbits, &end, 10);
+
+		if (*end != EOS || end == netmaskbits
+		||	bits < 0 || bits > 128) {
+			snprintf(errmsg, errmsglen
+			,	"Invalid prefix length [%s].", netmaskbits);
+			return(OCF_ERR_CONFIGURED);
+		}
+		prefixlen = (int)bits;
+	}
+
+	if (bcast_arg != NULL && *bcast_arg != EOS) {
+		fprintf(stderr, "IPv6 has no broadcast address, ignoring [%s].\n"
+		,	bcast_arg);
+	}
+
+	if (if_specified != NULL && *if_specified != EOS) {
+		if (ValidateIFName(if_specified, &ifr) < 0) {
+			snprintf(errmsg, errmsglen
+			,	"Invalid interface [%s]", if_specified);
+			return(OCF_ERR_CONFIGURED);
+		}
+		strncpy(best_if, if_specified, sizeof(best_if));
+		*(best_if + sizeof(best_if) - 1) = '\0';
+	}
+	/* without a prefix length, the route has to tell it */
+	if (if_specified == NULL || *if_specified == EOS || prefixlen < 0) {
+		SearchRoute6 **sr = active6_mechs;
+		char	route_if[MAXSTR];
+		int	route_prefixlen = 0;
+		int	rc = OCF_ERR_GENERIC;
+
+		snprintf(errmsg, errmsglen, "No valid mecahnisms");
+		strcpy(route_if, "UNKNOWN");
+
+		while (*sr) {
+			errmsg[0] = '\0';
+			rc = (*sr) (address, &in6, route_if, sizeof(route_if)
+			,	&route_prefixlen, errmsg, errmsglen);
+			if (!rc) {		/* Mechanism worked */
+				break;
+			}
+			sr++;
+		}
+		if (rc != 0) {	/* No route, or all mechanisms failed */
+			*badarg = 0;
+			return(rc);
+		}
+		if (if_specified == NULL || *if_specified == EOS) {
+			strncpy(best_if, route_if, sizeof(best_if));
+		}
+		if (prefixlen < 0) {
+			prefixlen = route_prefixlen;
+		}
+	}
+
+	*badarg = 0;
+	if (prefixlen <= 0 && IN6_IS_ADDR_LOOPBACK(&in6)) {
+		/* ::1 only has a route in the local table */
+		if (get_first_loopback_netdev(best_if) == NULL) {
+			snprintf(errmsg, errmsglen
+			,	"No loopback interface found.\n");
+			return(OCF_ERR_GENERIC);
+		}
+		prefixlen = 128;
+	}
+	if (prefixlen <= 0) {
+		snprintf(errmsg, errmsglen
+		,	"ERROR: Cannot use default route w/o netmask [%s]\n"
+		,	 address);
+		return(OCF_ERR_GENERIC);
+	}
+	snprintf(result, resultlen, "%s\tnetmask %d\n", best_if, prefixlen);
+	return(OCF_SUCCESS);
+}
+
+static int
+FindInterface (char *address, char *netmaskbits, char *bcast_arg
+,	char *if_specified, char *result, size_t resultlen
+,	char *errmsg, int errmsglen, int *badarg)
+{
 	struct in_addr	in;
 	struct in_addr	addr_out;
 	unsigned long	netmask;
 	char	best_if[MAXSTR];
-	char *	if_specified = NULL;
+	char	nmbuf[MAXSTR];
 	struct ifreq	ifr;
 	unsigned long	best_netmask = INT_MAX;
-	int		argerrs	= 0;
-
-	cmdname=argv[0];
-
 
 	memset(&addr_out, 0, sizeof(addr_out));
 	memset(&in, 0, sizeof(in));
 	memset(&ifr, 0, sizeof(ifr));
+	*badarg = 1;
 
-	switch (argc) {
-	case 1:	/* No -C argument */
-		break;
-	case 2: /* Hopefully a -C argument */
-		if (strncmp(argv[1], "-C", sizeof("-C")) != 0) {
-			argerrs=1;
-		}
-		OutputInCIDR=1;
-		break;
-	default:
-		argerrs=1;
-		break;
-	}
-	if (argerrs) {
-		usage(OCF_ERR_ARGS);
-		/* not reached */
-		return(1);
-	}
-
-	GetAddress (&address, &netmaskbits, &bcast_arg
-	,	 &if_specified);
 	if (address == NULL || *address == EOS) {
-		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+		snprintf(errmsg, errmsglen
+		,	"ERROR: IP address parameter is mandatory.");
+		return(OCF_ERR_CONFIGURED);
+	}
+	if (strchr(address, ':') != NULL) {
+		return FindInterface6(address, netmaskbits, bcast_arg
+		,	if_specified, result, resultlen
+		,	errmsg, errmsglen, badarg);
 	}
 
 	/* Is the IP address we're supposed to find valid? */
 	 
 	if (inet_pton(AF_INET, address, (void *)&in) <= 0) {
-		fprintf(stderr, "IP address [%s] not valid.", address);
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+		snprintf(errmsg, errmsglen, "IP address [%s] not valid.", address);
+		return(OCF_ERR_CONFIGURED);
 	}
 
 	if(netmaskbits != NULL && *netmaskbits != EOS
 	&&		strchr(netmaskbits, '.') != NULL) {
-		int len = strlen(netmaskbits);
-		snprintf(netmaskbits, len, "%d", ConvertQuadToInt(netmaskbits));
+		snprintf(nmbuf, sizeof(nmbuf), "%d", ConvertQuadToInt(netmaskbits));
+		netmaskbits = nmbuf;
 		fprintf(stderr, "Converted dotted-quad netmask to CIDR as: %s\n", netmaskbits);
 	}
 	
 	/* Validate the netmaskbits field */
-	ValidateNetmaskBits (netmaskbits, &netmask);
+	if (ValidateNetmaskBits (netmaskbits, &netmask, errmsg, errmsglen) < 0) {
+		return(OCF_ERR_CONFIGURED);
+	}
 
 	if (if_specified != NULL && *if_specified != EOS) {
 		if(ValidateIFName(if_specified, &ifr) < 0) {
-			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+			snprintf(errmsg, errmsglen
+			,	"Invalid interface [%s]", if_specified);
+			return(OCF_ERR_CONFIGURED);
 		}
 		strncpy(best_if, if_specified, sizeof(best_if));
 		*(best_if + sizeof(best_if) - 1) = '\0';
 	}else{
-		SearchRoute **sr = search_mechs;
-		char errmsg[MAXSTR] = "No valid mecahnisms";
+		SearchRoute **sr = active_mechs;
 		int rc = OCF_ERR_GENERIC;
 
+		snprintf(errmsg, errmsglen, "No valid mecahnisms");
 		strcpy(best_if, "UNKNOWN");
 
 		while (*sr) {
 			errmsg[0] = '\0';
 			rc = (*sr) (address, &in, &addr_out, best_if
 			,	sizeof(best_if)
-			,	&best_netmask, errmsg, sizeof(errmsg));
+			,	&best_netmask, errmsg, errmsglen);
 			if (!rc) {		/* Mechanism worked */
 				break;
 			}
 			sr++;
 		}
 		if (rc != 0) {	/* No route, or all mechanisms failed */
-			if (*errmsg) {
-				fprintf(stderr, "%s", errmsg);
-			}
+			*badarg = 0;
 			return(rc);
 		}
 	}
 
+	*badarg = 0;
 	if (netmaskbits) {
 		best_netmask = netmask;
 	}else if (best_netmask == 0L) {
@@ -664,14 +1136,19 @@ main(int argc, char ** argv) {
 		   My fix may be not good enough, please FIXME
 		 */
 		if (0 == strncmp(address, "127", 3)) {
-			if (NULL != get_first_loopback_netdev(best_if)) {
-				best_netmask = 0x000000ff;
-			} else {
-				fprintf(stderr, "No loopback interface found.\n");
+			static char	loopback[IFNAMSIZ];
+
+			/* the loopback device won't change: look once */
+			if (loopback[0] == EOS
+			&&	get_first_loopback_netdev(loopback) == NULL) {
+				snprintf(errmsg, errmsglen
+				,	"No loopback interface found.\n");
 				return(OCF_ERR_GENERIC);
 			}
+			strncpy(best_if, loopback, sizeof(best_if));
+			best_netmask = 0x000000ff;
 		} else {
-			fprintf(stderr
+			snprintf(errmsg, errmsglen
 			,	"ERROR: Cannot use default route w/o netmask [%s]\n"
 			,	 address);
 			return(OCF_ERR_GENERIC);
@@ -686,14 +1163,16 @@ main(int argc, char ** argv) {
 		 */
  		struct in_addr bcast_addr;
  		if (inet_pton(AF_INET, bcast_arg, (void *)&bcast_addr) <= 0) {
- 			fprintf(stderr, "Invalid broadcast address [%s].", bcast_arg);
- 			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+ 			snprintf(errmsg, errmsglen
+			,	"Invalid broadcast address [%s].", bcast_arg);
+			*badarg = 1;
+			return(OCF_ERR_CONFIGURED);
  		}
 
 		best_netmask = htonl(best_netmask);
 		if (!OutputInCIDR) {
-			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %s\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d.%d.%d.%d\tbroadcast %s\n"
 			,	best_if
                 	,       (int)((best_netmask>>24) & 0xff)
                 	,       (int)((best_netmask>>16) & 0xff)
@@ -701,7 +1180,8 @@ main(int argc, char ** argv) {
                 	,       (int)(best_netmask & 0xff)
 			,	bcast_arg);
 		}else{
-			printf("%s\tnetmask %d\tbroadcast %s\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d\tbroadcast %s\n"
 			,	best_if
 			,	netmask_bits(best_netmask)
 			,	bcast_arg);
@@ -721,7 +1201,8 @@ main(int argc, char ** argv) {
 		best_netmask = htonl(best_netmask);
 		def_bcast = htonl(def_bcast);
 		if (!OutputInCIDR) {
-			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d\n"
 			,       best_if
 			,       (int)((best_netmask>>24) & 0xff)
 			,       (int)((best_netmask>>16) & 0xff)
@@ -732,7 +1213,8 @@ main(int argc, char ** argv) {
 			,       (int)((def_bcast>>8) & 0xff)
 			,       (int)(def_bcast & 0xff));
 		}else{
-			printf("%s\tnetmask %d\tbroadcast %d.%d.%d.%d\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d\tbroadcast %d.%d.%d.%d\n"
 			,       best_if
 			,	netmask_bits(best_netmask)
 			,       (int)((def_bcast>>24) & 0xff)
@@ -741,6 +1223,612 @@ main(int argc, char ** argv) {
 			,       (int)(def_bcast & 0xff));
 		}
 	}
+	return(OCF_SUCCESS);
+}
+
+/*
+ * Squeeze a message onto one line, for the line based modes.
+ */
+static char *
+one_line(char *msg)
+{
+	char	*cp = msg + strlen(msg);
+
+	while (cp != msg && isspace((int)*(cp-1))) {
+		*--cp = EOS;
+	}
+	for (cp = msg; *cp; cp++) {
+		if (*cp == '\n') {
+			*cp = ' ';
+		}
+	}
+	return msg;
+}
+
+/*
+ * Batch mode: read one query per line from fp, as
+ *
+ *	address [netmask [broadcast [nic]]]
+ *
+ * where "-" stands for an omitted field, and write one line per query:
+ * the usual findif output, or "ERROR <exit code>\t<message>".  Empty lines
+ * and lines starting with '#' are skipped.  All queries are answered from
+ * one routing snapshot taken before the first one.
+ *
+ * Returns OCF_SUCCESS, or the exit code of the first failed query.
+ */
+static int
+RunBatch (FILE *fp)
+{
+	char	line[4 * MAXSTR];
+	char	result[2 * MAXSTR];
+	char	errmsg[MAXSTR];
+	int	ret = OCF_SUCCESS;
+	int	rc;
+
+	errmsg[0] = EOS;
+	if ((rc = LoadRouteSnapshot(errmsg, sizeof(errmsg))) != OCF_SUCCESS) {
+		fprintf(stderr, "%s\n", errmsg);
+		return rc;
+	}
+	active_mechs = snapshot_mechs;
+	active6_mechs = snapshot6_mechs;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char	*field[4] = { NULL, NULL, NULL, NULL };
+		char	*cp, *save = NULL;
+		int	nfields = 0;
+		int	badarg;
+
+		for (cp = strtok_r(line, " \t\r\n", &save)
+		;	cp != NULL && nfields < 4
+		;	cp = strtok_r(NULL, " \t\r\n", &save)) {
+			field[nfields++] = strcmp(cp, "-") == 0 ? NULL : cp;
+		}
+		if (nfields == 0 || (field[0] && *field[0] == '#')) {
+			continue;
+		}
+
+		errmsg[0] = EOS;
+		rc = FindInterface(field[0], field[1], field[2], field[3]
+		,	result, sizeof(result), errmsg, sizeof(errmsg)
+		,	&badarg);
+		if (rc == OCF_SUCCESS) {
+			fputs(result, stdout);
+		}else{
+			printf("ERROR %d\t%s\n", rc, one_line(errmsg));
+			if (ret == OCF_SUCCESS) {
+				ret = rc;
+			}
+		}
+		/* the caller may be waiting for this answer */
+		fflush(stdout);
+	}
+	lpm_free(&route_snapshot);
+	lpm_free(&route_snapshot6);
+	return ret;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * Resident mode.
+ *
+ * The daemon loads the interfaces and the main routing table once, keeps
+ * them current from rtnetlink notifications, and answers queries on a
+ * Unix stream socket, one line each way:
+ *
+ *	request:  <C|-> <address> <netmask> <broadcast> <nic>\n
+ *	reply:    <exit code> <badarg>\t<output or message>\n
+ *
+ * where "-" stands for an empty field.  A plain findif run asks the daemon
+ * first, and does the lookup itself if there is no daemon to ask.
+ */
+#define	MAXCLIENTS	64
+#define	CLIENT_TIMEOUT	2	/* seconds, for the client side */
+
+static const char *
+socket_path(const char *path)
+{
+	if (path == NULL && (path = getenv("FINDIF_SOCKET")) == NULL) {
+		path = FINDIF_SOCKET;
+	}
+	return path;
+}
+
+static int
+fill_sockaddr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		return -1;
+	}
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+/*
+ * Ask the daemon.  Returns the exit code, with the output or the message
+ * in result, or -1 if there is no daemon to answer.
+ */
+static int
+QueryDaemon (const char *path, char *address, char *netmaskbits
+,	char *bcast_arg, char *if_specified
+,	char *result, size_t resultlen, int *badarg)
+{
+	const char	*field[4];
+	char	req[4 * MAXSTR];
+	char	reply[4 * MAXSTR];
+	struct sockaddr_un	sun;
+	struct timeval	tv;
+	size_t	len = 0;
+	ssize_t	n;
+	char	*cp;
+	int	rc = -1;
+	int	sock;
+	int	j;
+
+	field[0] = address;
+	field[1] = netmaskbits;
+	field[2] = bcast_arg;
+	field[3] = if_specified;
+	for (j = 0; j < 4; j++) {
+		if (field[j] == NULL || *field[j] == EOS) {
+			field[j] = "-";
+		}else if (strpbrk(field[j], " \t\r\n") != NULL
+		||	strcmp(field[j], "-") == 0) {
+			/* cannot be sent as is: let the local code judge it */
+			return -1;
+		}
+	}
+	n = snprintf(req, sizeof(req), "%c %s %s %s %s\n"
+	,	OutputInCIDR ? 'C' : '-', field[0], field[1], field[2], field[3]);
+	if (n < 0 || (size_t)n >= sizeof(req)) {
+		return -1;
+	}
+
+	if (fill_sockaddr(&sun, socket_path(path)) < 0
+	||	(sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	tv.tv_sec = CLIENT_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0
+	||	write(sock, req, n) != n) {
+		goto out;
+	}
+	while (len < sizeof(reply) - 1
+	&&	(n = read(sock, reply + len, sizeof(reply) - 1 - len)) > 0) {
+		len += n;
+		if (memchr(reply, '\n', len) != NULL) {
+			break;
+		}
+	}
+	reply[len] = EOS;
+	if ((cp = strchr(reply, '\n')) == NULL) {
+		goto out;
+	}
+	*cp = EOS;
+	if (sscanf(reply, "%d %d", &rc, badarg) != 2
+	||	(cp = strchr(reply, '\t')) == NULL) {
+		rc = -1;
+		goto out;
+	}
+	snprintf(result, resultlen, "%s\n", cp + 1);
+out:
+	close(sock);
+	return rc;
+}
+
+struct findif_client {
+	int	fd;		/* -1 for a free slot */
+	size_t	len;
+	char	buf[4 * MAXSTR];
+};
+
+/*
+ * Answer one request line.  Returns -1 if the client should be dropped.
+ */
+static int
+DaemonRequest (int fd, char *line)
+{
+	char	*field[5] = { NULL, NULL, NULL, NULL, NULL };
+	char	result[2 * MAXSTR];
+	char	errmsg[MAXSTR];
+	char	reply[4 * MAXSTR];
+	char	*cp, *save = NULL;
+	int	nfields = 0;
+	int	saved_cidr = OutputInCIDR;
+	int	badarg = 1;
+	int	rc;
+	int	n;
+
+	for (cp = strtok_r(line, " \t\r", &save)
+	;	cp != NULL && nfields < 5
+	;	cp = strtok_r(NULL, " \t\r", &save)) {
+		field[nfields++] = strcmp(cp, "-") == 0 ? NULL : cp;
+	}
+	errmsg[0] = EOS;
+	if (nfields != 5) {
+		rc = OCF_ERR_ARGS;
+		snprintf(errmsg, sizeof(errmsg), "Malformed request.");
+	}else{
+		OutputInCIDR = field[0] != NULL;
+		rc = FindInterface(field[1], field[2], field[3], field[4]
+		,	result, sizeof(result), errmsg, sizeof(errmsg)
+		,	&badarg);
+		OutputInCIDR = saved_cidr;
+	}
+	n = snprintf(reply, sizeof(reply), "%d %d\t%s\n", rc, badarg
+	,	one_line(rc == OCF_SUCCESS ? result : errmsg));
+	if (n < 0 || n >= (int)sizeof(reply)) {
+		return -1;
+	}
+	return write(fd, reply, n) == n ? 0 : -1;
+}
+
+/*
+ * Read what a client sent and answer its complete lines.
+ * Returns -1 when the client is gone or misbehaves.
+ */
+static int
+DaemonClient (struct findif_client *cl)
+{
+	char	*nl;
+	ssize_t	n;
+
+	n = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len);
+	if (n <= 0) {
+		return (n < 0 && errno == EAGAIN) ? 0 : -1;
+	}
+	cl->len += n;
+	cl->buf[cl->len] = EOS;
+	while ((nl = strchr(cl->buf, '\n')) != NULL) {
+		size_t	used = nl + 1 - cl->buf;
+
+		*nl = EOS;
+		if (DaemonRequest(cl->fd, cl->buf) < 0) {
+			return -1;
+		}
+		memmove(cl->buf, nl + 1, cl->len - used + 1);
+		cl->len -= used;
+	}
+	/* a line longer than any request */
+	return cl->len == sizeof(cl->buf) - 1 ? -1 : 0;
+}
+
+/*
+ * Load the interfaces and routes from scratch, and replace the cached
+ * ones if that worked.
+ */
+static int
+DaemonResync (struct link_table *links)
+{
+	struct link_table	new_links;
+	struct lpm_table	new_routes;
+	struct lpm_table	new_routes6;
+
+	link_table_init(&new_links);
+	lpm_init(&new_routes, 32);
+	lpm_init(&new_routes6, 128);
+	if (link_table_load(&new_links) < 0
+	||	route_table_load(&new_routes, AF_INET, &new_links) < 0) {
+		link_table_free(&new_links);
+		lpm_free(&new_routes);
+		return -1;
+	}
+	/* no IPv6 on this host: answer IPv6 queries with "no route" */
+	if (route_table_load(&new_routes6, AF_INET6, &new_links) < 0) {
+		lpm_init(&new_routes6, 128);
+	}
+	link_table_free(links);
+	*links = new_links;
+	lpm_free(&route_snapshot);
+	route_snapshot = new_routes;
+	lpm_free(&route_snapshot6);
+	route_snapshot6 = new_routes6;
+	route_snapshot6_loaded = 1;
+	return 0;
+}
+
+/*
+ * Apply the pending notifications.  Returns -1 if the caches have to be
+ * reloaded, because notifications were lost or could not be applied.
+ */
+static int
+DaemonNetlink (int nlsock, struct link_table *links)
+{
+	static char	buf[32768];
+	struct nlmsghdr	*nh;
+	int		resync = 0;
+	int		n;
+
+	while ((n = recv(nlsock, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			/* ENOBUFS: the socket overran, we missed changes */
+			resync = 1;
+			continue;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n)
+		;	nh = NLMSG_NEXT(nh, n)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				if (link_table_update(links, nh) != 0) {
+					resync = 1;
+				}
+				break;
+			case RTM_DELADDR:
+				/* its routes may go without notifications */
+				resync = 1;
+				break;
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				/* each table takes the routes of its family */
+				if (route_table_update(&route_snapshot
+				,	links, nh) < 0
+				||	route_table_update(&route_snapshot6
+				,	links, nh) < 0) {
+					resync = 1;
+				}
+				break;
+			}
+		}
+	}
+	return resync ? -1 : 0;
+}
+
+static volatile sig_atomic_t	daemon_stop = 0;
+
+static void
+daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+static int
+RunDaemon (const char *path)
+{
+	static struct findif_client	clients[MAXCLIENTS];
+	struct pollfd		pfd[MAXCLIENTS + 2];
+	struct sockaddr_un	sun;
+	struct sigaction	sa;
+	int	nlsock, lsock;
+	int	j;
+
+	path = socket_path(path);
+	if (fill_sockaddr(&sun, path) < 0) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return(OCF_ERR_ARGS);
+	}
+
+	/* subscribe first, so no change slips in between dump and loop */
+	if ((nlsock = nl_subscribe(RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE
+	|	RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_LINK)) < 0) {
+		fprintf(stderr, "Cannot open netlink socket: %s\n"
+		,	strerror(errno));
+		return(OCF_ERR_GENERIC);
+	}
+	link_table_init(&link_snapshot);
+	lpm_init(&route_snapshot, 32);
+	lpm_init(&route_snapshot6, 128);
+	if (DaemonResync(&link_snapshot) < 0) {
+		fprintf(stderr, "Cannot load the routing table\n");
+		return(OCF_ERR_GENERIC);
+	}
+	link_cache = &link_snapshot;
+	link_cache_loaded = 1;
+	active_mechs = snapshot_mechs;
+	active6_mechs = snapshot6_mechs;
+
+	unlink(path);
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	||	bind(lsock, (struct sockaddr *)&sun, sizeof(sun)) < 0
+	||	chmod(path, S_IRUSR|S_IWUSR) < 0
+	||	listen(lsock, 16) < 0) {
+		fprintf(stderr, "Cannot listen on %s: %s\n"
+		,	path, strerror(errno));
+		return(OCF_ERR_GENERIC);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	for (j = 0; j < MAXCLIENTS; j++) {
+		clients[j].fd = -1;
+	}
+
+	while (!daemon_stop) {
+		int	nfds = 2;
+
+		pfd[0].fd = nlsock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = lsock;
+		pfd[1].events = POLLIN;
+		for (j = 0; j < MAXCLIENTS; j++) {
+			pfd[j + 2].fd = clients[j].fd;
+			pfd[j + 2].events = POLLIN;
+			pfd[j + 2].revents = 0;
+		}
+		nfds += MAXCLIENTS;
+
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			break;
+		}
+
+		/* bring the tables up to date before answering anyone */
+		if ((pfd[0].revents & POLLIN)
+		&&	DaemonNetlink(nlsock, &link_snapshot) < 0
+		&&	DaemonResync(&link_snapshot) < 0) {
+			fprintf(stderr, "Cannot reload the routing table\n");
+			break;
+		}
+
+		for (j = 0; j < MAXCLIENTS; j++) {
+			struct findif_client	*cl = &clients[j];
+
+			if (cl->fd != -1 && pfd[j + 2].revents
+			&&	DaemonClient(cl) < 0) {
+				close(cl->fd);
+				cl->fd = -1;
+			}
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			int	fd = accept(lsock, NULL, NULL);
+
+			if (fd < 0) {
+				continue;
+			}
+			for (j = 0; j < MAXCLIENTS && clients[j].fd != -1; j++) {
+			}
+			if (j == MAXCLIENTS) {
+				/* busy: the client will do the lookup itself */
+				close(fd);
+				continue;
+			}
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			clients[j].fd = fd;
+			clients[j].len = 0;
+		}
+	}
+
+	for (j = 0; j < MAXCLIENTS; j++) {
+		if (clients[j].fd != -1) {
+			close(clients[j].fd);
+		}
+	}
+	close(lsock);
+	unlink(path);
+	close(nlsock);
+	link_cache = NULL;
+	link_table_free(&link_snapshot);
+	lpm_free(&route_snapshot);
+	lpm_free(&route_snapshot6);
+	return(daemon_stop ? OCF_SUCCESS : OCF_ERR_GENERIC);
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+int
+main(int argc, char ** argv) {
+
+	char *	address = NULL;
+	char *	bcast_arg = NULL;
+	char *	netmaskbits = NULL;
+	char *	if_specified = NULL;
+	char	result[2 * MAXSTR];
+	char	errmsg[MAXSTR];
+	int		argerrs	= 0;
+	int		batch = 0;
+	int		resident = 0;
+	const char *	sockpath = NULL;
+	int		badarg;
+	int		rc;
+	int		c;
+
+	cmdname=argv[0];
+
+	while ((c = getopt(argc, argv, "CbdS:")) != -1) {
+		switch (c) {
+		case 'C':
+			OutputInCIDR=1;
+			break;
+		case 'b':
+			batch=1;
+			break;
+		case 'd':
+			resident=1;
+			break;
+		case 'S':
+			sockpath=optarg;
+			break;
+		default:
+			argerrs=1;
+			break;
+		}
+	}
+	if (optind < argc && !(batch && optind + 1 == argc)) {
+		argerrs=1;
+	}
+	if (batch && resident) {
+		argerrs=1;
+	}
+	if (argerrs) {
+		usage(OCF_ERR_ARGS);
+		/* not reached */
+		return(1);
+	}
+
+	if (batch) {
+		FILE	*fp = stdin;
+
+		if (optind < argc && strcmp(argv[optind], "-") != 0
+		&&	(fp = fopen(argv[optind], "r")) == NULL) {
+			fprintf(stderr, "Cannot open %s: %s\n"
+			,	argv[optind], strerror(errno));
+			return(OCF_ERR_ARGS);
+		}
+		rc = RunBatch(fp);
+		if (fp != stdin) {
+			fclose(fp);
+		}
+		return(rc);
+	}
+
+	if (resident) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+		return(RunDaemon(sockpath));
+#else
+		fprintf(stderr, "Resident mode needs rtnetlink support\n");
+		return(OCF_ERR_UNIMPLEMENTED);
+#endif
+	}
+
+	GetAddress (&address, &netmaskbits, &bcast_arg
+	,	 &if_specified);
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+	rc = QueryDaemon(sockpath, address, netmaskbits, bcast_arg
+	,	if_specified, result, sizeof(result), &badarg);
+	if (rc == OCF_SUCCESS) {
+		fputs(result, stdout);
+		return(0);
+	}
+	if (rc > 0) {
+		fputs(result, stderr);
+		if (badarg) {
+			usage(rc);
+			/* not reached */
+		}
+		return(rc);
+	}
+#endif
+
+	errmsg[0] = EOS;
+	rc = FindInterface(address, netmaskbits, bcast_arg, if_specified
+	,	result, sizeof(result), errmsg, sizeof(errmsg), &badarg);
+	if (rc != OCF_SUCCESS) {
+		if (*errmsg) {
+			fprintf(stderr, "%s", errmsg);
+		}
+		if (badarg) {
+			usage(rc);
+			/* not reached */
+		}
+		return(rc);
+	}
+	fputs(result, stdout);
 	return(0);
 }
 
@@ -750,16 +1838,31 @@ usage(int ec)
 	fprintf(stderr, "\n"
 		"%s version 2.99.1 Copyright Alan Robertson\n"
 		"\n"
-		"Usage: %s [-C]\n"
+		"Usage: %s [-C] [-S socket]\n"
+		"       %s [-C] -b [file]\n"
+		"       %s -d [-S socket]\n"
 		"Options:\n"
 		"    -C: Output netmask as the number of bits rather "
 			"than as 4 octets.\n"
+		"    -b: Batch mode. Read one query per line from file\n"
+		"        (default stdin) as \"ip [cidr_netmask [broadcast [nic]]]\",\n"
+		"        \"-\" meaning omitted, and print one result line per\n"
+		"        query, or \"ERROR <code>\t<message>\". All queries are\n"
+		"        answered from one routing table snapshot.\n"
+		"    -d: Resident mode. Keep the routing table cached, follow\n"
+		"        its changes, and answer the queries of other findif\n"
+		"        runs on the socket, which they try before looking\n"
+		"        routes up themselves.\n"
+		"    -S: Socket of the resident findif (default $FINDIF_SOCKET\n"
+		"        or " FINDIF_SOCKET ").\n"
 		"Environment variables:\n"
-		"OCF_RESKEY_ip		 ip address (mandatory!)\n"
+		"OCF_RESKEY_ip		 ip address (mandatory!), IPv4 or IPv6.\n"
+		"			 For IPv6 the netmask is a prefix length\n"
+		"			 and there is no broadcast address.\n"
 		"OCF_RESKEY_cidr_netmask netmask of interface\n"
 		"OCF_RESKEY_broadcast	 broadcast address for interface\n"
 		"OCF_RESKEY_nic		 interface to assign to\n"
-	,	cmdname, cmdname);
+	,	cmdname, cmdname, cmdname, cmdname);
 	exit(ec);
 }
 
@@ -0,0 +1,329 @@
+/*
+ * findif_bench.c: Route table scale benchmark for findif
+ *
+ *	Generates synthetic route tables in the format of /proc/net/route,
+ *	from a thousand up to a million entries, and times what findif does
+ *	with them when it falls back to the proc file:
+ *
+ *	  - parsing the file with the former fgets/sscanf loop, for reference,
+ *	    and with the bulk parser findif uses;
+ *	  - a lookup as a single findif run does it: load, look up, discard;
+ *	  - a lookup in a loaded snapshot, as batch and resident mode do.
+ *
+ *	The tables are written to files which findif itself reads when
+ *	$FINDIF_PROCROUTE points to them (see -k).
+ *
+ *	Build it with "make findif_bench"; it is not installed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "findif_lpm.h"
+#include "findif_proc.h"
+
+#define	DEFAULT_SIZES	"1000,10000,100000,1000000"
+#define	DEFAULT_QUERIES	100000
+#define	NIFACES		16
+
+static const char *cmdname = "findif_bench";
+
+/* xorshift32: repeatable tables without depending on the libc rand() */
+static unsigned int seed = 2463534242U;
+
+static unsigned int
+next_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/*
+ * Prefix lengths roughly as in a full Internet table: mostly /24, then
+ * /16 to /23, some shorter ones and some host routes.
+ */
+static int
+random_prefixlen(void)
+{
+	unsigned int	r = next_random() % 100;
+
+	if (r < 55) {
+		return 24;
+	}else if (r < 90) {
+		return 16 + next_random() % 8;
+	}else if (r < 95) {
+		return 8 + next_random() % 8;
+	}
+	return 25 + next_random() % 8;
+}
+
+static unsigned long
+prefix_mask(int bits)
+{
+	return bits == 0 ? 0 : 0xffffffffUL << (32 - bits);
+}
+
+/*
+ * Write a table of nroutes routes, plus a default route, as the kernel
+ * formats /proc/net/route.
+ */
+static int
+write_table(const char *path, int nroutes)
+{
+	FILE	*fp;
+	int	j;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "%s: cannot create %s: %s\n"
+		,	cmdname, path, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "%-127s\n", "Iface\tDestination\tGateway \tFlags"
+	"\tRefCnt\tUse\tMetric\tMask\t\tMTU\tWindow\tIRTT");
+	fprintf(fp, "%-127s\n", "eth0\t00000000\t0100000A\t0003\t0\t0\t0"
+	"\t00000000\t0\t0\t0");
+	for (j = 0; j < nroutes; j++) {
+		char		line[128];
+		int		bits = random_prefixlen();
+		unsigned long	mask = prefix_mask(bits);
+		unsigned long	dest = next_random() & mask;
+
+		snprintf(line, sizeof(line)
+		,	"eth%d\t%08lX\t%08lX\t%04X\t%d\t%u\t%d\t%08lX\t%d\t%u\t%u"
+		,	(int)(next_random() % NIFACES)
+		,	(unsigned long)htonl(dest), (unsigned long)htonl(0x0a000001)
+		,	0x0003, 0, 0, (int)(next_random() % 4)
+		,	(unsigned long)htonl(mask), 0, 0, 0);
+		fprintf(fp, "%-127s\n", line);
+	}
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "%s: cannot write %s: %s\n"
+		,	cmdname, path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The parser findif had before: one fgets and one sscanf per line.
+ */
+static int
+sscanf_route_load(struct lpm_table *t, const char *path)
+{
+	unsigned long	flags, refcnt, use, gw, mask, dest;
+	long		metric;
+	char		buf[2048];
+	char		interface[256];
+	FILE		*fp;
+	int		rc = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	if (fgets(buf, sizeof(buf), fp) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		in_addr_t	dest_addr;
+		unsigned long	m;
+		int		bits = 32;
+
+		if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
+		,	interface, &dest, &gw, &flags, &refcnt, &use
+		,	&metric, &mask) != 8) {
+			rc = -1;
+			break;
+		}
+		for (m = ntohl((in_addr_t)mask); m && !(m & 1); m >>= 1) {
+			bits--;
+		}
+		dest_addr = (in_addr_t)dest;
+		if (lpm_insert(t, &dest_addr, mask ? bits : 0, metric
+		,	interface) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+	fclose(fp);
+	return rc;
+}
+
+static double
+now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_size(const char *dir, int nroutes, int nqueries, int keep)
+{
+	char			path[1024];
+	char			errmsg[1024];
+	struct lpm_table	t;
+	in_addr_t		*queries;
+	double			t0, sscanf_ms, load_ms, single_ms, snap_ns;
+	int			found = 0;
+	int			rounds;
+	int			j;
+
+	snprintf(path, sizeof(path), "%s/findif_bench.%d.route", dir, nroutes);
+	if (write_table(path, nroutes) < 0) {
+		return -1;
+	}
+	if ((queries = malloc(nqueries * sizeof(*queries))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", cmdname);
+		return -1;
+	}
+	for (j = 0; j < nqueries; j++) {
+		queries[j] = htonl(next_random());
+	}
+
+	lpm_init(&t, 32);
+	t0 = now();
+	if (sscanf_route_load(&t, path) < 0) {
+		fprintf(stderr, "%s: cannot parse %s\n", cmdname, path);
+		goto fail;
+	}
+	sscanf_ms = (now() - t0) * 1e3;
+	lpm_free(&t);
+
+	t0 = now();
+	if (proc_route_load(&t, path, errmsg, sizeof(errmsg)) < 0) {
+		fprintf(stderr, "%s: %s\n", cmdname, errmsg);
+		goto fail;
+	}
+	load_ms = (now() - t0) * 1e3;
+
+	t0 = now();
+	for (j = 0; j < nqueries; j++) {
+		if (lpm_lookup(&t, &queries[j]) != NULL) {
+			found++;
+		}
+	}
+	snap_ns = (now() - t0) * 1e9 / nqueries;
+	lpm_free(&t);
+
+	/* enough single runs to smooth the small tables out */
+	rounds = nroutes >= 100000 ? 3 : 1000000 / nroutes;
+	t0 = now();
+	for (j = 0; j < rounds; j++) {
+		lpm_init(&t, 32);
+		if (proc_route_load(&t, path, errmsg, sizeof(errmsg)) < 0
+		||	lpm_lookup(&t, &queries[j % nqueries]) == NULL) {
+			fprintf(stderr, "%s: %s\n", cmdname, errmsg);
+			goto fail;
+		}
+		lpm_free(&t);
+	}
+	single_ms = (now() - t0) * 1e3 / rounds;
+
+	printf("%9d %12.2f %12.2f %12.2f %12.1f %9d\n"
+	,	nroutes, sscanf_ms, load_ms, single_ms, snap_ns, found);
+	free(queries);
+	if (!keep) {
+		unlink(path);
+	}
+	return 0;
+
+fail:
+	lpm_free(&t);
+	free(queries);
+	if (!keep) {
+		unlink(path);
+	}
+	return -1;
+}
+
+static void
+usage(int ec)
+{
+	fprintf(stderr, "Usage: %s [-d dir] [-s sizes] [-q queries] [-k]\n"
+		"    -d: directory for the route tables (default /tmp)\n"
+		"    -s: comma separated table sizes (default " DEFAULT_SIZES ")\n"
+		"    -q: lookups per table for the snapshot timing (default %d)\n"
+		"    -k: keep the tables, to run findif against them with\n"
+		"        FINDIF_PROCROUTE=<dir>/findif_bench.<size>.route\n"
+	,	cmdname, DEFAULT_QUERIES);
+	exit(ec);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*dir = "/tmp";
+	char		sizes[1024];
+	char		*cp, *save = NULL;
+	int		nqueries = DEFAULT_QUERIES;
+	int		keep = 0;
+	int		rc = 0;
+	int		c;
+
+	strcpy(sizes, DEFAULT_SIZES);
+	while ((c = getopt(argc, argv, "d:s:q:kh")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			snprintf(sizes, sizeof(sizes), "%s", optarg);
+			break;
+		case 'q':
+			nqueries = atoi(optarg);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+			break;
+		}
+	}
+	if (optind != argc || nqueries <= 0) {
+		usage(1);
+	}
+
+	printf("%9s %12s %12s %12s %12s %9s\n", "routes", "sscanf ms"
+	,	"bulk ms", "single ms", "snapshot ns", "found");
+	for (cp = strtok_r(sizes, ",", &save); cp != NULL
+	;	cp = strtok_r(NULL, ",", &save)) {
+		int	n = atoi(cp);
+
+		if (n <= 0) {
+			fprintf(stderr, "%s: bad size %s\n", cmdname, cp);
+			usage(1);
+		}
+		if (bench_size(dir, n, nqueries, keep) < 0) {
+			rc = 1;
+		}
+		fflush(stdout);
+	}
+	return rc;
+}
@@ -0,0 +1,314 @@
+/*
+ * findif_lpm.c: Longest-prefix-match route index for findif
+ *
+ *	A path-compressed binary (radix) trie over the destination prefixes
+ *	of a route snapshot.  A lookup walks at most one node per distinct
+ *	prefix length on the path to the address, so it picks the most
+ *	specific route in a few dozen memory accesses, whatever the size of
+ *	the table.  Among routes with the same prefix, the lowest metric
+ *	wins; on a tie the route inserted first is kept, as the kernel
+ *	lists the preferred one first.
+ *
+ *	Routes can also be deleted, so that a resident process can follow
+ *	the kernel table.  Nodes left without routes stay in the trie; they
+ *	cost a little memory until the next full reload, not correctness.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include "findif_lpm.h"
+
+/* Value of bit number n (0 is the most significant bit of key[0]) */
+#define KEYBIT(key, n)	(((key)[(n) >> 3] >> (7 - ((n) & 7))) & 1)
+
+/*
+ * Number of leading bits, up to max, which a and b have in common.
+ */
+static int
+common_bits(const unsigned char *a, const unsigned char *b, int max)
+{
+	int	n = 0;
+
+	while (n + 8 <= max && a[n >> 3] == b[n >> 3]) {
+		n += 8;
+	}
+	while (n < max && KEYBIT(a, n) == KEYBIT(b, n)) {
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Copy the first bits bits of src, clearing the rest of the key.
+ */
+static void
+copy_prefix(unsigned char *dst, const unsigned char *src, int bits)
+{
+	int	bytes = bits >> 3;
+
+	memset(dst, 0, LPM_MAXKEY);
+	memcpy(dst, src, bytes);
+	if (bits & 7) {
+		dst[bytes] = src[bytes] & (unsigned char)(0xff << (8 - (bits & 7)));
+	}
+}
+
+static int
+new_node(struct lpm_table *t, const unsigned char *key, int bits)
+{
+	struct lpm_node	*n = &t->nodes[t->nnodes];
+
+	copy_prefix(n->key, key, bits);
+	n->bits = bits;
+	n->child[0] = n->child[1] = -1;
+	n->route = -1;
+	return t->nnodes++;
+}
+
+void
+lpm_init(struct lpm_table *t, int maxbits)
+{
+	memset(t, 0, sizeof(*t));
+	t->maxbits = maxbits;
+	t->root = -1;
+	t->free_routes = -1;
+}
+
+void
+lpm_free(struct lpm_table *t)
+{
+	free(t->nodes);
+	free(t->routes);
+	lpm_init(t, t->maxbits);
+}
+
+/*
+ * Find the node holding exactly the given prefix, or -1.
+ */
+static int
+find_node(const struct lpm_table *t, const unsigned char *key, int prefixlen)
+{
+	int	cur = t->root;
+
+	while (cur != -1) {
+		const struct lpm_node	*n = &t->nodes[cur];
+
+		if (n->bits > prefixlen
+		||	common_bits(key, n->key, n->bits) < n->bits) {
+			return -1;
+		}
+		if (n->bits == prefixlen) {
+			return cur;
+		}
+		cur = n->child[KEYBIT(key, n->bits)];
+	}
+	return -1;
+}
+
+/*
+ * Put route ri into the chain of node ni, after the routes with a lower
+ * or equal metric.  An identical route already there is kept instead.
+ */
+static void
+chain_route(struct lpm_table *t, int ni, int ri)
+{
+	struct lpm_route	*r = &t->routes[ri];
+	int			*link = &t->nodes[ni].route;
+
+	while (*link != -1) {
+		struct lpm_route	*o = &t->routes[*link];
+
+		if (o->metric == r->metric
+		&&	strcmp(o->ifname, r->ifname) == 0) {
+			/* duplicate: give the slot back */
+			r->next = t->free_routes;
+			t->free_routes = ri;
+			return;
+		}
+		if (o->metric > r->metric) {
+			break;
+		}
+		link = &o->next;
+	}
+	r->next = *link;
+	*link = ri;
+}
+
+/*
+ * Add a route to the table.  Adding a route which is already there, with
+ * the same prefix, metric and interface, changes nothing.
+ * Returns 0 on success, -1 if memory is exhausted.
+ */
+int
+lpm_insert(struct lpm_table *t, const void *dest, int prefixlen
+,	long metric, const char *ifname)
+{
+	unsigned char	key[LPM_MAXKEY];
+	struct lpm_route *r;
+	int		ri;
+	int		parent = -1;
+	int		side = 0;
+	int		cur;
+
+	if (prefixlen < 0 || prefixlen > t->maxbits) {
+		return -1;
+	}
+	copy_prefix(key, dest, prefixlen);
+
+	/* An insert creates at most two nodes; make room up front */
+	if (t->nnodes + 2 > t->nodes_alloc) {
+		int	n = t->nodes_alloc ? t->nodes_alloc * 2 : 64;
+		void	*p = realloc(t->nodes, n * sizeof(*t->nodes));
+		if (p == NULL) {
+			return -1;
+		}
+		t->nodes = p;
+		t->nodes_alloc = n;
+	}
+	if (t->free_routes != -1) {
+		ri = t->free_routes;
+		t->free_routes = t->routes[ri].next;
+	}else{
+		if (t->nroutes + 1 > t->routes_alloc) {
+			int	n = t->routes_alloc ? t->routes_alloc * 2 : 32;
+			void	*p = realloc(t->routes, n * sizeof(*t->routes));
+			if (p == NULL) {
+				return -1;
+			}
+			t->routes = p;
+			t->routes_alloc = n;
+		}
+		ri = t->nroutes++;
+	}
+
+	r = &t->routes[ri];
+	memcpy(r->dest, key, sizeof(r->dest));
+	r->prefixlen = prefixlen;
+	r->metric = metric;
+	strncpy(r->ifname, ifname, sizeof(r->ifname));
+	r->ifname[sizeof(r->ifname) - 1] = '\0';
+	r->next = -1;
+
+	cur = t->root;
+	while (cur != -1) {
+		struct lpm_node	*n = &t->nodes[cur];
+		int		max = n->bits < prefixlen ? n->bits : prefixlen;
+		int		common = common_bits(key, n->key, max);
+
+		if (common < n->bits) {
+			/* key leaves the path inside this node: split it */
+			int	split = new_node(t, key, common);
+			n = &t->nodes[cur];
+			t->nodes[split].child[KEYBIT(n->key, common)] = cur;
+			if (common == prefixlen) {
+				t->nodes[split].route = ri;
+			} else {
+				int leaf = new_node(t, key, prefixlen);
+				t->nodes[leaf].route = ri;
+				t->nodes[split].child[KEYBIT(key, common)] = leaf;
+			}
+			cur = split;
+			goto link;
+		}
+		if (n->bits == prefixlen) {
+			chain_route(t, cur, ri);
+			return 0;
+		}
+		parent = cur;
+		side = KEYBIT(key, n->bits);
+		cur = n->child[side];
+	}
+	cur = new_node(t, key, prefixlen);
+	t->nodes[cur].route = ri;
+
+link:
+	if (parent == -1) {
+		t->root = cur;
+	}else{
+		t->nodes[parent].child[side] = cur;
+	}
+	return 0;
+}
+
+/*
+ * Remove the routes with the given prefix and metric, and, unless ifname
+ * is NULL, interface.
+ * Returns the number of routes removed.
+ */
+int
+lpm_delete(struct lpm_table *t, const void *dest, int prefixlen
+,	long metric, const char *ifname)
+{
+	unsigned char	key[LPM_MAXKEY];
+	int		*link;
+	int		ni;
+	int		removed = 0;
+
+	if (prefixlen < 0 || prefixlen > t->maxbits) {
+		return 0;
+	}
+	copy_prefix(key, dest, prefixlen);
+	if ((ni = find_node(t, key, prefixlen)) == -1) {
+		return 0;
+	}
+
+	link = &t->nodes[ni].route;
+	while (*link != -1) {
+		int			ri = *link;
+		struct lpm_route	*r = &t->routes[ri];
+
+		if (r->metric == metric
+		&&	(ifname == NULL || strcmp(r->ifname, ifname) == 0)) {
+			*link = r->next;
+			r->next = t->free_routes;
+			t->free_routes = ri;
+			removed++;
+			continue;
+		}
+		link = &r->next;
+	}
+	return removed;
+}
+
+/*
+ * Find the most specific route covering addr.
+ * Returns NULL if no route matches.
+ */
+const struct lpm_route *
+lpm_lookup(const struct lpm_table *t, const void *addr)
+{
+	const unsigned char	*key = addr;
+	int			best = -1;
+	int			cur = t->root;
+
+	while (cur != -1) {
+		const struct lpm_node	*n = &t->nodes[cur];
+
+		if (common_bits(key, n->key, n->bits) < n->bits) {
+			break;
+		}
+		if (n->route != -1) {
+			best = n->route;
+		}
+		if (n->bits >= t->maxbits) {
+			break;
+		}
+		cur = n->child[KEYBIT(key, n->bits)];
+	}
+	return best == -1 ? NULL : &t->routes[best];
+}
@@ -0,0 +1,73 @@
+/*
+ * findif_lpm.h: Longest-prefix-match route index for findif
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef FINDIF_LPM_H
+#define FINDIF_LPM_H
+
+#include <stddef.h>
+#include <net/if.h>
+
+#define LPM_MAXKEY	16	/* bytes, large enough for an IPv6 address */
+
+/*
+ * One route of a snapshot.  dest holds the destination in network byte
+ * order; only the first prefixlen bits are significant.
+ */
+struct lpm_route {
+	unsigned char	dest[LPM_MAXKEY];
+	int		prefixlen;
+	long		metric;
+	char		ifname[IF_NAMESIZE];
+	int		next;		/* next route of the same prefix, or -1 */
+};
+
+/*
+ * Node of the path-compressed binary trie.  Nodes and routes are kept in
+ * arrays and refer to each other by index, so that a whole snapshot is a
+ * handful of allocations, however many routes it has.
+ */
+struct lpm_node {
+	unsigned char	key[LPM_MAXKEY];
+	int		bits;		/* length of the prefix of this node */
+	int		child[2];	/* next bit 0 / 1, or -1 */
+	int		route;		/* routes for exactly this prefix, sorted
+					   by metric, or -1 */
+};
+
+struct lpm_table {
+	int		maxbits;	/* 32 for IPv4, 128 for IPv6 */
+	int		root;
+	struct lpm_node	*nodes;
+	int		nnodes;
+	int		nodes_alloc;
+	struct lpm_route *routes;
+	int		nroutes;	/* used slots of routes[] */
+	int		routes_alloc;
+	int		free_routes;	/* chain of deleted route slots */
+};
+
+void lpm_init(struct lpm_table *t, int maxbits);
+void lpm_free(struct lpm_table *t);
+int lpm_insert(struct lpm_table *t, const void *dest, int prefixlen
+,	long metric, const char *ifname);
+int lpm_delete(struct lpm_table *t, const void *dest, int prefixlen
+,	long metric, const char *ifname);
+const struct lpm_route *lpm_lookup(const struct lpm_table *t
+,	const void *addr);
+
+#endif /* FINDIF_LPM_H */
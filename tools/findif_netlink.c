@@ -0,0 +1,571 @@
+/*
+ * findif_netlink.c: rtnetlink backed route and link tables for findif
+ *
+ *	The tables are filled by one RTM_GETROUTE / RTM_GETLINK dump each,
+ *	and can then be kept current from the RTM_NEWROUTE, RTM_DELROUTE,
+ *	RTM_NEWLINK and RTM_DELLINK notifications of the kernel.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "findif_netlink.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <netinet/in.h>
+
+/*
+ * Send a netlink dump request and pass every answer message to cb.
+ * hdr is the family specific header of the request (rtmsg, ifinfomsg...),
+ * of which usually only the family is set.
+ *
+ * Returns 0 when the dump is complete, -1 if netlink is not usable or the
+ * dump failed, or the first nonzero value returned by cb.
+ */
+int
+nl_dump(int type, const void *hdr, size_t hdrlen
+,	nl_callback *cb, void *arg)
+{
+	struct {
+		struct nlmsghdr	nh;
+		char		body[64];
+	} req;
+	struct sockaddr_nl	sanl;
+	char			buf[32768];
+	int			sock;
+	int			rc = -1;
+
+	if (hdrlen > sizeof(req.body)) {
+		return -1;
+	}
+	if ((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(hdrlen);
+	req.nh.nlmsg_type = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = 1;
+	memcpy(req.body, hdr, hdrlen);
+
+	memset(&sanl, 0, sizeof(sanl));
+	sanl.nl_family = AF_NETLINK;
+	if (sendto(sock, &req, req.nh.nlmsg_len, 0
+	,	(struct sockaddr *)&sanl, sizeof(sanl)) < 0) {
+		goto out;
+	}
+
+	while (1) {
+		struct nlmsghdr	*nh;
+		ssize_t		len;
+
+		len = recv(sock, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto out;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)len)
+		;	nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				rc = 0;
+				goto out;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				goto out;
+			}
+			if ((rc = cb(nh, arg)) != 0) {
+				goto out;
+			}
+			rc = -1;
+		}
+	}
+
+  out:
+	close(sock);
+	return rc;
+}
+
+/*
+ * Open a netlink socket receiving the notifications of the given
+ * RTMGRP_* groups.  Returns the socket, or -1.
+ */
+int
+nl_subscribe(unsigned int groups)
+{
+	struct sockaddr_nl	sanl;
+	int			rcvbuf = 4 * 1024 * 1024;
+	int			sock;
+
+	if ((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		return -1;
+	}
+	/* route churn comes in bursts; an overrun costs a full reload */
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&sanl, 0, sizeof(sanl));
+	sanl.nl_family = AF_NETLINK;
+	sanl.nl_groups = groups;
+	if (bind(sock, (struct sockaddr *)&sanl, sizeof(sanl)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Link table
+ */
+
+static unsigned int
+name_hash(const char *name)
+{
+	unsigned int	h = 2166136261U;	/* FNV-1a */
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	}
+	return h;
+}
+
+void
+link_table_init(struct link_table *lt)
+{
+	memset(lt, 0, sizeof(*lt));
+	lt->free_links = -1;
+}
+
+void
+link_table_free(struct link_table *lt)
+{
+	free(lt->links);
+	free(lt->name_hash);
+	free(lt->index_hash);
+	link_table_init(lt);
+}
+
+/*
+ * (Re)build both hash tables with nbuckets buckets.
+ */
+static int
+link_rehash(struct link_table *lt, int nbuckets)
+{
+	int	*nh = malloc(nbuckets * sizeof(int));
+	int	*ih = malloc(nbuckets * sizeof(int));
+	int	i;
+
+	if (nh == NULL || ih == NULL) {
+		free(nh);
+		free(ih);
+		return -1;
+	}
+	for (i = 0; i < nbuckets; i++) {
+		nh[i] = ih[i] = -1;
+	}
+	for (i = 0; i < lt->nlinks; i++) {
+		struct link_entry	*l = &lt->links[i];
+		unsigned int		b;
+
+		if (l->index == 0) {
+			continue;
+		}
+		b = name_hash(l->name) & (nbuckets - 1);
+		l->next_name = nh[b];
+		nh[b] = i;
+		b = (unsigned int)l->index & (nbuckets - 1);
+		l->next_index = ih[b];
+		ih[b] = i;
+	}
+	free(lt->name_hash);
+	free(lt->index_hash);
+	lt->name_hash = nh;
+	lt->index_hash = ih;
+	lt->nbuckets = nbuckets;
+	return 0;
+}
+
+static int
+link_find_index(const struct link_table *lt, int index)
+{
+	int	i;
+
+	if (lt->nbuckets == 0) {
+		return -1;
+	}
+	for (i = lt->index_hash[(unsigned int)index & (lt->nbuckets - 1)]
+	;	i != -1; i = lt->links[i].next_index) {
+		if (lt->links[i].index == index) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const struct link_entry *
+link_by_index(const struct link_table *lt, int index)
+{
+	int	i = link_find_index(lt, index);
+
+	return i == -1 ? NULL : &lt->links[i];
+}
+
+const struct link_entry *
+link_by_name(const struct link_table *lt, const char *name)
+{
+	int	i;
+
+	if (lt->nbuckets == 0) {
+		return NULL;
+	}
+	for (i = lt->name_hash[name_hash(name) & (lt->nbuckets - 1)]
+	;	i != -1; i = lt->links[i].next_name) {
+		if (strncmp(lt->links[i].name, name, IF_NAMESIZE) == 0) {
+			return &lt->links[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The interface with the lowest index which has all the given IFF_*
+ * flags, such as the first loopback device.
+ */
+const struct link_entry *
+link_by_flags(const struct link_table *lt, unsigned int flags)
+{
+	const struct link_entry	*best = NULL;
+	int			i;
+
+	for (i = 0; i < lt->nlinks; i++) {
+		const struct link_entry	*l = &lt->links[i];
+
+		if (l->index != 0 && (l->flags & flags) == flags
+		&&	(best == NULL || l->index < best->index)) {
+			best = l;
+		}
+	}
+	return best;
+}
+
+/*
+ * Remove entry i from the chain starting at *head, linked by the field
+ * at offset off of the entries.
+ */
+static void
+link_unchain(struct link_table *lt, int *head, int i, size_t off)
+{
+	while (*head != -1) {
+		int	*next = (int *)((char *)&lt->links[*head] + off);
+
+		if (*head == i) {
+			*head = *next;
+			return;
+		}
+		head = next;
+	}
+}
+
+static void
+link_remove(struct link_table *lt, int i)
+{
+	struct link_entry	*l = &lt->links[i];
+
+	link_unchain(lt, &lt->name_hash[name_hash(l->name) & (lt->nbuckets - 1)]
+	,	i, offsetof(struct link_entry, next_name));
+	link_unchain(lt, &lt->index_hash[(unsigned int)l->index & (lt->nbuckets - 1)]
+	,	i, offsetof(struct link_entry, next_index));
+	l->index = 0;
+	l->next_index = lt->free_links;
+	lt->free_links = i;
+}
+
+static int
+link_add(struct link_table *lt, int index, unsigned int flags
+,	const char *name)
+{
+	struct link_entry	*l;
+	unsigned int		b;
+	int			i;
+
+	if (lt->nlinks + 1 > 2 * lt->nbuckets
+	&&	link_rehash(lt, lt->nbuckets ? 2 * lt->nbuckets : 64) < 0) {
+		return -1;
+	}
+	if (lt->free_links != -1) {
+		i = lt->free_links;
+		lt->free_links = lt->links[i].next_index;
+	}else{
+		if (lt->nlinks + 1 > lt->links_alloc) {
+			int	n = lt->links_alloc ? 2 * lt->links_alloc : 64;
+			void	*p = realloc(lt->links, n * sizeof(*lt->links));
+			if (p == NULL) {
+				return -1;
+			}
+			lt->links = p;
+			lt->links_alloc = n;
+		}
+		i = lt->nlinks++;
+	}
+
+	l = &lt->links[i];
+	l->index = index;
+	l->flags = flags;
+	strncpy(l->name, name, sizeof(l->name));
+	l->name[sizeof(l->name) - 1] = '\0';
+	b = name_hash(l->name) & (lt->nbuckets - 1);
+	l->next_name = lt->name_hash[b];
+	lt->name_hash[b] = i;
+	b = (unsigned int)index & (lt->nbuckets - 1);
+	l->next_index = lt->index_hash[b];
+	lt->index_hash[b] = i;
+	return 0;
+}
+
+/*
+ * Apply an RTM_NEWLINK or RTM_DELLINK message to the table.
+ * Returns 1 if an interface went away, was renamed (so that names
+ * derived from the table may be stale) or went up or down (the kernel
+ * flushes the IPv4 routes of a link going down without RTM_DELROUTE),
+ * 0 otherwise, -1 if memory is exhausted.
+ */
+int
+link_table_update(struct link_table *lt, struct nlmsghdr *nh)
+{
+	struct ifinfomsg	*ifi = NLMSG_DATA(nh);
+	struct rtattr		*rta;
+	int			attrlen = IFLA_PAYLOAD(nh);
+	const char		*name = NULL;
+	int			i;
+
+	if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK) {
+		return 0;
+	}
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			name = RTA_DATA(rta);
+		}
+	}
+
+	i = link_find_index(lt, ifi->ifi_index);
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		if (i == -1) {
+			return 0;
+		}
+		link_remove(lt, i);
+		return 1;
+	}
+	if (name == NULL) {
+		return 0;
+	}
+	if (i != -1) {
+		if (strncmp(lt->links[i].name, name, IF_NAMESIZE) == 0) {
+			unsigned int	changed = lt->links[i].flags
+			^	ifi->ifi_flags;
+
+			lt->links[i].flags = ifi->ifi_flags;
+			return (changed & (IFF_UP|IFF_RUNNING)) != 0;
+		}
+		link_remove(lt, i);
+		return link_add(lt, ifi->ifi_index, ifi->ifi_flags, name) < 0
+		?	-1 : 1;
+	}
+	return link_add(lt, ifi->ifi_index, ifi->ifi_flags, name);
+}
+
+static int
+link_dump_cb(struct nlmsghdr *nh, void *arg)
+{
+	return link_table_update(arg, nh) < 0;
+}
+
+/*
+ * Fill the table with one RTM_GETLINK dump.
+ * Returns 0, or -1 if netlink cannot be used.
+ */
+int
+link_table_load(struct link_table *lt)
+{
+	struct ifinfomsg	ifi;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	if (nl_dump(RTM_GETLINK, &ifi, sizeof(ifi), link_dump_cb, lt) != 0) {
+		link_table_free(lt);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Route table
+ */
+
+/*
+ * Interface names of the routes when there is no link table.  Routes
+ * come grouped by interface, so a small direct-mapped cache saves almost
+ * every if_indextoname() call.
+ */
+#define	IFNAME_CACHE	64
+static int	cache_index[IFNAME_CACHE];
+static char	cache_name[IFNAME_CACHE][IF_NAMESIZE];
+
+static const char *
+route_ifname(struct link_table *lt, int ifindex)
+{
+	int	slot = ifindex % IFNAME_CACHE;
+
+	if (lt != NULL) {
+		const struct link_entry	*l = link_by_index(lt, ifindex);
+		return l ? l->name : NULL;
+	}
+	if (cache_index[slot] != ifindex) {
+		if (if_indextoname(ifindex, cache_name[slot]) == NULL) {
+			return NULL;
+		}
+		cache_index[slot] = ifindex;
+	}
+	return cache_name[slot];
+}
+
+/*
+ * Decode a route message.  Returns 1 for a unicast route of the main
+ * table of the family of t, 0 for anything else.
+ */
+static int
+parse_route(const struct lpm_table *t, struct nlmsghdr *nh
+,	unsigned char *dest, long *metric, int *oif)
+{
+	struct rtmsg	*rtm = NLMSG_DATA(nh);
+	struct rtattr	*rta;
+	int		attrlen = RTM_PAYLOAD(nh);
+	unsigned int	table = rtm->rtm_table;
+	int		family = t->maxbits == 32 ? AF_INET : AF_INET6;
+
+	if (rtm->rtm_family != family || rtm->rtm_type != RTN_UNICAST) {
+		return 0;
+	}
+	memset(dest, 0, LPM_MAXKEY);
+	*metric = 0;
+	*oif = 0;
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case RTA_DST:
+			if (RTA_PAYLOAD(rta) <= LPM_MAXKEY) {
+				memcpy(dest, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			}
+			break;
+		case RTA_OIF:
+			*oif = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_PRIORITY:
+			*metric = *(unsigned int *)RTA_DATA(rta);
+			break;
+		case RTA_TABLE:
+			table = *(unsigned int *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			/* use the first nexthop */
+			if (*oif == 0 && RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+				*oif = ((struct rtnexthop *)RTA_DATA(rta))->rtnh_ifindex;
+			}
+			break;
+		}
+	}
+	/* the same view as /proc/net/route: the main table only */
+	return table == RT_TABLE_MAIN;
+}
+
+/*
+ * Apply an RTM_NEWROUTE or RTM_DELROUTE message to the table.
+ * Returns 0, or -1 if memory is exhausted.
+ */
+int
+route_table_update(struct lpm_table *t, struct link_table *lt
+,	struct nlmsghdr *nh)
+{
+	struct rtmsg	*rtm = NLMSG_DATA(nh);
+	unsigned char	dest[LPM_MAXKEY];
+	const char	*ifname;
+	long		metric;
+	int		oif;
+
+	if ((nh->nlmsg_type != RTM_NEWROUTE && nh->nlmsg_type != RTM_DELROUTE)
+	||	!parse_route(t, nh, dest, &metric, &oif)) {
+		return 0;
+	}
+	ifname = oif ? route_ifname(lt, oif) : NULL;
+
+	if (nh->nlmsg_type == RTM_DELROUTE) {
+		lpm_delete(t, dest, rtm->rtm_dst_len, metric, ifname);
+		return 0;
+	}
+	if (ifname == NULL) {
+		return 0;
+	}
+	if (nh->nlmsg_flags & NLM_F_REPLACE) {
+		lpm_delete(t, dest, rtm->rtm_dst_len, metric, NULL);
+	}
+	return lpm_insert(t, dest, rtm->rtm_dst_len, metric, ifname);
+}
+
+struct route_dump {
+	struct lpm_table	*table;
+	struct link_table	*links;
+};
+
+static int
+route_dump_cb(struct nlmsghdr *nh, void *arg)
+{
+	struct route_dump	*rd = arg;
+
+	return route_table_update(rd->table, rd->links, nh) < 0;
+}
+
+/*
+ * Fill the table with the routes of the main table of the family, from
+ * one RTM_GETROUTE dump.
+ * Returns 0, or -1 if netlink cannot be used.
+ */
+int
+route_table_load(struct lpm_table *t, int family, struct link_table *lt)
+{
+	struct route_dump	rd;
+	struct rtmsg		rtm;
+	int			i;
+
+	for (i = 0; i < IFNAME_CACHE; i++) {
+		cache_index[i] = -1;
+	}
+	rd.table = t;
+	rd.links = lt;
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = family;
+	if (nl_dump(RTM_GETROUTE, &rtm, sizeof(rtm), route_dump_cb, &rd) != 0) {
+		lpm_free(t);
+		return -1;
+	}
+	return 0;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
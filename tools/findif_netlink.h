@@ -0,0 +1,83 @@
+/*
+ * findif_netlink.h: rtnetlink backed route and link tables for findif
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef FINDIF_NETLINK_H
+#define FINDIF_NETLINK_H
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include "findif_lpm.h"
+
+/*
+ * Callback for every message of a dump.  A nonzero return value stops
+ * the dump and is returned by nl_dump().
+ */
+typedef int nl_callback (struct nlmsghdr *nh, void *arg);
+
+int nl_dump(int type, const void *hdr, size_t hdrlen
+,	nl_callback *cb, void *arg);
+int nl_subscribe(unsigned int groups);
+
+/*
+ * The interfaces of the host, looked up by name or by index through two
+ * hash tables over one array of entries.
+ */
+struct link_entry {
+	int		index;		/* 0 for a free entry */
+	unsigned int	flags;		/* IFF_* */
+	char		name[IF_NAMESIZE];
+	int		next_name;	/* chain of the name bucket, or -1 */
+	int		next_index;	/* chain of the index bucket, or -1 */
+};
+
+struct link_table {
+	struct link_entry *links;
+	int		nlinks;		/* used slots of links[] */
+	int		links_alloc;
+	int		free_links;	/* chain of free slots, by next_index */
+	int		*name_hash;
+	int		*index_hash;
+	int		nbuckets;	/* a power of two */
+};
+
+void link_table_init(struct link_table *lt);
+void link_table_free(struct link_table *lt);
+int link_table_load(struct link_table *lt);
+int link_table_update(struct link_table *lt, struct nlmsghdr *nh);
+const struct link_entry *link_by_name(const struct link_table *lt
+,	const char *name);
+const struct link_entry *link_by_index(const struct link_table *lt
+,	int index);
+const struct link_entry *link_by_flags(const struct link_table *lt
+,	unsigned int flags);
+
+/*
+ * Route tables follow the main routing table, like /proc/net/route does.
+ * Interface names come from lt when it is given, else from the kernel.
+ */
+int route_table_load(struct lpm_table *t, int family, struct link_table *lt);
+int route_table_update(struct lpm_table *t, struct link_table *lt
+,	struct nlmsghdr *nh);
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
+#endif /* FINDIF_NETLINK_H */
@@ -0,0 +1,396 @@
+/*
+ * findif_proc.c: /proc/net/route and ipv6_route readers for findif
+ *
+ *	The fallback for hosts where netlink cannot be used.  On a host with
+ *	a full routing table the file has hundreds of thousands of lines, so
+ *	it is taken in with one bulk read (or mapped, for a regular file)
+ *	and the fields are decoded in place, without stdio or sscanf, and
+ *	without any allocation per line.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "findif_proc.h"
+
+#define	READ_CHUNK	65536
+
+/*
+ * The contents of a file, mapped or read into memory.
+ */
+struct proc_file {
+	char	*data;
+	size_t	len;
+	int	mapped;
+};
+
+/*
+ * Files of /proc have no size, and are read in one pass into a buffer
+ * grown as needed; anything else (a saved or synthetic table) is mapped.
+ */
+static int
+proc_file_open(struct proc_file *f, const char *path)
+{
+	struct stat	st;
+	size_t		alloc = 0;
+	ssize_t		n;
+	int		fd;
+
+	memset(f, 0, sizeof(*f));
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		f->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (f->data != MAP_FAILED) {
+			f->len = st.st_size;
+			f->mapped = 1;
+			close(fd);
+			return 0;
+		}
+		f->data = NULL;
+	}
+	for (;;) {
+		if (f->len == alloc) {
+			char	*p;
+
+			alloc = alloc ? 2 * alloc : READ_CHUNK;
+			if ((p = realloc(f->data, alloc)) == NULL) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			f->data = p;
+		}
+		n = read(fd, f->data + f->len, alloc - f->len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		}
+		if (n == 0) {
+			break;
+		}
+		f->len += n;
+	}
+	close(fd);
+	return 0;
+
+fail:
+	n = errno;
+	free(f->data);
+	f->data = NULL;
+	close(fd);
+	errno = n;
+	return -1;
+}
+
+static void
+proc_file_close(struct proc_file *f)
+{
+	if (f->mapped) {
+		munmap(f->data, f->len);
+	}else{
+		free(f->data);
+	}
+	memset(f, 0, sizeof(*f));
+}
+
+static int
+is_blank(int c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static int
+hex_digit(int c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/*
+ * Decode the next blank separated field of the line ending at end as a
+ * number in the given base (16 or 10).  Returns 0, or -1 if there is no
+ * number there.
+ */
+static int
+number_field(const char **pp, const char *end, int base, unsigned long *val)
+{
+	const char	*p = *pp;
+	unsigned long	v = 0;
+	int		neg = 0;
+	int		digits = 0;
+
+	while (p < end && is_blank(*p)) {
+		p++;
+	}
+	if (base == 10 && p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	for (; p < end; p++, digits++) {
+		int	d = hex_digit(*p);
+
+		if (d < 0 || d >= base) {
+			break;
+		}
+		v = v * base + d;
+	}
+	if (digits == 0 || (p < end && !is_blank(*p))) {
+		return -1;
+	}
+	*val = neg ? -v : v;
+	*pp = p;
+	return 0;
+}
+
+/* Length of a netmask in network byte order */
+static int
+mask_bits(unsigned long mask)
+{
+	unsigned long	m = ntohl((in_addr_t)mask);
+	int		bits = 32;
+
+	if (m == 0) {
+		return 0;
+	}
+	while (!(m & 1)) {
+		m >>= 1;
+		bits--;
+	}
+	return bits;
+}
+
+/*
+ * Decode one route line:
+ *
+ *	Iface Destination Gateway Flags RefCnt Use Metric Mask MTU Window IRTT
+ *
+ * with the addresses and the flags in hex, the rest in decimal.
+ */
+static int
+parse_route_line(struct lpm_table *t, const char *line, const char *end)
+{
+	char		ifname[IF_NAMESIZE];
+	unsigned long	dest, gw, flags, refcnt, use, metric, mask;
+	const char	*p = line;
+	in_addr_t	dest_addr;
+	size_t		len;
+
+	while (p < end && !is_blank(*p)) {
+		p++;
+	}
+	len = p - line;
+	if (len == 0 || len >= sizeof(ifname)) {
+		return -1;
+	}
+	memcpy(ifname, line, len);
+	ifname[len] = '\0';
+
+	if (number_field(&p, end, 16, &dest) < 0
+	||	number_field(&p, end, 16, &gw) < 0
+	||	number_field(&p, end, 16, &flags) < 0
+	||	number_field(&p, end, 10, &refcnt) < 0
+	||	number_field(&p, end, 10, &use) < 0
+	||	number_field(&p, end, 10, &metric) < 0
+	||	number_field(&p, end, 16, &mask) < 0) {
+		return -1;
+	}
+	/* dest and mask are in network byte order */
+	dest_addr = (in_addr_t)dest;
+	if (lpm_insert(t, &dest_addr, mask_bits(mask), (long)metric
+	,	ifname) < 0) {
+		errno = ENOMEM;
+		return -2;
+	}
+	return 0;
+}
+
+/*
+ * Decode the next field as exactly n bytes of hex, such as the 32 digits
+ * of an IPv6 address in /proc/net/ipv6_route.
+ */
+static int
+hex_bytes_field(const char **pp, const char *end, unsigned char *out, int n)
+{
+	const char	*p = *pp;
+	int		j;
+
+	while (p < end && is_blank(*p)) {
+		p++;
+	}
+	if (end - p < 2 * n) {
+		return -1;
+	}
+	for (j = 0; j < n; j++, p += 2) {
+		int	hi = hex_digit(p[0]);
+		int	lo = hex_digit(p[1]);
+
+		if (hi < 0 || lo < 0) {
+			return -1;
+		}
+		out[j] = (unsigned char)(hi << 4 | lo);
+	}
+	if (p < end && !is_blank(*p)) {
+		return -1;
+	}
+	*pp = p;
+	return 0;
+}
+
+/*
+ * Decode one line of /proc/net/ipv6_route:
+ *
+ *	dest dest_plen src src_plen nexthop metric refcnt use flags iface
+ *
+ * all in hex.  The file shows every table, so local, anycast and reject
+ * routes, which are not what an address would be configured on, and
+ * cached clones are skipped.
+ */
+#define	RTF6_REJECT	0x00000200
+#define	RTF6_ANYCAST	0x00100000
+#define	RTF6_CACHE	0x01000000
+#define	RTF6_LOCAL	0x80000000
+
+static int
+parse_route6_line(struct lpm_table *t, const char *line, const char *end)
+{
+	unsigned char	dest[16], src[16], gw[16];
+	char		ifname[IF_NAMESIZE];
+	unsigned long	plen, src_plen, metric, refcnt, use, flags;
+	const char	*p = line;
+	const char	*name;
+	size_t		len;
+
+	if (hex_bytes_field(&p, end, dest, 16) < 0
+	||	number_field(&p, end, 16, &plen) < 0
+	||	hex_bytes_field(&p, end, src, 16) < 0
+	||	number_field(&p, end, 16, &src_plen) < 0
+	||	hex_bytes_field(&p, end, gw, 16) < 0
+	||	number_field(&p, end, 16, &metric) < 0
+	||	number_field(&p, end, 16, &refcnt) < 0
+	||	number_field(&p, end, 16, &use) < 0
+	||	number_field(&p, end, 16, &flags) < 0
+	||	plen > 128) {
+		return -1;
+	}
+	while (p < end && is_blank(*p)) {
+		p++;
+	}
+	for (name = p; p < end && !is_blank(*p); p++) {
+	}
+	len = p - name;
+	if (len == 0 || len >= sizeof(ifname)) {
+		return -1;
+	}
+	if (flags & (RTF6_REJECT|RTF6_ANYCAST|RTF6_CACHE|RTF6_LOCAL)) {
+		return 0;
+	}
+	memcpy(ifname, name, len);
+	ifname[len] = '\0';
+	if (lpm_insert(t, dest, (int)plen, (long)metric, ifname) < 0) {
+		errno = ENOMEM;
+		return -2;
+	}
+	return 0;
+}
+
+typedef int route_line_parser (struct lpm_table *t, const char *line
+,	const char *end);
+
+static int
+proc_load(struct lpm_table *t, const char *path, int header
+,	route_line_parser *parse, char *errmsg, int errmsglen)
+{
+	struct proc_file	f;
+	const char		*line, *end, *nl;
+	int			rc = 0;
+
+	if (proc_file_open(&f, path) < 0) {
+		snprintf(errmsg, errmsglen, "Cannot open %s for reading", path);
+		return -1;
+	}
+	end = f.data + f.len;
+	nl = f.data - 1;
+
+	/* Skip first (header) line */
+	if (header && (nl = memchr(f.data, '\n', f.len)) == NULL) {
+		snprintf(errmsg, errmsglen
+		,	"Cannot skip first line from %s", path);
+		rc = -1;
+		goto out;
+	}
+	for (line = nl + 1; line < end; line = nl + 1) {
+		const char	*eol;
+
+		if ((nl = memchr(line, '\n', end - line)) == NULL) {
+			nl = end;
+		}
+		/* the kernel pads the lines with blanks */
+		for (eol = nl; eol > line && is_blank(eol[-1]); eol--) {
+		}
+		if (eol == line) {
+			continue;
+		}
+		switch (parse(t, line, eol)) {
+		case 0:
+			break;
+		case -1:
+			snprintf(errmsg, errmsglen, "Bad line in %s: %.*s"
+			,	path, (int)(eol - line), line);
+			rc = -1;
+			goto out;
+		default:
+			snprintf(errmsg, errmsglen, "Out of memory");
+			rc = -1;
+			goto out;
+		}
+	}
+
+out:
+	proc_file_close(&f);
+	return rc;
+}
+
+int
+proc_route_load(struct lpm_table *t, const char *path
+,	char *errmsg, int errmsglen)
+{
+	return proc_load(t, path, 1, parse_route_line, errmsg, errmsglen);
+}
+
+int
+proc_route6_load(struct lpm_table *t, const char *path
+,	char *errmsg, int errmsglen)
+{
+	return proc_load(t, path, 0, parse_route6_line, errmsg, errmsglen);
+}
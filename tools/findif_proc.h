@@ -0,0 +1,38 @@
+/*
+ * findif_proc.h: /proc/net/route and ipv6_route readers for findif
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef FINDIF_PROC_H
+#define FINDIF_PROC_H
+
+#include "findif_lpm.h"
+
+/*
+ * Load the routes of a file in the format of /proc/net/route into t.
+ * Returns 0, or -1 with errmsg filled in.
+ */
+int proc_route_load(struct lpm_table *t, const char *path
+,	char *errmsg, int errmsglen);
+
+/*
+ * The same for a file in the format of /proc/net/ipv6_route, into a table
+ * of 128 bit keys.
+ */
+int proc_route6_load(struct lpm_table *t, const char *path
+,	char *errmsg, int errmsglen);
+
+#endif /* FINDIF_PROC_H */
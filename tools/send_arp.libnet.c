@@ -43,9 +43,9 @@
 #include <limits.h>
 #include <libnet.h>
 #include <libgen.h>
-#include <clplumbing/timers.h>
 #include <clplumbing/cl_signal.h>
 #include <clplumbing/cl_log.h>
+#include "send_arp_sched.h"
 
 #ifdef HAVE_LIBNET_1_0_API
 #	define	LTYPE	struct libnet_link_int
@@ -57,13 +57,51 @@
 #define PIDDIR       HA_VARRUNDIR "/" PACKAGE "/rsctmp/send_arp"
 #define PIDFILE_BASE PIDDIR "/send_arp-"
 
-static int send_arp(LTYPE* l, u_long ip, u_char *device, u_char mac[6]
-,	u_char *broadcast, u_char *netmask, u_short arptype);
+/*
+ * An Ethernet ARP frame: the Ethernet header, then the ARP header with the
+ * sender and target addresses.  Room is left for a link layer which pads
+ * to the Ethernet minimum.
+ */
+#define ARP_FRAME_MAX	64
+#define ARP_SPA_OFFSET	(LIBNET_ETH_H + 14)	/* sender protocol address */
+#define ARP_TPA_OFFSET	(LIBNET_ETH_H + 24)	/* target protocol address */
+
+enum { FRAME_REQUEST, FRAME_REPLY };
+
+static int build_arp(LTYPE* l, u_long ip, u_char mac[6]
+,	u_char device_mac[6], u_short arptype, u_char frame[ARP_FRAME_MAX]);
+static int write_arp(LTYPE* l, char *device, u_char *frame, int len);
+
+/*
+ * One link handle per interface, opened once, with the hardware address
+ * of the interface looked up once, and the request and reply frames for
+ * it built once, with the addresses left blank.
+ */
+struct arp_iface {
+	char *	device;
+	LTYPE *	l;
+	u_char	mac[6];
+	u_char	frame[2][ARP_FRAME_MAX];
+	int	framelen;
+};
+
+/*
+ * One address to announce, on one of the interfaces, with its copies of
+ * the frames of the interface, the addresses filled in.
+ */
+struct arp_target {
+	char *	ipaddr;
+	u_long	ip;
+	int	iface;		/* index into ifaces */
+	u_char	frame[2][ARP_FRAME_MAX];
+};
 
 static char print_usage[]={
 "send_arp: sends out custom ARP packet.\n"
-"  usage: send_arp [-i repeatinterval-ms] [-r repeatcount] [-p pidfile] \\\n"
-"              device src_ip_addr src_hw_addr broadcast_ip_addr netmask\n"
+"  usage: send_arp [-i repeatinterval-ms] [-r repeatcount] [-B profile] \\\n"
+"              [-p pidfile] \\\n"
+"              device src_ip_addr[,src_ip_addr...] src_hw_addr \\\n"
+"              broadcast_ip_addr netmask\n"
 "\n"
 "  where:\n"
 "    repeatinterval-ms: timing, in milliseconds of sending arp packets\n"
@@ -78,14 +116,24 @@ static char print_usage[]={
 "    repeatcount: how many pairs of ARP packets to send.\n"
 "                 See above for why pairs are sent\n"
 "\n"
+"    profile: burst[:first[:max]], instead of the fixed half interval\n"
+"      between packets: burst packets at once, then gaps of first ms,\n"
+"      doubling up to max ms.  \"5:50:1000\" sends five packets at once,\n"
+"      then the next ones 50, 100, 200, ... ms apart, up to a second.\n"
+"      The packets still alternate between requests and replies.\n"
+"\n"
 "    pidfile: pid file to use\n"
 "\n"
 "    device: netowrk interace to use\n"
 "\n"
 "    src_ip_addr: source ip address\n"
+"      Several addresses may be given, separated by commas, and each\n"
+"      may be followed by @interface to announce it on another interface\n"
+"      than device. They are all announced in the same rounds, by this\n"
+"      one process.\n"
 "\n"
 "    src_hw_addr: source hardware address.\n"
-"                 If \"auto\" then the address of device\n"
+"                 If \"auto\" then the address of each interface\n"
 "\n"
 "    broadcast_ip_addr: ignored\n"
 "\n"
@@ -95,7 +143,10 @@ static char print_usage[]={
 static const char * SENDARPNAME = "send_arp";
 
 static void convert_macaddr (u_char *macaddr, u_char enet_src[6]);
-static int get_hw_addr(char *device, u_char mac[6]);
+static int get_hw_addr(LTYPE *l, char *device, u_char mac[6]);
+static int open_iface(char *device);
+static int parse_targets(char *list, char *device);
+static int build_frames(u_char *src_mac);
 int write_pid_file(const char *pidfilename);
 int create_pid_directory(const char *piddirectory);
 
@@ -114,6 +165,11 @@ int create_pid_directory(const char *piddirectory);
 #define ENV_PREFIX "HA_"
 #define KEY_LOGDAEMON   "use_logd"
 
+static struct arp_iface *	ifaces;
+static int			nifaces;
+static struct arp_target *	targets;
+static int			ntargets;
+
 static void
 byebye(int nsig)
 {
@@ -127,18 +183,18 @@ int
 main(int argc, char *argv[])
 {
 	int	c = -1;
-	char	errbuf[LIBNET_ERRBUF_SIZE];
 	char*	device;
 	char*	ipaddr;
 	char*	macaddr;
-	char*	broadcast;
-	char*	netmask;
-	u_long	ip;
 	u_char  src_mac[6];
-	LTYPE*	l;
+	int	auto_mac;
 	int	repeatcount = 1;
-	int	j;
+	int	failed = 0;
+	int	j, k;
 	long	msinterval = 1000;
+	char	*profile_spec = NULL;
+	struct arp_profile	profile;
+	struct arp_sched	sched;
 	int	flag;
 	char    pidfilenamebuf[64];
 	char    *pidfilename = NULL;
@@ -151,7 +207,7 @@ main(int argc, char *argv[])
         cl_log_set_facility(LOG_USER);
 	cl_inherit_logging_environment(0);
 
-	while ((flag = getopt(argc, argv, "i:r:p:")) != EOF) {
+	while ((flag = getopt(argc, argv, "i:r:p:B:")) != EOF) {
 		switch(flag) {
 
 		case 'i':	msinterval= atol(optarg);
@@ -163,6 +219,9 @@ main(int argc, char *argv[])
 		case 'p':	pidfilename= optarg;
 				break;
 
+		case 'B':	profile_spec= optarg;
+				break;
+
 		default:	fprintf(stderr, "%s\n\n", print_usage);
 				return 1;
 				break;
@@ -172,10 +231,14 @@ main(int argc, char *argv[])
 		fprintf(stderr, "%s\n\n", print_usage);
 		return 1;
 	}
+	if (arp_profile_parse(&profile, profile_spec, msinterval / 2) < 0) {
+		cl_log(LOG_ERR, "Invalid repeat interval or profile");
+		return 1;
+	}
 
 	/*
 	 *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
-	 *	argv[optind+2] IP		192.168.195.186
+	 *	argv[optind+2] IP		192.168.195.186[,...]
 	 *	argv[optind+3] MAC ADDR		00a0cc34a878
 	 *	argv[optind+4] BROADCAST	192.168.195.186
 	 *	argv[optind+5] NETMASK		ffffffffffff
@@ -184,12 +247,13 @@ main(int argc, char *argv[])
 	device    = argv[optind];
 	ipaddr    = argv[optind+1];
 	macaddr   = argv[optind+2];
-	broadcast = argv[optind+3];
-	netmask   = argv[optind+4];
+	/* the broadcast address and the netmask are ignored */
 
 	if (!pidfilename) {
-		if (snprintf(pidfilenamebuf, sizeof(pidfilenamebuf), "%s%s", 
-					PIDFILE_BASE, ipaddr) >= 
+		/* named after the first address */
+		if (snprintf(pidfilenamebuf, sizeof(pidfilenamebuf), "%s%.*s", 
+					PIDFILE_BASE, (int)strcspn(ipaddr, ",@")
+					, ipaddr) >= 
 				(int)sizeof(pidfilenamebuf)) {
 			cl_log(LOG_INFO, "Pid file truncated");
 			return EXIT_FAILURE;
@@ -201,77 +265,213 @@ main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-#if defined(HAVE_LIBNET_1_0_API)
-#ifdef ON_DARWIN
-	if ((ip = libnet_name_resolve((unsigned char*)ipaddr, 1)) == -1UL) {
-#else
-	if ((ip = libnet_name_resolve(ipaddr, 1)) == -1UL) {
-#endif
-		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
+	if (parse_targets(ipaddr, device) < 0) {
 		unlink(pidfilename);
 		return EXIT_FAILURE;
 	}
 
-	l = libnet_open_link_interface(device, errbuf);
-	if (!l) {
-		cl_log(LOG_ERR, "libnet_open_link_interface on %s: %s"
-		,	device, errbuf);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
+	auto_mac = !strcasecmp(macaddr, AUTO_MAC_ADDR);
+	if (!auto_mac) {
+		convert_macaddr((unsigned char *)macaddr, src_mac);
 	}
-#elif defined(HAVE_LIBNET_1_1_API)
-	if ((l=libnet_init(LIBNET_LINK, device, errbuf)) == NULL) {
-		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
+	if (build_frames(auto_mac ? NULL : src_mac) < 0) {
 		unlink(pidfilename);
 		return EXIT_FAILURE;
 	}
-	if ((signed)(ip = libnet_name2addr4(l, ipaddr, 1)) == -1) {
-		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
+
+/*
+ * We need to send both a broadcast ARP request as well as the ARP response we
+ * were already sending.  All the interesting research work for this fix was
+ * done by Masaki Hasegawa <masaki-h@pp.iij4u.or.jp> and his colleagues.
+ *
+ * With several addresses, each round sends the requests for all of them,
+ * then, half an interval later, the replies for all of them.  The frames
+ * are all built beforehand, so each packet is a single write.
+ *
+ * The rounds follow the deadlines of the profile, by default one every
+ * half interval, which is what the former sleeps did.
+ */
+	if (arp_sched_init(&sched, &profile) < 0) {
+		cl_log(LOG_ERR, "Cannot start the scheduler: %s"
+		,	strerror(errno));
 		unlink(pidfilename);
 		return EXIT_FAILURE;
 	}
+	for (j=0; j < 2 * repeatcount; ++j) {
+		int	op = j % 2 ? FRAME_REPLY : FRAME_REQUEST;
+		int	fd;
+
+		while (arp_sched_wait(&sched, &fd) != ARP_SCHED_SEND) {
+			if (errno != EINTR) {
+				cl_log(LOG_ERR, "Scheduler failure: %s"
+				,	strerror(errno));
+				unlink(pidfilename);
+				return EXIT_FAILURE;
+			}
+		}
+		for (k = 0; k < ntargets; k++) {
+			struct arp_target *t = &targets[k];
+			struct arp_iface *ifc = &ifaces[t->iface];
+
+			c = write_arp(ifc->l, ifc->device
+			,	t->frame[op], ifc->framelen);
+			if (c < 0) {
+				/* carry on with the others */
+				failed = 1;
+			}
+		}
+		arp_sched_advance(&sched);
+	}
+	arp_sched_close(&sched);
+
+	unlink(pidfilename);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Open the link of the interface, unless it is open already.
+ * Returns its index in ifaces, or -1.
+ */
+static int
+open_iface(char *device)
+{
+	char			errbuf[LIBNET_ERRBUF_SIZE];
+	struct arp_iface	*ifc;
+	int			j;
+
+	for (j = 0; j < nifaces; j++) {
+		if (strcmp(ifaces[j].device, device) == 0) {
+			return j;
+		}
+	}
+	ifc = realloc(ifaces, (nifaces + 1) * sizeof(*ifaces));
+	if (ifc == NULL) {
+		cl_log(LOG_ERR, "Memory allocation failure");
+		return -1;
+	}
+	ifaces = ifc;
+	ifc = &ifaces[nifaces];
+	ifc->device = device;
+
+#if defined(HAVE_LIBNET_1_0_API)
+	ifc->l = libnet_open_link_interface(device, errbuf);
+	if (!ifc->l) {
+		cl_log(LOG_ERR, "libnet_open_link_interface on %s: %s"
+		,	device, errbuf);
+		return -1;
+	}
+#elif defined(HAVE_LIBNET_1_1_API)
+	/* advanced mode, to take the frames built back out of libnet */
+	if ((ifc->l=libnet_init(LIBNET_LINK_ADV, device, errbuf)) == NULL) {
+		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
+		return -1;
+	}
 #else
 #	error "Must have LIBNET API version defined."
 #endif
+	if (get_hw_addr(ifc->l, device, ifc->mac) < 0) {
+		cl_log(LOG_ERR, "Cannot find mac address for %s", device);
+		return -1;
+	}
+	return nifaces++;
+}
+
+/*
+ * Split the list of addresses, "ip[@device],...", into targets.  The
+ * interfaces are opened as they are first named.
+ */
+static int
+parse_targets(char *list, char *device)
+{
+	char	*item, *save = NULL;
+	int	j;
+
+	for (item = strtok_r(list, ",", &save); item != NULL
+	;	item = strtok_r(NULL, ",", &save)) {
+		struct arp_target	*t;
+		char			*at = strchr(item, '@');
 
-	if (!strcasecmp(macaddr, AUTO_MAC_ADDR)) {
-		if (get_hw_addr(device, src_mac) < 0) {
-			 cl_log(LOG_ERR, "Cannot find mac address for %s", 
-					 device);
-			 unlink(pidfilename);
-			 return EXIT_FAILURE;
+		t = realloc(targets, (ntargets + 1) * sizeof(*targets));
+		if (t == NULL) {
+			cl_log(LOG_ERR, "Memory allocation failure");
+			return -1;
+		}
+		targets = t;
+		t = &targets[ntargets];
+		t->ipaddr = item;
+		if (at != NULL) {
+			*at = '\0';
 		}
+		if ((t->iface = open_iface(at ? at + 1 : device)) < 0) {
+			return -1;
+		}
+		ntargets++;
 	}
-	else {
-		convert_macaddr((unsigned char *)macaddr, src_mac);
+	if (ntargets == 0) {
+		cl_log(LOG_ERR, "No IP address given");
+		return -1;
 	}
 
+	for (j = 0; j < ntargets; j++) {
+		struct arp_target	*t = &targets[j];
+
+#if defined(HAVE_LIBNET_1_0_API)
+#ifdef ON_DARWIN
+		t->ip = libnet_name_resolve((unsigned char*)t->ipaddr, 1);
+#else
+		t->ip = libnet_name_resolve(t->ipaddr, 1);
+#endif
+		if (t->ip == -1UL) {
+#else
+		t->ip = libnet_name2addr4(ifaces[t->iface].l, t->ipaddr, 1);
+		if ((signed)t->ip == -1) {
+#endif
+			cl_log(LOG_ERR, "Cannot resolve IP address [%s]"
+			,	t->ipaddr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*
- * We need to send both a broadcast ARP request as well as the ARP response we
- * were already sending.  All the interesting research work for this fix was
- * done by Masaki Hasegawa <masaki-h@pp.iij4u.or.jp> and his colleagues.
+ * Build the request and reply frames of each interface once, from the MAC
+ * address given, or the interface's own if it is NULL; then fill in the
+ * copies of each address.  Only the sender and target protocol addresses
+ * differ between the frames of the addresses of an interface.
  */
-	for (j=0; j < repeatcount; ++j) {
-		c = send_arp(l, ip, (unsigned char*)device, src_mac
-			, (unsigned char*)broadcast, (unsigned char*)netmask
-			, ARPOP_REQUEST);
-		if (c < 0) {
-			break;
-		}
-		mssleep(msinterval / 2);
-		c = send_arp(l, ip, (unsigned char*)device, src_mac
-			, (unsigned char *)broadcast
-			, (unsigned char *)netmask, ARPOP_REPLY);
-		if (c < 0) {
-			break;
-		}
-		if (j != repeatcount-1) {
-			mssleep(msinterval / 2);
+static int
+build_frames(u_char *src_mac)
+{
+	int	j, op;
+
+	for (j = 0; j < nifaces; j++) {
+		struct arp_iface	*ifc = &ifaces[j];
+		u_char			*mac = src_mac ? src_mac : ifc->mac;
+		int			len;
+
+		if ((len = build_arp(ifc->l, 0, mac, ifc->mac, ARPOP_REQUEST
+		,	ifc->frame[FRAME_REQUEST])) < 0
+		||	build_arp(ifc->l, 0, mac, ifc->mac, ARPOP_REPLY
+		,	ifc->frame[FRAME_REPLY]) != len) {
+			cl_log(LOG_ERR, "Cannot build ARP frames for %s"
+			,	ifc->device);
+			return -1;
 		}
+		ifc->framelen = len;
 	}
+	for (j = 0; j < ntargets; j++) {
+		struct arp_target	*t = &targets[j];
+		struct arp_iface	*ifc = &ifaces[t->iface];
+		uint32_t		ip = (uint32_t)t->ip;
 
-	unlink(pidfilename);
-	return c < 0  ? EXIT_FAILURE : EXIT_SUCCESS;
+		for (op = FRAME_REQUEST; op <= FRAME_REPLY; op++) {
+			memcpy(t->frame[op], ifc->frame[op], ifc->framelen);
+			memcpy(t->frame[op] + ARP_SPA_OFFSET, &ip, 4);
+			memcpy(t->frame[op] + ARP_TPA_OFFSET, &ip, 4);
+		}
+	}
+	return 0;
 }
 
 
@@ -298,18 +498,11 @@ convert_macaddr (u_char *macaddr, u_char enet_src[6])
 
 #ifdef HAVE_LIBNET_1_0_API
 int
-get_hw_addr(char *device, u_char mac[6])
+get_hw_addr(struct libnet_link_int *network, char *device, u_char mac[6])
 {
 	struct ether_addr	*mac_address;
-	struct libnet_link_int  *network;
 	char                    err_buf[LIBNET_ERRBUF_SIZE];
 
-	network = libnet_open_link_interface(device, err_buf);
-	if (!network) {
-		fprintf(stderr, "libnet_open_link_interface: %s\n", err_buf);
-		return -1;
-	}
-
 	mac_address = libnet_get_hwaddr(network, device, err_buf);
 	if (!mac_address) {
 		fprintf(stderr, "libnet_get_hwaddr: %s\n", err_buf);
@@ -324,21 +517,13 @@ get_hw_addr(char *device, u_char mac[6])
 
 #ifdef HAVE_LIBNET_1_1_API
 int
-get_hw_addr(char *device, u_char mac[6])
+get_hw_addr(libnet_t *ln, char *device, u_char mac[6])
 {
 	struct libnet_ether_addr	*mac_address;
-	libnet_t		*ln;
-	char			err_buf[LIBNET_ERRBUF_SIZE];
-
-	ln = libnet_init(LIBNET_LINK, device, err_buf);
-	if (!ln) {
-		fprintf(stderr, "libnet_open_link_interface: %s\n", err_buf);
-		return -1;
-	}
 
 	mac_address = libnet_get_hwaddr(ln);
 	if (!mac_address) {
-		fprintf(stderr,  "libnet_get_hwaddr: %s\n", err_buf);
+		fprintf(stderr,  "libnet_get_hwaddr: %s\n", libnet_geterror(ln));
 		return -1;
 	}
 
@@ -387,13 +572,14 @@ get_hw_addr(char *device, u_char mac[6])
  */
 
 #ifdef HAVE_LIBNET_1_0_API
+/*
+ * Build an ARP frame into frame.  Returns its length, or -1.
+ */
 int
-send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr, u_char *broadcast, u_char *netmask, u_short arptype)
+build_arp(struct libnet_link_int *l, u_long ip, u_char *macaddr, u_char *device_mac, u_short arptype, u_char frame[ARP_FRAME_MAX])
 {
-	int n;
 	u_char *buf;
 	u_char *target_mac;
-	u_char device_mac[6];
 	u_char bcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	u_char zero_mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
@@ -403,15 +589,7 @@ send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr,
 		return -1;
 	}
 
-	/* Convert ASCII Mac Address to 6 Hex Digits. */
-
 	/* Ethernet header */
-	if (get_hw_addr((char*)device, device_mac) < 0) {
-		cl_log(LOG_ERR, "Cannot find mac address for %s",
-				device);
-		return -1;
-	}
-
 	if (libnet_build_ethernet(bcast_mac, device_mac, ETHERTYPE_ARP, NULL, 0
 	,	buf) == -1) {
 		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
@@ -427,6 +605,7 @@ send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr,
 	}
 	else {
 		cl_log(LOG_ERR, "unkonwn arptype:");
+		libnet_destroy_packet(&buf);
 		return -1;
 	}
 
@@ -450,12 +629,20 @@ send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr,
 		return -1;
 	}
 
-	n = libnet_write_link_layer(l, (char*)device, buf, LIBNET_ARP_H + LIBNET_ETH_H);
+	memcpy(frame, buf, LIBNET_ARP_H + LIBNET_ETH_H);
+	libnet_destroy_packet(&buf);
+	return LIBNET_ARP_H + LIBNET_ETH_H;
+}
+
+int
+write_arp(struct libnet_link_int *l, char *device, u_char *frame, int len)
+{
+	int n;
+
+	n = libnet_write_link_layer(l, device, frame, len);
 	if (n == -1) {
-		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
+		cl_log(LOG_ERR, "libnet_write_link_layer failed:");
 	}
-
-	libnet_destroy_packet(&buf);
 	return (n);
 }
 #endif /* HAVE_LIBNET_1_0_API */
@@ -464,14 +651,18 @@ send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr,
 
 
 #ifdef HAVE_LIBNET_1_1_API
+/*
+ * Build an ARP frame into frame, through the advanced mode of the libnet
+ * context.  Returns its length, or -1.
+ */
 int
-send_arp(libnet_t* lntag, u_long ip, u_char *device, u_char macaddr[6], u_char *broadcast, u_char *netmask, u_short arptype)
+build_arp(libnet_t* lntag, u_long ip, u_char macaddr[6], u_char device_mac[6], u_short arptype, u_char frame[ARP_FRAME_MAX])
 {
-	int n;
 	u_char *target_mac;
-	u_char device_mac[6];
 	u_char bcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	u_char zero_mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	uint8_t *packet;
+	uint32_t size;
 
 	if (arptype == ARPOP_REQUEST) {
 		target_mac = zero_mac;
@@ -502,33 +693,52 @@ send_arp(libnet_t* lntag, u_long ip, u_char *device, u_char macaddr[6], u_char *
 		0		/* packet id */
 	) == -1 ) {
 		cl_log(LOG_ERR, "libnet_build_arp failed:");
+		libnet_clear_packet(lntag);
 		return -1;
 	}
 
 	/* Ethernet header */
-	if (get_hw_addr((char *)device, device_mac) < 0) {
-		cl_log(LOG_ERR, "Cannot find mac address for %s",
-				device);
-		return -1;
-	}
-
 	if (libnet_build_ethernet(bcast_mac, device_mac, ETHERTYPE_ARP, NULL, 0
 	,	lntag, 0) == -1 ) {
 		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
+		libnet_clear_packet(lntag);
 		return -1;
 	}
 
-	n = libnet_write(lntag);
-	if (n == -1) {
-		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
+	if (libnet_adv_cull_packet(lntag, &packet, &size) == -1) {
+		cl_log(LOG_ERR, "libnet_adv_cull_packet failed: %s"
+		,	libnet_geterror(lntag));
+		libnet_clear_packet(lntag);
+		return -1;
+	}
+	if (size > ARP_FRAME_MAX || size < ARP_TPA_OFFSET + 4) {
+		cl_log(LOG_ERR, "unexpected ARP frame size %u", size);
+		size = 0;
+	}else{
+		memcpy(frame, packet, size);
 	}
+	libnet_adv_free_packet(lntag, packet);
 	libnet_clear_packet(lntag);
 
+	return size ? (int)size : -1;
+}
+
+int
+write_arp(libnet_t* lntag, char *device, u_char *frame, int len)
+{
+	int n;
+
+	n = libnet_adv_write_link(lntag, frame, len);
+	if (n == -1) {
+		cl_log(LOG_ERR, "libnet_adv_write_link failed: %s"
+		,	libnet_geterror(lntag));
+	}
 	return (n);
 }
 #endif /* HAVE_LIBNET_1_1_API */
 
 
+
 int
 create_pid_directory(const char *pidfilename)  
 {
@@ -9,6 +9,10 @@
  * Authors:	Alexey Kuznetsov, <kuznet@ms2.inr.ac.ru>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* sendmmsg() */
+#endif
+#include <config.h>
 #include <stdlib.h>
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -20,6 +24,10 @@
 #include <linux/if.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
 #include <net/if_arp.h>
 #include <sys/uio.h>
 
@@ -31,27 +39,85 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <time.h>
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#	define USE_TSTAMP
+#	include <linux/net_tstamp.h>
+#	include <linux/errqueue.h>
+#endif
+
+#include "send_arp_sched.h"
+#include "send_arp_daemon.h"
 
 static void usage(void) __attribute__((noreturn));
 
 static int quit_on_reply;
 static char *device;
-static int ifindex;
 static char *source;
 static struct in_addr src, dst;
-static char *target;
 static int dad = 0, unsolicited = 0, advert = 0;
 static int quiet = 0;
 static int count = -1;
 static int timeout = 0;
+static long interval = 1000;
+static char *profile_spec;
+static char *daemon_path;
 static int unicasting = 0;
-static int s = 0;
 static int broadcast_only = 0;
 
-static struct sockaddr_ll me;
-static struct sockaddr_ll he;
-
-static struct timeval start, last;
+/*
+ * Several addresses, possibly on several interfaces, can be announced
+ * at once.  Each interface has one socket, and its index and hardware
+ * address are looked up once.  The first target and its interface are
+ * the ones probed and listened to in the other modes.
+ */
+struct arp_iface {
+	char *name;
+	int s;
+	struct sockaddr_ll me;
+	struct sockaddr_ll he;
+	struct timespec first_tx;	/* -M: the first announcement */
+	int tx_stamped;			/* first_tx is the kernel's */
+};
+
+struct arp_target {
+	struct in_addr src, dst;
+	int iface;		/* index into ifaces */
+	int dup;		/* DAD: someone else has it */
+};
+
+static struct arp_iface *ifaces;
+static int nifaces;
+static struct arp_target *targets;
+static int ntargets;
+static int multi_dad;		/* DAD of several targets at once */
+
+/* The neighbours to refresh by unicast, with -N */
+struct arp_neigh {
+	struct sockaddr_ll ll;	/* the interface's, to this neighbour */
+	struct in_addr ip;
+	int iface;
+};
+
+static int refresh_neigh;
+static struct arp_neigh *neighs;
+static int nneighs;
+
+/* The peers seen to have taken our address, with -M */
+struct arp_peer {
+	struct in_addr ip;
+	unsigned char mac[8];
+	struct in_addr target;	/* which of ours they asked for */
+	int iface;
+	struct timespec seen;	/* their first frame to us */
+	int frames;
+};
+
+static int measure;
+static struct arp_peer *peers;
+static int npeers;
+
+static struct timeval last;
 
 static int sent, brd_sent;
 static int received, brd_recv, req_recv;
@@ -62,15 +128,31 @@ static int received, brd_recv, req_recv;
 static void print_hex(unsigned char *p, int len);
 static int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM);
 static void set_signal(int signo, void (*handler)(void));
-static int send_pack(int s, struct in_addr src, struct in_addr dst,
+static int build_pack(unsigned char *buf, struct in_addr src, struct in_addr dst,
 	      struct sockaddr_ll *ME, struct sockaddr_ll *HE);
+static void send_all(void);
 static void finish(void);
-static void catcher(void);
+static void announce(void);
+static int open_iface(char *name);
+static int add_targets(char *list);
+static void set_filters(void);
+static void dad_index(void);
+static void load_neighbours(void);
+static void send_neighbours(void);
+static void enable_tstamps(struct arp_iface *ifc);
+static void read_tx_stamps(struct arp_iface *ifc);
+static void measure_recv(struct arp_iface *ifc, unsigned char *buf, int len,
+			 struct sockaddr_ll *FROM, struct timespec *ts);
+static void report(void);
+static int dad_recv(struct arp_iface *ifc, unsigned char *buf, int len,
+		    struct sockaddr_ll *FROM);
 
 void usage(void)
 {
 	fprintf(stderr,
-		"Usage: arping [-fqbDUAV] [-c count] [-w timeout] [-I device] [-s source] destination\n"
+		"Usage: arping [-fqbDUAMNV] [-c count] [-w timeout] [-B profile]\n"
+		"              [-S socket] [-I device] [-s source] destination...\n"
+		"       arping -d [-S socket]\n"
 		"  -f : quit on first reply\n"
 		"  -q : be quiet\n"
 		"  -b : keep broadcasting, don't go unicast\n"
@@ -80,9 +162,25 @@ void usage(void)
 		"  -V : print version and exit\n"
 		"  -c count : how many packets to send\n"
 		"  -w timeout : how long to wait for a reply\n"
+		"  -B profile : burst[:first[:max]], send burst packets at once, then\n"
+		"    wait first ms, doubling up to max ms; e.g. 5:50:1000 (1:1000)\n"
 		"  -I device : which ethernet device to use (eth0)\n"
 		"  -s source : source ip address\n"
 		"  destination : ask for what ip address\n"
+		"    With -U or -A, several destinations may be given, as separate\n"
+		"    arguments or separated by commas, each as ip[@device] to use\n"
+		"    another device than -I. They are announced together.\n"
+		"    With -D, all of them are checked at once, within the one\n"
+		"    timeout, and the exit code is 1 if any is in use.\n"
+		"  -M : with -U or -A, measure how long each peer takes to\n"
+		"    address us at the announced address(es), until the timeout\n"
+		"    (default 5 s), and print it as JSON\n"
+		"  -N : with -U or -A, also send a unicast reply to every neighbour\n"
+		"    in the kernel's neighbour table of the device(s)\n"
+		"  -d : run as the resident announcer, which -U and -A runs hand\n"
+		"    their addresses to; it announces IPv6 addresses too\n"
+		"  -S socket : socket of the resident announcer (default\n"
+		"    $SEND_ARP_SOCKET or " SEND_ARP_SOCKET ")\n"
 		);
 	exit(2);
 }
@@ -97,12 +195,18 @@ void set_signal(int signo, void (*handler)(void))
 	sigaction(signo, &sa, NULL);
 }
 
-int send_pack(int s, struct in_addr src, struct in_addr dst,
-	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+/*
+ * Build an ARP packet of the given operation from src to dst, with tha as
+ * the target hardware address, into buf, which must have room for FRAMESZ
+ * bytes.  Returns its length.
+ */
+#define FRAMESZ	64
+#define BURST	64	/* frames per sendmmsg() */
+
+static int build_arp(unsigned char *buf, int op, struct in_addr src,
+		     struct in_addr dst, struct sockaddr_ll *ME,
+		     unsigned char *tha)
 {
-	int err;
-	struct timeval now;
-	unsigned char buf[256];
 	struct arphdr *ah = (struct arphdr*)buf;
 	unsigned char *p = (unsigned char *)(ah+1);
 
@@ -112,7 +216,7 @@ int send_pack(int s, struct in_addr src, struct in_addr dst,
 	ah->ar_pro = htons(ETH_P_IP);
 	ah->ar_hln = ME->sll_halen;
 	ah->ar_pln = 4;
-	ah->ar_op  = advert ? htons(ARPOP_REPLY) : htons(ARPOP_REQUEST);
+	ah->ar_op  = htons(op);
 
 	memcpy(p, &ME->sll_addr, ah->ar_hln);
 	p+=ME->sll_halen;
@@ -120,28 +224,133 @@ int send_pack(int s, struct in_addr src, struct in_addr dst,
 	memcpy(p, &src, 4);
 	p+=4;
 
-	if (advert)
-		memcpy(p, &ME->sll_addr, ah->ar_hln);
-	else
-		memcpy(p, &HE->sll_addr, ah->ar_hln);
+	memcpy(p, tha, ah->ar_hln);
 	p+=ah->ar_hln;
 
 	memcpy(p, &dst, 4);
 	p+=4;
 
+	return p-buf;
+}
+
+/*
+ * The packet of the mode: a request, or a reply with -A.
+ */
+int build_pack(unsigned char *buf, struct in_addr src, struct in_addr dst,
+	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	if (advert)
+		return build_arp(buf, ARPOP_REPLY, src, dst, ME, ME->sll_addr);
+	return build_arp(buf, ARPOP_REQUEST, src, dst, ME, HE->sll_addr);
+}
+
+/*
+ * Send the queued packets of one interface.  A packet which cannot be sent
+ * is reported and skipped, so that one failure (ENOBUFS in the middle of
+ * a large burst, say) does not drop the rest of the batch.  Returns how
+ * many went out.
+ */
+static int flush_pack(struct arp_iface *ifc, struct mmsghdr *msgs, int n)
+{
+	int i = 0, ok = 0;
+
+#ifdef HAVE_SENDMMSG
+	while (i < n) {
+		int err = sendmmsg(ifc->s, msgs + i, n - i, 0);
+
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS)
+				break;
+			/* the first one of the rest failed */
+			if (!quiet)
+				perror("arping: sendmmsg");
+			err = 1;
+		} else
+			ok += err;
+		i += err;
+	}
+#endif
+	/* no sendmmsg(): one call per packet */
+	for (; i < n; i++) {
+		struct msghdr *mh = &msgs[i].msg_hdr;
+
+		if (sendto(ifc->s, mh->msg_iov->iov_base, mh->msg_iov->iov_len,
+			   0, mh->msg_name, mh->msg_namelen) < 0) {
+			if (!quiet)
+				perror("arping: sendto");
+		} else
+			ok++;
+	}
+	return ok;
+}
+
+/*
+ * Send one packet for every target.  The packets of each interface are
+ * handed to the kernel in batches, so that announcing many addresses
+ * costs a few system calls per round rather than one per address.
+ */
+void send_all(void)
+{
+	static unsigned char (*frames)[FRAMESZ];
+	struct mmsghdr msgs[BURST];
+	struct iovec iov[BURST];
+	struct timeval now;
+	int i, k, n, done = 0;
+
+	if (frames == NULL) {
+		frames = calloc(ntargets, FRAMESZ);
+		if (frames == NULL) {
+			perror("arping: calloc");
+			exit(2);
+		}
+	}
+
 	gettimeofday(&now, NULL);
-	err = sendto(s, buf, p-buf, 0, (struct sockaddr*)HE, sizeof(*HE));
-	if (err == p-buf) {
+	for (i = 0; i < nifaces; i++) {
+		struct arp_iface *ifc = &ifaces[i];
+
+		n = 0;
+		for (k = 0; k < ntargets; k++) {
+			struct arp_target *t = &targets[k];
+
+			if (t->iface != i || t->dup)
+				continue;
+			iov[n].iov_base = frames[k];
+			iov[n].iov_len = build_pack(frames[k], t->src, t->dst,
+						    &ifc->me, &ifc->he);
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &ifc->he;
+			msgs[n].msg_hdr.msg_namelen = sizeof(ifc->he);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			if (++n == BURST) {
+				done += flush_pack(ifc, msgs, n);
+				n = 0;
+			}
+		}
+		if (n)
+			done += flush_pack(ifc, msgs, n);
+		/* until the kernel's timestamp of it comes in */
+		if (measure && !ifc->first_tx.tv_sec)
+			clock_gettime(CLOCK_REALTIME, &ifc->first_tx);
+	}
+	if (done) {
 		last = now;
-		sent++;
+		sent += done;
 		if (!unicasting)
-			brd_sent++;
+			brd_sent += done;
 	}
-	return err;
 }
 
 void finish(void)
 {
+	if (measure) {
+		report();
+		exit(!npeers);
+	}
+
 	if (!quiet) {
 		printf("Sent %d probes (%d broadcast(s))\n", sent, brd_sent);
 		printf("Received %d response(s)", received);
@@ -171,24 +380,27 @@ void finish(void)
 	exit(!received);
 }
 
-void catcher(void)
+/*
+ * Called when the scheduler says the next round is due.
+ */
+void announce(void)
 {
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-
-	if (start.tv_sec==0)
-		start = tv;
+	int i;
 
-	if (count-- == 0 || (timeout && MS_TDIFF(tv,start) > timeout*1000 + 500))
+	/* a measurement listens on until the timeout */
+	if (count == 0 && measure)
+		return;
+	if (count-- == 0)
 		finish();
 
-	if (last.tv_sec==0 || MS_TDIFF(tv,last) > 500) {
-		send_pack(s, src, dst, &me, &he);
-		if (count == 0 && unsolicited)
-			finish();
-	}
-	alarm(1);
+	send_all();
+	if (refresh_neigh)
+		send_neighbours();
+	if (measure)
+		for (i = 0; i < nifaces; i++)
+			read_tx_stamps(&ifaces[i]);
+	if (count == 0 && unsolicited && !measure)
+		finish();
 }
 
 void print_hex(unsigned char *p, int len)
@@ -231,7 +443,7 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 		return 0;
 	if (ah->ar_pln != 4)
 		return 0;
-	if (ah->ar_hln != me.sll_halen)
+	if (ah->ar_hln != ifaces[0].me.sll_halen)
 		return 0;
 	if (len < sizeof(*ah) + 2*(4 + ah->ar_hln))
 		return 0;
@@ -242,7 +454,7 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 			return 0;
 		if (src.s_addr != dst_ip.s_addr)
 			return 0;
-		if (memcmp(p+ah->ar_hln+4, &me.sll_addr, ah->ar_hln))
+		if (memcmp(p+ah->ar_hln+4, &ifaces[0].me.sll_addr, ah->ar_hln))
 			return 0;
 	} else {
 		/* DAD packet was:
@@ -260,7 +472,7 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 		 */
 		if (src_ip.s_addr != dst.s_addr)
 			return 0;
-		if (memcmp(p, &me.sll_addr, me.sll_halen) == 0)
+		if (memcmp(p, &ifaces[0].me.sll_addr, ifaces[0].me.sll_halen) == 0)
 			return 0;
 		if (src.s_addr && src.s_addr != dst_ip.s_addr)
 			return 0;
@@ -276,7 +488,7 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 			printf("for %s ", inet_ntoa(dst_ip));
 			s_printed = 1;
 		}
-		if (memcmp(p+ah->ar_hln+4, me.sll_addr, ah->ar_hln)) {
+		if (memcmp(p+ah->ar_hln+4, ifaces[0].me.sll_addr, ah->ar_hln)) {
 			if (!s_printed)
 				printf("for ");
 			printf("[");
@@ -302,7 +514,7 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 	if (quit_on_reply)
 		finish();
 	if(!broadcast_only) {
-		memcpy(he.sll_addr, p, me.sll_halen);
+		memcpy(ifaces[0].he.sll_addr, p, ifaces[0].me.sll_halen);
 		unicasting=1;
 	}
 	return 1;
@@ -317,28 +529,681 @@ static void byebye(int nsig)
     exit(nsig);
 }
 
+/*
+ * Open, check and bind a socket for the interface, unless there is one
+ * already.  Returns its index in ifaces; exits on failure.
+ */
+static int open_iface(char *name)
+{
+	struct arp_iface *ifc;
+	struct ifreq ifr;
+	socklen_t alen;
+	int i;
+
+	for (i = 0; i < nifaces; i++)
+		if (strcmp(ifaces[i].name, name) == 0)
+			return i;
+
+	ifc = realloc(ifaces, (nifaces + 1) * sizeof(*ifaces));
+	if (ifc == NULL) {
+		perror("arping: realloc");
+		exit(2);
+	}
+	ifaces = ifc;
+	ifc = &ifaces[nifaces];
+	memset(ifc, 0, sizeof(*ifc));
+	ifc->name = name;
+
+	ifc->s = socket(PF_PACKET, SOCK_DGRAM, 0);
+	if (ifc->s < 0) {
+		perror("arping: socket");
+		exit(2);
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+	if (ioctl(ifc->s, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, "arping: unknown iface %s\n", name);
+		exit(2);
+	}
+	ifc->me.sll_ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(ifc->s, SIOCGIFFLAGS, (char*)&ifr)) {
+		perror("ioctl(SIOCGIFFLAGS)");
+		exit(2);
+	}
+	if (!(ifr.ifr_flags&IFF_UP)) {
+		if (!quiet)
+			printf("Interface \"%s\" is down\n", name);
+		exit(2);
+	}
+	if (ifr.ifr_flags&(IFF_NOARP|IFF_LOOPBACK)) {
+		if (!quiet)
+			printf("Interface \"%s\" is not ARPable\n", name);
+		exit(dad?0:2);
+	}
+
+	ifc->me.sll_family = AF_PACKET;
+	ifc->me.sll_protocol = htons(ETH_P_ARP);
+	if (bind(ifc->s, (struct sockaddr*)&ifc->me, sizeof(ifc->me)) == -1) {
+		perror("bind");
+		exit(2);
+	}
+	alen = sizeof(ifc->me);
+	if (getsockname(ifc->s, (struct sockaddr*)&ifc->me, &alen) == -1) {
+		perror("getsockname");
+		exit(2);
+	}
+	if (ifc->me.sll_halen == 0) {
+		if (!quiet)
+			printf("Interface \"%s\" is not ARPable (no ll address)\n", name);
+		exit(dad?0:2);
+	}
+
+	ifc->he = ifc->me;
+	memset(ifc->he.sll_addr, -1, ifc->he.sll_halen);
+
+	return nifaces++;
+}
+
+/*
+ * Have the kernel drop the frames recv_pack() would ignore anyway, so that
+ * an ARP storm on the segment is not copied to us frame by frame.  Only
+ * requests and replies for IP from the probed address (and, but for DAD
+ * without a source, to our source address) reach the first interface's
+ * socket, which is the one read; the others are not read at all, and get
+ * nothing.  The hardware addresses are still checked in recv_pack().
+ */
+static void set_filters(void)
+{
+	int halen = ifaces[0].me.sll_halen;
+	struct sock_filter code[] = {
+		/* 0 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF+SKF_AD_PKTTYPE),
+		/* 1 */ BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, PACKET_MULTICAST, 13, 0),
+		/* 2 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6),	/* ar_op */
+		/* 3 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REQUEST, 1, 0),
+		/* 4 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REPLY, 0, 10),
+		/* 5 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 2),	/* ar_pro */
+		/* 6 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, 8),
+		/* 7 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 4),	/* ar_hln, ar_pln */
+		/* 8 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, halen << 8 | 4, 0, 6),
+		/* 9 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 8 + halen),	/* sender ip */
+		/* 10 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ntohl(dst.s_addr), 0, 4),
+		/* 11 */ BPF_JUMP(BPF_JMP|BPF_JA, 0, 0, 0),	/* skipped or not */
+		/* 12 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 8 + 2*halen + 4), /* target */
+		/* 13 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ntohl(src.s_addr), 0, 1),
+		/* 14 */ BPF_STMT(BPF_RET|BPF_K, 0xffff),
+		/* 15 */ BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_filter none[] = {
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_fprog prog;
+	int i;
+
+	/* DAD without a source takes whatever the target address is for */
+	if (dad && !src.s_addr)
+		code[11].k = 2;
+	/*
+	 * DAD of several targets and measurements read every interface, and
+	 * the addresses are matched with dad_lookup() instead.
+	 */
+	if (multi_dad || measure)
+		code[9] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JA, 4, 0, 0);
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	if (setsockopt(ifaces[0].s, SOL_SOCKET, SO_ATTACH_FILTER,
+		       &prog, sizeof(prog)) < 0 && !quiet)
+		perror("WARNING: setsockopt(SO_ATTACH_FILTER)");
+
+	for (i = 1; i < nifaces; i++) {
+		if (!multi_dad && !measure) {
+			prog.len = 1;
+			prog.filter = none;
+		}
+		setsockopt(ifaces[i].s, SOL_SOCKET, SO_ATTACH_FILTER,
+			   &prog, sizeof(prog));
+	}
+}
+
+/*
+ * Take a neighbour of the dump, if it is on one of our interfaces and has
+ * a usable link layer address.
+ */
+static void add_neighbour(struct ndmsg *ndm, int len)
+{
+	struct rtattr *rta = (struct rtattr *)((char *)ndm +
+					       NLMSG_ALIGN(sizeof(*ndm)));
+	unsigned char *lladdr = NULL;
+	struct in_addr ip = { 0 };
+	struct arp_neigh *nb;
+	int have_ip = 0;
+	int i, halen = 0;
+
+	if (ndm->ndm_family != AF_INET ||
+	    !(ndm->ndm_state & (NUD_REACHABLE|NUD_STALE|NUD_DELAY|
+				NUD_PROBE|NUD_PERMANENT)))
+		return;
+	for (i = 0; i < nifaces; i++)
+		if (ifaces[i].me.sll_ifindex == ndm->ndm_ifindex)
+			break;
+	if (i == nifaces)
+		return;
+
+	len -= NLMSG_ALIGN(sizeof(*ndm));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == 4) {
+			memcpy(&ip, RTA_DATA(rta), 4);
+			have_ip = 1;
+		} else if (rta->rta_type == NDA_LLADDR) {
+			lladdr = RTA_DATA(rta);
+			halen = RTA_PAYLOAD(rta);
+		}
+	}
+	if (!have_ip || lladdr == NULL || halen != ifaces[i].me.sll_halen)
+		return;
+
+	nb = realloc(neighs, (nneighs + 1) * sizeof(*neighs));
+	if (nb == NULL) {
+		perror("arping: realloc");
+		exit(2);
+	}
+	neighs = nb;
+	nb = &neighs[nneighs++];
+	nb->ll = ifaces[i].he;
+	memcpy(nb->ll.sll_addr, lladdr, halen);
+	nb->ip = ip;
+	nb->iface = i;
+}
+
+/*
+ * Dump the IPv4 neighbour table of the kernel, for the neighbours on our
+ * interfaces.
+ */
+static void load_neighbours(void)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ndmsg ndm;
+	} req;
+	static char buf[32768];
+	struct nlmsghdr *nh;
+	int fd, len, done = 0;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) {
+		perror("arping: netlink socket");
+		exit(2);
+	}
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETNEIGH;
+	req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	req.nh.nlmsg_seq = 1;
+	req.ndm.ndm_family = AF_INET;
+	if (send(fd, &req, sizeof(req), 0) < 0) {
+		perror("arping: netlink send");
+		exit(2);
+	}
+	while (!done && (len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE ||
+			    nh->nlmsg_type == NLMSG_ERROR) {
+				done = 1;
+				break;
+			}
+			if (nh->nlmsg_type == RTM_NEWNEIGH)
+				add_neighbour(NLMSG_DATA(nh),
+					      nh->nlmsg_len - NLMSG_HDRLEN);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Send each neighbour a unicast reply for each target on its interface,
+ * for the hosts and switches which ignore gratuitous broadcasts.  The
+ * replies go out in batches, with a pause between them, so that a large
+ * segment is not flooded all at once.
+ */
+#define NEIGH_PAUSE_NS	1000000		/* between two batches */
+
+void send_neighbours(void)
+{
+	static unsigned char frames[BURST][FRAMESZ];
+	struct mmsghdr msgs[BURST];
+	struct iovec iov[BURST];
+	struct timespec pause;
+	int i, k, n = 0, done = 0;
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = NEIGH_PAUSE_NS;
+	for (k = 0; k < ntargets; k++) {
+		struct arp_target *t = &targets[k];
+		struct arp_iface *ifc = &ifaces[t->iface];
+
+		for (i = 0; i < nneighs; i++) {
+			struct arp_neigh *nb = &neighs[i];
+
+			if (nb->iface != t->iface)
+				continue;
+			iov[n].iov_base = frames[n];
+			iov[n].iov_len = build_arp(frames[n], ARPOP_REPLY,
+						   t->src, nb->ip, &ifc->me,
+						   nb->ll.sll_addr);
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &nb->ll;
+			msgs[n].msg_hdr.msg_namelen = sizeof(nb->ll);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			if (++n == BURST) {
+				done += flush_pack(ifc, msgs, n);
+				n = 0;
+				nanosleep(&pause, NULL);
+			}
+		}
+		if (n) {
+			done += flush_pack(ifc, msgs, n);
+			n = 0;
+		}
+	}
+	sent += done;
+}
+
+/*
+ * Duplicate address detection of several targets: the probes for all of
+ * them go out in each round, and a reply is matched to its target through
+ * a hash of the target addresses, open addressed.
+ */
+static int *dad_hash;
+static unsigned int dad_mask;
+
+static unsigned int dad_slot(struct in_addr ip)
+{
+	return (ntohl(ip.s_addr) * 2654435761U) & dad_mask;
+}
+
+static void dad_index(void)
+{
+	unsigned int size = 16;
+	int i;
+
+	while (size < 2 * (unsigned int)ntargets)
+		size <<= 1;
+	dad_hash = malloc(size * sizeof(*dad_hash));
+	if (dad_hash == NULL) {
+		perror("arping: malloc");
+		exit(2);
+	}
+	memset(dad_hash, -1, size * sizeof(*dad_hash));
+	dad_mask = size - 1;
+	for (i = 0; i < ntargets; i++) {
+		unsigned int h = dad_slot(targets[i].dst);
+
+		while (dad_hash[h] != -1)
+			h = (h + 1) & dad_mask;
+		dad_hash[h] = i;
+	}
+}
+
+static struct arp_target *dad_lookup(struct in_addr ip, int iface)
+{
+	unsigned int h;
+
+	for (h = dad_slot(ip); dad_hash[h] != -1; h = (h + 1) & dad_mask) {
+		struct arp_target *t = &targets[dad_hash[h]];
+
+		if (t->dst.s_addr == ip.s_addr && t->iface == iface)
+			return t;
+	}
+	return NULL;
+}
+
+/*
+ * The same checks as recv_pack() does in DAD mode, against the target the
+ * sender address is.  Returns 1 if the packet shows a duplicate.
+ */
+int dad_recv(struct arp_iface *ifc, unsigned char *buf, int len,
+	     struct sockaddr_ll *FROM)
+{
+	struct arphdr *ah = (struct arphdr*)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+	struct in_addr src_ip, dst_ip;
+	struct arp_target *t;
+	static int found;
+
+	if (len < sizeof(*ah) || ah->ar_pln != 4 ||
+	    ah->ar_hln != ifc->me.sll_halen ||
+	    len < sizeof(*ah) + 2*(4 + ah->ar_hln))
+		return 0;
+	if (ah->ar_hrd != htons(FROM->sll_hatype) &&
+	    (FROM->sll_hatype != ARPHRD_FDDI || ah->ar_hrd != htons(ARPHRD_ETHER)))
+		return 0;
+	memcpy(&src_ip, p+ah->ar_hln, 4);
+	memcpy(&dst_ip, p+ah->ar_hln+4+ah->ar_hln, 4);
+
+	t = dad_lookup(src_ip, ifc - ifaces);
+	if (t == NULL || t->dup)
+		return 0;
+	if (memcmp(p, ifc->me.sll_addr, ifc->me.sll_halen) == 0)
+		return 0;
+	if (t->src.s_addr && t->src.s_addr != dst_ip.s_addr)
+		return 0;
+
+	t->dup = 1;
+	received++;
+	if (FROM->sll_pkttype != PACKET_HOST)
+		brd_recv++;
+	if (ah->ar_op == htons(ARPOP_REQUEST))
+		req_recv++;
+	if (!quiet) {
+		printf("%s %s from %s [",
+		       FROM->sll_pkttype==PACKET_HOST ? "Unicast" : "Broadcast",
+		       ah->ar_op == htons(ARPOP_REPLY) ? "reply" : "request",
+		       inet_ntoa(src_ip));
+		print_hex(p, ah->ar_hln);
+		printf("] on %s\n", ifc->name);
+		fflush(stdout);
+	}
+	/* nothing left to find out */
+	if (++found == ntargets)
+		finish();
+	return 1;
+}
+
+/*
+ * Convergence measurement: from the first announcement on an interface to
+ * the first ARP frame each peer addresses to our hardware address for one
+ * of the targets, which shows that it has taken the new address.  Both
+ * ends are the kernel's timestamps where SO_TIMESTAMPING is available, so
+ * that the scheduling of this process does not count.
+ */
+static void enable_tstamps(struct arp_iface *ifc)
+{
+#ifdef USE_TSTAMP
+	int flags = SOF_TIMESTAMPING_TX_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|
+		    SOF_TIMESTAMPING_SOFTWARE;
+
+	if (setsockopt(ifc->s, SOL_SOCKET, SO_TIMESTAMPING,
+		       &flags, sizeof(flags)) < 0)
+		perror("WARNING: setsockopt(SO_TIMESTAMPING)");
+#endif
+}
+
+/* The software timestamp of a received message, if it has one */
+static int get_tstamp(struct msghdr *mh, struct timespec *ts)
+{
+#ifdef USE_TSTAMP
+	struct cmsghdr *cm;
+	struct scm_timestamping st;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+		memcpy(&st, CMSG_DATA(cm), sizeof(st));
+		if (st.ts[0].tv_sec) {
+			*ts = st.ts[0];
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Take the transmit timestamps off the error queue.  The first one is the
+ * first announcement's, and replaces the time taken before sending it.
+ */
+void read_tx_stamps(struct arp_iface *ifc)
+{
+#ifdef USE_TSTAMP
+	unsigned char data[FRAMESZ];
+	char ctrl[512];
+	struct iovec iov;
+	struct msghdr mh;
+	struct timespec ts;
+
+	for (;;) {
+		iov.iov_base = data;
+		iov.iov_len = sizeof(data);
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctrl;
+		mh.msg_controllen = sizeof(ctrl);
+		if (recvmsg(ifc->s, &mh, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+			break;
+		if (!ifc->tx_stamped && get_tstamp(&mh, &ts)) {
+			ifc->first_tx = ts;
+			ifc->tx_stamped = 1;
+		}
+	}
+#endif
+}
+
+/*
+ * Note the first frame of each peer to our hardware address for one of
+ * the targets: a unicast request, as a host revalidating its cache sends,
+ * or anything carrying our address as the target's.
+ */
+void measure_recv(struct arp_iface *ifc, unsigned char *buf, int len,
+		  struct sockaddr_ll *FROM, struct timespec *ts)
+{
+	struct arphdr *ah = (struct arphdr*)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+	struct in_addr src_ip, dst_ip;
+	struct arp_peer *peer;
+	int i, iface = ifc - ifaces;
+
+	if (!ifc->first_tx.tv_sec)
+		return;
+	if (len < sizeof(*ah) || ah->ar_pln != 4 ||
+	    ah->ar_hln != ifc->me.sll_halen ||
+	    len < sizeof(*ah) + 2*(4 + ah->ar_hln))
+		return;
+	memcpy(&src_ip, p+ah->ar_hln, 4);
+	memcpy(&dst_ip, p+ah->ar_hln+4+ah->ar_hln, 4);
+	if (!src_ip.s_addr || dad_lookup(src_ip, iface) != NULL ||
+	    dad_lookup(dst_ip, iface) == NULL)
+		return;
+	if (FROM->sll_pkttype != PACKET_HOST &&
+	    memcmp(p+ah->ar_hln+4, ifc->me.sll_addr, ah->ar_hln))
+		return;
+
+	for (i = 0; i < npeers; i++) {
+		if (peers[i].ip.s_addr == src_ip.s_addr &&
+		    peers[i].iface == iface) {
+			peers[i].frames++;
+			return;
+		}
+	}
+	peer = realloc(peers, (npeers + 1) * sizeof(*peers));
+	if (peer == NULL) {
+		perror("arping: realloc");
+		exit(2);
+	}
+	peers = peer;
+	peer = &peers[npeers++];
+	memset(peer, 0, sizeof(*peer));
+	peer->ip = src_ip;
+	memcpy(peer->mac, p, ah->ar_hln);
+	peer->target = dst_ip;
+	peer->iface = iface;
+	peer->seen = *ts;
+	peer->frames = 1;
+}
+
+static double peer_ms(struct arp_peer *peer)
+{
+	struct timespec *tx = &ifaces[peer->iface].first_tx;
+
+	return (peer->seen.tv_sec - tx->tv_sec) * 1000.0 +
+		(peer->seen.tv_nsec - tx->tv_nsec) / 1000000.0;
+}
+
+static int cmp_ms(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the measurement: each peer with the milliseconds it took, and the
+ * spread of them.
+ */
+void report(void)
+{
+	double *ms = NULL;
+	const char *stamps = "kernel";
+	int i, j;
+
+	for (i = 0; i < nifaces; i++)
+		if (ifaces[i].first_tx.tv_sec && !ifaces[i].tx_stamped)
+			stamps = "user";
+	if (npeers && (ms = malloc(npeers * sizeof(*ms))) == NULL) {
+		perror("arping: malloc");
+		exit(2);
+	}
+
+	printf("{\"sent\": %d, \"timeout_ms\": %d, \"tx_timestamp\": \"%s\",\n",
+	       sent, timeout * 1000, stamps);
+	printf(" \"peers\": [");
+	for (i = 0; i < npeers; i++) {
+		struct arp_peer *peer = &peers[i];
+
+		ms[i] = peer_ms(peer);
+		printf("%s\n  {\"ip\": \"%s\", \"mac\": \"", i ? "," : "",
+		       inet_ntoa(peer->ip));
+		print_hex(peer->mac, ifaces[peer->iface].me.sll_halen);
+		printf("\", \"device\": \"%s\", ", ifaces[peer->iface].name);
+		printf("\"for\": \"%s\", \"ms\": %.3f, \"frames\": %d}",
+		       inet_ntoa(peer->target), ms[i], peer->frames);
+	}
+	printf("%s],\n \"converged\": %d, \"ms\": ", npeers ? "\n " : "",
+	       npeers);
+	if (npeers) {
+		qsort(ms, npeers, sizeof(*ms), cmp_ms);
+		/* nearest rank */
+		j = (95 * npeers + 99) / 100 - 1;
+		printf("{\"min\": %.3f, \"median\": %.3f, \"p95\": %.3f, "
+		       "\"max\": %.3f}}\n", ms[0], ms[(npeers - 1) / 2],
+		       ms[j], ms[npeers - 1]);
+	} else
+		printf("null}\n");
+	fflush(stdout);
+	free(ms);
+}
+
+/*
+ * Add the targets of a "ip[@device],..." list.  Returns the number added;
+ * exits on failure.
+ */
+static int add_targets(char *list)
+{
+	char *item, *save = NULL;
+	int added = 0;
+
+	for (item = strtok_r(list, ",", &save); item != NULL;
+	     item = strtok_r(NULL, ",", &save)) {
+		struct arp_target *t;
+		char *at = strchr(item, '@');
+
+		t = realloc(targets, (ntargets + 1) * sizeof(*targets));
+		if (t == NULL) {
+			perror("arping: realloc");
+			exit(2);
+		}
+		targets = t;
+		t = &targets[ntargets++];
+		memset(t, 0, sizeof(*t));
+		if (at)
+			*at = '\0';
+		t->iface = open_iface(at ? at+1 : device);
+
+		if (inet_aton(item, &t->dst) != 1) {
+			struct hostent *hp;
+			hp = gethostbyname2(item, AF_INET);
+			if (!hp) {
+				fprintf(stderr, "arping: unknown host %s\n", item);
+				exit(2);
+			}
+			memcpy(&t->dst, hp->h_addr, 4);
+		}
+		added++;
+	}
+	return added;
+}
+
+/*
+ * Find the source address to use towards dst on the interface, or check
+ * that the given one can be used.
+ */
+static void check_source(struct in_addr *src, struct in_addr dst, char *device)
+{
+	struct sockaddr_in saddr;
+	int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (probe_fd < 0) {
+		perror("socket");
+		exit(2);
+	}
+	if (device) {
+		if (setsockopt(probe_fd, SOL_SOCKET, SO_BINDTODEVICE, device, strlen(device)+1) == -1)
+			perror("WARNING: interface is ignored");
+	}
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	if (src->s_addr) {
+		saddr.sin_addr = *src;
+		if (bind(probe_fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1) {
+			perror("bind");
+			exit(2);
+		}
+	} else if (!dad) {
+		int on = 1;
+		socklen_t alen = sizeof(saddr);
+
+		saddr.sin_port = htons(1025);
+		saddr.sin_addr = dst;
+
+		if (setsockopt(probe_fd, SOL_SOCKET, SO_DONTROUTE, (char*)&on, sizeof(on)) == -1)
+			perror("WARNING: setsockopt(SO_DONTROUTE)");
+		if (connect(probe_fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1) {
+			perror("connect");
+			exit(2);
+		}
+		if (getsockname(probe_fd, (struct sockaddr*)&saddr, &alen) == -1) {
+			perror("getsockname");
+			exit(2);
+		}
+		*src = saddr.sin_addr;
+	}
+	close(probe_fd);
+}
+
 int
 main(int argc, char **argv)
 {
-	int socket_errno;
 	int ch;
+	int i;
 	uid_t uid = getuid();
 	int hb_mode = 0;
+	int run_daemon = 0;
+	char **lists;
+	int nlists;
+	struct arp_profile profile;
+	struct arp_sched sched;
 
 	signal(SIGTERM, byebye);
 	signal(SIGPIPE, byebye);
 	
 	device = strdup("eth0");
-	
-	s = socket(PF_PACKET, SOCK_DGRAM, 0);
-	socket_errno = errno;
 
-	if (setuid(uid)) {
-		perror("arping: setuid");
-		exit(-1);
-	}
-
-	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:B:dS:MN")) != EOF) {
 		switch(ch) {
 		case 'b':
 			broadcast_only=1;
@@ -377,10 +1242,30 @@ main(int argc, char **argv)
 		case 'V':
 			printf("send_arp utility\n");
 			exit(0);
+		case 'B':
+			profile_spec = optarg;
+			break;
+		case 'd':
+			run_daemon = 1;
+			break;
+		case 'M':
+			/* the report is all there is on stdout */
+			measure = 1;
+			quiet++;
+			break;
+		case 'N':
+			refresh_neigh = 1;
+			break;
+		case 'S':
+			daemon_path = optarg;
+			break;
+		case 'i': /* send_arp compatability option */
+		    hb_mode = 1;
+		    interval = atol(optarg);
+		    break;
 		case 'p':
-		case 'i':
 		    hb_mode = 1;
-		    /* send_arp compatability options, ignore */
+		    /* send_arp compatability option, ignore */
 		    break;
 		case 'h':
 		case '?':
@@ -389,6 +1274,40 @@ main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * The announcer unlinks and creates its socket at a path the user
+	 * may choose, and needs its privileges all along: it is not for a
+	 * setuid install.
+	 */
+	if (run_daemon) {
+		if (optind != argc)
+			usage();
+		if (uid != geteuid()) {
+			fprintf(stderr, "arping: -d cannot be used setuid\n");
+			exit(2);
+		}
+		exit(arp_daemon_run(daemon_path));
+	}
+
+	if (device == NULL) {
+		fprintf(stderr, "arping: device (option -I) is required\n");
+		usage();
+	}
+
+	if (arp_profile_parse(&profile, profile_spec, interval) < 0) {
+		fprintf(stderr, "arping: invalid interval or profile\n");
+		exit(2);
+	}
+
+	if (source && inet_aton(source, &src) != 1) {
+		fprintf(stderr, "arping: invalid source %s\n", source);
+		exit(2);
+	}
+
+	/*
+	 * The sockets of all the interfaces are opened before privileges
+	 * are dropped.
+	 */
 	if(hb_mode) {
 	    /* send_arp compatability mode */
 	    if (argc - optind != 5) {
@@ -397,7 +1316,7 @@ main(int argc, char **argv)
 	    }
 	    /*
 	     *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
-	     *	argv[optind+2] IP		192.168.195.186
+	     *	argv[optind+2] IP		192.168.195.186[,...]
 	     *	argv[optind+3] MAC ADDR		00a0cc34a878
 	     *	argv[optind+4] BROADCAST	192.168.195.186
 	     *	argv[optind+5] NETMASK		ffffffffffff
@@ -405,141 +1324,102 @@ main(int argc, char **argv)
 
 	    unsolicited = 1;
 	    device = argv[optind];
-	    target = argv[optind+1];
+	    lists = &argv[optind+1];
+	    nlists = 1;
 
 	} else {
 	    argc -= optind;
 	    argv += optind;
-	    if (argc != 1)
+	    if (argc < 1 || (argc > 1 && !unsolicited && !dad))
 		usage();
 
-	    target = *argv;
-	}
-	
-	if (device == NULL) {
-		fprintf(stderr, "arping: device (option -I) is required\n");
-		usage();
+	    lists = argv;
+	    nlists = argc;
 	}
 
-	if (s < 0) {
-		errno = socket_errno;
-		perror("arping: socket");
-		exit(2);
-	}
-
-	if (1) {
-		struct ifreq ifr;
-		memset(&ifr, 0, sizeof(ifr));
-		strncpy(ifr.ifr_name, device, IFNAMSIZ-1);
-		if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
-			fprintf(stderr, "arping: unknown iface %s\n", device);
-			exit(2);
-		}
-		ifindex = ifr.ifr_ifindex;
+	/*
+	 * Plain announcements are left to the resident announcer if there
+	 * is one; if not, or for the addresses it fails on, they are sent
+	 * from here.
+	 */
+	if ((refresh_neigh || measure) && !unsolicited)
+		usage();
 
-		if (ioctl(s, SIOCGIFFLAGS, (char*)&ifr)) {
-			perror("ioctl(SIOCGIFFLAGS)");
-			exit(2);
-		}
-		if (!(ifr.ifr_flags&IFF_UP)) {
-			if (!quiet)
-				printf("Interface \"%s\" is down\n", device);
-			exit(2);
+	if (unsolicited && !dad && !source && count > 0 && !refresh_neigh &&
+	    !measure) {
+		static char redo[16384];
+		static char *redo_list[1] = { redo };
+		uid_t euid = geteuid();
+		int done;
+
+		/* the socket may be the user's choice: reach it as the user */
+		if (seteuid(uid)) {
+			perror("arping: seteuid");
+			exit(-1);
 		}
-		if (ifr.ifr_flags&(IFF_NOARP|IFF_LOOPBACK)) {
-			if (!quiet)
-				printf("Interface \"%s\" is not ARPable\n", device);
-			exit(dad?0:2);
+		done = arp_daemon_announce(daemon_path, lists, nlists,
+					   device, advert, count, &profile,
+					   redo, sizeof(redo));
+		if (seteuid(euid)) {
+			perror("arping: seteuid");
+			exit(-1);
 		}
-	}
 
-	if (inet_aton(target, &dst) != 1) {
-		struct hostent *hp;
-		hp = gethostbyname2(target, AF_INET);
-		if (!hp) {
-			fprintf(stderr, "arping: unknown host %s\n", target);
-			exit(2);
+		/* whatever it could not do is sent from here, on top */
+		if (done >= 0 && redo[0] != '\0') {
+			sent = brd_sent = done;
+			lists = redo_list;
+			nlists = 1;
+		} else if (done >= 0) {
+			if (!quiet) {
+				printf("Sent %d probes (%d broadcast(s))\n",
+				       done, done);
+				printf("Received 0 response(s)\n");
+			}
+			exit(0);
 		}
-		memcpy(&dst, hp->h_addr, 4);
 	}
 
-	if (source && inet_aton(source, &src) != 1) {
-		fprintf(stderr, "arping: invalid source %s\n", source);
-		exit(2);
+	for (i = 0; i < nlists; i++)
+		add_targets(lists[i]);
+	if (ntargets == 0 || (ntargets > 1 && !unsolicited && !dad))
+		usage();
+	if (dad && ntargets > 1) {
+		/* one shared deadline; stop early only when all are taken */
+		multi_dad = 1;
+		quit_on_reply = 0;
+		dad_index();
 	}
-
-	if (!dad && unsolicited && src.s_addr == 0)
-		src = dst;
-
-	if (!dad || src.s_addr) {
-		struct sockaddr_in saddr;
-		int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-		if (probe_fd < 0) {
-			perror("socket");
-			exit(2);
-		}
-		if (device) {
-			if (setsockopt(probe_fd, SOL_SOCKET, SO_BINDTODEVICE, device, strlen(device)+1) == -1)
-				perror("WARNING: interface is ignored");
-		}
-		memset(&saddr, 0, sizeof(saddr));
-		saddr.sin_family = AF_INET;
-		if (src.s_addr) {
-			saddr.sin_addr = src;
-			if (bind(probe_fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1) {
-				perror("bind");
-				exit(2);
-			}
-		} else if (!dad) {
-			int on = 1;
-			socklen_t alen = sizeof(saddr);
-
-			saddr.sin_port = htons(1025);
-			saddr.sin_addr = dst;
-
-			if (setsockopt(probe_fd, SOL_SOCKET, SO_DONTROUTE, (char*)&on, sizeof(on)) == -1)
-				perror("WARNING: setsockopt(SO_DONTROUTE)");
-			if (connect(probe_fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1) {
-				perror("connect");
-				exit(2);
-			}
-			if (getsockname(probe_fd, (struct sockaddr*)&saddr, &alen) == -1) {
-				perror("getsockname");
-				exit(2);
-			}
-			src = saddr.sin_addr;
-		}
-		close(probe_fd);
-	};
-
-	me.sll_family = AF_PACKET;
-	me.sll_ifindex = ifindex;
-	me.sll_protocol = htons(ETH_P_ARP);
-	if (bind(s, (struct sockaddr*)&me, sizeof(me)) == -1) {
-		perror("bind");
-		exit(2);
+	if (measure) {
+		dad_index();
+		if (!timeout)
+			timeout = 5;
 	}
 
-	if (1) {
-		socklen_t alen = sizeof(me);
-		if (getsockname(s, (struct sockaddr*)&me, &alen) == -1) {
-			perror("getsockname");
-			exit(2);
-		}
-	}
-	if (me.sll_halen == 0) {
-		if (!quiet)
-			printf("Interface \"%s\" is not ARPable (no ll address)\n", device);
-		exit(dad?0:2);
+	if (setuid(uid)) {
+		perror("arping: setuid");
+		exit(-1);
 	}
 
-	he = me;
-	memset(he.sll_addr, -1, he.sll_halen);
+	for (i = 0; i < ntargets; i++) {
+		struct arp_target *t = &targets[i];
+
+		t->src = src;
+		if (!dad && unsolicited && t->src.s_addr == 0)
+			t->src = t->dst;
+		if (!dad || t->src.s_addr)
+			check_source(&t->src, t->dst, ifaces[t->iface].name);
+	}
+	/* the first target is the one probed in the other modes */
+	src = targets[0].src;
+	dst = targets[0].dst;
 
 	if (!quiet) {
-		printf("ARPING %s ", inet_ntoa(dst));
-		printf("from %s %s\n",  inet_ntoa(src), device ? : "");
+		for (i = 0; i < ntargets; i++) {
+			printf("ARPING %s ", inet_ntoa(targets[i].dst));
+			printf("from %s %s\n",  inet_ntoa(targets[i].src),
+			       ifaces[targets[i].iface].name);
+		}
 	}
 
 	if (!src.s_addr && !dad) {
@@ -547,30 +1427,94 @@ main(int argc, char **argv)
 		exit(2);
 	}
 
-	set_signal(SIGINT, finish);
-	set_signal(SIGALRM, catcher);
+	if (refresh_neigh) {
+		load_neighbours();
+		if (!quiet)
+			printf("Refreshing %d neighbour(s)\n", nneighs);
+	}
 
-	catcher();
+	set_signal(SIGINT, finish);
+	set_filters();
+	if (measure)
+		for (i = 0; i < nifaces; i++)
+			enable_tstamps(&ifaces[i]);
+
+	/*
+	 * The packets go out on the deadlines of the profile, and replies
+	 * are read from the first interface in between.
+	 */
+	if (arp_sched_init(&sched, &profile) < 0) {
+		perror("arping: scheduler");
+		exit(2);
+	}
+	for (i = 0; i < (multi_dad || measure ? nifaces : 1); i++) {
+		if (arp_sched_watch(&sched, ifaces[i].s) < 0) {
+			perror("arping: scheduler");
+			exit(2);
+		}
+	}
+	if (timeout)
+		arp_sched_set_limit(&sched, timeout*1000L);
 
 	while(1) {
 		sigset_t sset, osset;
 		unsigned char packet[4096];
+		char ctrl[512];
 		struct sockaddr_ll from;
-		socklen_t alen = sizeof(from);
-		int cc;
+		struct iovec iov;
+		struct msghdr mh;
+		struct timespec ts;
+		int cc, fd;
+
+		switch (arp_sched_wait(&sched, &fd)) {
+		case ARP_SCHED_SEND:
+			announce();
+			arp_sched_advance(&sched);
+			continue;
+		case ARP_SCHED_LIMIT:
+			finish();
+			continue;
+		case ARP_SCHED_FD:
+			break;
+		default:
+			if (errno != EINTR) {
+				perror("arping: scheduler");
+				exit(2);
+			}
+			continue;
+		}
 
-		if ((cc = recvfrom(s, packet, sizeof(packet), 0,
-				   (struct sockaddr *)&from, &alen)) < 0) {
-			perror("arping: recvfrom");
+		for (i = 0; ifaces[i].s != fd; i++)
+			;
+		/* the transmit timestamps wake us up too */
+		if (measure)
+			read_tx_stamps(&ifaces[i]);
+
+		iov.iov_base = packet;
+		iov.iov_len = sizeof(packet);
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = &from;
+		mh.msg_namelen = sizeof(from);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctrl;
+		mh.msg_controllen = sizeof(ctrl);
+		if ((cc = recvmsg(fd, &mh, MSG_DONTWAIT)) < 0) {
+			if (errno != EAGAIN)
+				perror("arping: recvmsg");
 			continue;
 		}
 		sigemptyset(&sset);
-		sigaddset(&sset, SIGALRM);
 		sigaddset(&sset, SIGINT);
 		sigprocmask(SIG_BLOCK, &sset, &osset);
-		recv_pack(packet, cc, &from);
+		if (measure) {
+			if (!get_tstamp(&mh, &ts))
+				clock_gettime(CLOCK_REALTIME, &ts);
+			measure_recv(&ifaces[i], packet, cc, &from, &ts);
+		} else if (multi_dad)
+			dad_recv(&ifaces[i], packet, cc, &from);
+		else
+			recv_pack(packet, cc, &from);
 		sigprocmask(SIG_SETMASK, &osset, NULL);
 	}
 }
-
-
@@ -0,0 +1,873 @@
+/*
+ * send_arp_daemon.c: resident ARP/NA announcer for send_arp
+ *
+ *	Each IPaddr2 start used to fork a send_arp of its own, which opened
+ *	its sockets, looked the interface up and, in the libnet variant,
+ *	killed whatever instance the pid file named.  The announcer keeps one
+ *	socket per interface open, takes the announcements over a Unix stream
+ *	socket, one line each way:
+ *
+ *	request:  <U|A> <address> <interface> <count> <burst>:<first>:<max>\n
+ *	reply:    <0|1> <address>\t<packets sent, or message>\n
+ *	notice:   2 <address>\t<ms the restarted announcement is to take>\n
+ *
+ *	and answers each request once its announcement is over.  A request
+ *	for an address which is being announced already restarts that
+ *	announcement on the new profile, with no fewer packets than were
+ *	left, instead of running a second one beside it.  Everyone waiting
+ *	for it is told how long the restarted run is to take, so as not to
+ *	give up on it early, and gets the reply when it ends.
+ *	IPv4 addresses are announced with gratuitous ARP, IPv6 ones with
+ *	unsolicited neighbour advertisements.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* struct in6_pktinfo */
+#endif
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "send_arp_daemon.h"
+
+#define MAXCLIENTS	64
+#define MAXREQ		256	/* bytes of a request line */
+#define MAXCOUNT	10000	/* packets per announcement */
+#define CLIENT_SLACK	2000	/* ms, over the length of the profile */
+
+/* The sockets of one interface, opened on first use */
+struct ann_iface {
+	char			name[IFNAMSIZ];
+	int			open;
+	int			arp;	/* PF_PACKET socket */
+	int			nd;	/* ICMPv6 socket, or -1 */
+	struct sockaddr_ll	me;
+	struct sockaddr_ll	he;
+};
+
+/* One address being announced */
+struct announcement {
+	int			family;
+	unsigned char		addr[16];
+	int			iface;		/* index into ann_ifaces */
+	int			advert;
+	int			left;		/* packets still to send */
+	int			sent;
+	const char		*error;		/* why it stopped early */
+	struct arp_sched	sched;
+	int			*waiters;	/* client descriptors */
+	int			nwaiters;
+};
+
+struct ann_client {
+	int	fd;		/* -1 for a free slot */
+	size_t	len;
+	char	buf[4 * MAXREQ];
+};
+
+static struct ann_iface		*ann_ifaces;
+static int			ann_nifaces;
+static struct announcement	*anns;
+static int			nanns;
+
+static const char *
+socket_path(const char *path)
+{
+	if (path == NULL && (path = getenv("SEND_ARP_SOCKET")) == NULL) {
+		path = SEND_ARP_SOCKET;
+	}
+	return path;
+}
+
+static int
+fill_sockaddr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		return -1;
+	}
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+static void
+iface_close(struct ann_iface *ifc)
+{
+	if (ifc->open) {
+		close(ifc->arp);
+		if (ifc->nd >= 0) {
+			close(ifc->nd);
+		}
+	}
+	ifc->open = 0;
+}
+
+/*
+ * Open (or reopen) the interface.  The packet socket is bound to no
+ * protocol, so that nothing is queued on it: it is only sent on.
+ */
+static const char *
+iface_open(struct ann_iface *ifc)
+{
+	struct ifreq	ifr;
+	socklen_t	alen = sizeof(ifc->me);
+
+	if (ifc->open) {
+		return NULL;
+	}
+	if ((ifc->arp = socket(PF_PACKET, SOCK_DGRAM, 0)) < 0) {
+		return "cannot open packet socket";
+	}
+	ifc->nd = -1;
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, ifc->name, IFNAMSIZ);
+	if (ioctl(ifc->arp, SIOCGIFINDEX, &ifr) < 0) {
+		close(ifc->arp);
+		return "unknown interface";
+	}
+	memset(&ifc->me, 0, sizeof(ifc->me));
+	ifc->me.sll_family = AF_PACKET;
+	ifc->me.sll_ifindex = ifr.ifr_ifindex;
+	if (ioctl(ifc->arp, SIOCGIFFLAGS, &ifr) < 0
+	||	!(ifr.ifr_flags & IFF_UP)) {
+		close(ifc->arp);
+		return "interface is down";
+	}
+	if (bind(ifc->arp, (struct sockaddr *)&ifc->me, sizeof(ifc->me)) < 0
+	||	getsockname(ifc->arp, (struct sockaddr *)&ifc->me, &alen) < 0
+	||	ifc->me.sll_halen == 0) {
+		close(ifc->arp);
+		return "interface has no link layer address";
+	}
+	ifc->he = ifc->me;
+	ifc->he.sll_protocol = htons(ETH_P_ARP);
+	memset(ifc->he.sll_addr, -1, ifc->he.sll_halen);
+	ifc->open = 1;
+	return NULL;
+}
+
+/* The ICMPv6 socket of the interface, for neighbour advertisements */
+static const char *
+iface_open_nd(struct ann_iface *ifc)
+{
+	struct icmp6_filter	filter;
+	int			ifindex = ifc->me.sll_ifindex;
+	int			hops = 255;	/* RFC 4861, 7.1.2 */
+
+	if (ifc->nd >= 0) {
+		return NULL;
+	}
+	if ((ifc->nd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
+		return "cannot open ICMPv6 socket";
+	}
+	ICMP6_FILTER_SETBLOCKALL(&filter);
+	if (setsockopt(ifc->nd, IPPROTO_ICMPV6, ICMP6_FILTER
+	,	&filter, sizeof(filter)) < 0
+	||	setsockopt(ifc->nd, IPPROTO_IPV6, IPV6_MULTICAST_IF
+	,	&ifindex, sizeof(ifindex)) < 0
+	||	setsockopt(ifc->nd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS
+	,	&hops, sizeof(hops)) < 0) {
+		close(ifc->nd);
+		ifc->nd = -1;
+		return "cannot set up ICMPv6 socket";
+	}
+	return NULL;
+}
+
+static int
+iface_lookup(const char *name)
+{
+	struct ann_iface	*ifc;
+	int			j;
+
+	for (j = 0; j < ann_nifaces; j++) {
+		if (strcmp(ann_ifaces[j].name, name) == 0) {
+			return j;
+		}
+	}
+	ifc = realloc(ann_ifaces, (ann_nifaces + 1) * sizeof(*ann_ifaces));
+	if (ifc == NULL) {
+		return -1;
+	}
+	ann_ifaces = ifc;
+	ifc = &ann_ifaces[ann_nifaces];
+	memset(ifc, 0, sizeof(*ifc));
+	strncpy(ifc->name, name, IFNAMSIZ-1);
+	return ann_nifaces++;
+}
+
+/* A gratuitous ARP request, or reply for -A, as send_arp sends them */
+static int
+send_arp_packet(struct ann_iface *ifc, const unsigned char *ip, int advert)
+{
+	unsigned char	buf[64];
+	struct arphdr	*ah = (struct arphdr *)buf;
+	unsigned char	*p = (unsigned char *)(ah + 1);
+	int		halen = ifc->me.sll_halen;
+
+	if (2 * (halen + 4) > (int)(sizeof(buf) - sizeof(*ah))) {
+		errno = EINVAL;
+		return -1;
+	}
+	ah->ar_hrd = htons(ifc->me.sll_hatype);
+	if (ah->ar_hrd == htons(ARPHRD_FDDI)) {
+		ah->ar_hrd = htons(ARPHRD_ETHER);
+	}
+	ah->ar_pro = htons(ETH_P_IP);
+	ah->ar_hln = halen;
+	ah->ar_pln = 4;
+	ah->ar_op = htons(advert ? ARPOP_REPLY : ARPOP_REQUEST);
+	memcpy(p, ifc->me.sll_addr, halen);
+	p += halen;
+	memcpy(p, ip, 4);
+	p += 4;
+	memcpy(p, advert ? ifc->me.sll_addr : ifc->he.sll_addr, halen);
+	p += halen;
+	memcpy(p, ip, 4);
+	p += 4;
+	return sendto(ifc->arp, buf, p - buf, 0
+	,	(struct sockaddr *)&ifc->he, sizeof(ifc->he)) < 0 ? -1 : 0;
+}
+
+/*
+ * An unsolicited neighbour advertisement to all nodes, from the address
+ * itself, with the override flag and our link layer address.
+ */
+static int
+send_na_packet(struct ann_iface *ifc, const unsigned char *ip)
+{
+	unsigned char		buf[sizeof(struct nd_neighbor_advert) + 8 + 32];
+	struct nd_neighbor_advert *na = (struct nd_neighbor_advert *)buf;
+	struct nd_opt_hdr	*opt;
+	struct sockaddr_in6	dst;
+	struct in6_pktinfo	*pi;
+	struct cmsghdr		*cm;
+	struct msghdr		msg;
+	struct iovec		iov;
+	char			cbuf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	int			optlen = (2 + ifc->me.sll_halen + 7) / 8 * 8;
+
+	if (sizeof(*na) + optlen > sizeof(buf)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(buf, 0, sizeof(buf));
+	na->nd_na_type = ND_NEIGHBOR_ADVERT;
+	na->nd_na_flags_reserved = ND_NA_FLAG_OVERRIDE;
+	memcpy(&na->nd_na_target, ip, 16);
+	opt = (struct nd_opt_hdr *)(buf + sizeof(*na));
+	opt->nd_opt_type = ND_OPT_TARGET_LINKADDR;
+	opt->nd_opt_len = optlen / 8;
+	memcpy(opt + 1, ifc->me.sll_addr, ifc->me.sll_halen);
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "ff02::1", &dst.sin6_addr);
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(*na) + optlen;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_name = &dst;
+	msg.msg_namelen = sizeof(dst);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = IPPROTO_IPV6;
+	cm->cmsg_type = IPV6_PKTINFO;
+	cm->cmsg_len = CMSG_LEN(sizeof(*pi));
+	pi = (struct in6_pktinfo *)CMSG_DATA(cm);
+	memcpy(&pi->ipi6_addr, ip, 16);
+	pi->ipi6_ifindex = ifc->me.sll_ifindex;
+	return sendmsg(ifc->nd, &msg, 0) < 0 ? -1 : 0;
+}
+
+static void
+reply(int fd, int rc, const struct announcement *a, const char *ipstr
+,	const char *text)
+{
+	char	addr[INET6_ADDRSTRLEN];
+	char	line[MAXREQ + 64];
+	int	n;
+
+	if (a != NULL) {
+		inet_ntop(a->family, a->addr, addr, sizeof(addr));
+		ipstr = addr;
+	}
+	n = snprintf(line, sizeof(line), "%d %s\t%s\n", rc, ipstr, text);
+	if (n > 0 && n < (int)sizeof(line)) {
+		/* a client gone away is noticed by the main loop */
+		if (write(fd, line, n) < 0) {
+			return;
+		}
+	}
+}
+
+/* Tell everyone waiting how it went, and drop the announcement */
+static void
+announcement_done(int j)
+{
+	struct announcement	*a = &anns[j];
+	char			text[32];
+	int			k;
+
+	snprintf(text, sizeof(text), "%d", a->sent);
+	for (k = 0; k < a->nwaiters; k++) {
+		reply(a->waiters[k], a->error != NULL, a, NULL
+		,	a->error ? a->error : text);
+	}
+	free(a->waiters);
+	anns[j] = anns[--nanns];
+}
+
+/*
+ * Queue the announcement of one request line.  The errors are answered
+ * at once.
+ */
+static void
+request(int fd, char *line)
+{
+	char			*field[5];
+	char			*cp, *save = NULL;
+	struct arp_profile	profile;
+	struct announcement	*a = NULL;
+	unsigned char		addr[16];
+	const char		*err;
+	int			family, iface, count, nfields = 0;
+	int			j, *w, created = 0;
+
+	for (cp = strtok_r(line, " \t\r", &save); cp != NULL && nfields < 5
+	;	cp = strtok_r(NULL, " \t\r", &save)) {
+		field[nfields++] = cp;
+	}
+	if (nfields != 5 || (strcmp(field[0], "U") && strcmp(field[0], "A"))
+	||	strlen(field[2]) >= IFNAMSIZ) {
+		reply(fd, 1, NULL, nfields > 1 ? field[1] : "-"
+		,	"malformed request");
+		return;
+	}
+	family = strchr(field[1], ':') ? AF_INET6 : AF_INET;
+	count = atoi(field[3]);
+	if (inet_pton(family, field[1], addr) != 1) {
+		reply(fd, 1, NULL, field[1], "bad address");
+		return;
+	}
+	if (count < 1 || count > MAXCOUNT
+	||	arp_profile_parse(&profile, field[4], 1000) < 0) {
+		reply(fd, 1, NULL, field[1], "bad count or profile");
+		return;
+	}
+	if ((iface = iface_lookup(field[2])) < 0) {
+		reply(fd, 1, NULL, field[1], "out of memory");
+		return;
+	}
+	err = iface_open(&ann_ifaces[iface]);
+	if (err == NULL && family == AF_INET6) {
+		err = iface_open_nd(&ann_ifaces[iface]);
+	}
+	if (err != NULL) {
+		reply(fd, 1, NULL, field[1], err);
+		return;
+	}
+
+	for (j = 0; j < nanns; j++) {
+		a = &anns[j];
+		if (a->family == family && a->iface == iface
+		&&	memcmp(a->addr, addr, family == AF_INET ? 4 : 16) == 0) {
+			break;
+		}
+	}
+	if (j == nanns) {
+		a = realloc(anns, (nanns + 1) * sizeof(*anns));
+		if (a == NULL) {
+			reply(fd, 1, NULL, field[1], "out of memory");
+			return;
+		}
+		anns = a;
+		a = &anns[nanns++];
+		memset(a, 0, sizeof(*a));
+		a->family = family;
+		memcpy(a->addr, addr, sizeof(addr));
+		a->iface = iface;
+		created = 1;
+	}
+	w = realloc(a->waiters, (a->nwaiters + 1) * sizeof(*w));
+	if (w == NULL) {
+		/* an entry without a waiter nor a schedule would never end */
+		if (created) {
+			--nanns;
+		}
+		reply(fd, 1, NULL, field[1], "out of memory");
+		return;
+	}
+	a->waiters = w;
+	a->waiters[a->nwaiters++] = fd;
+
+	/*
+	 * The latest request wins: start over on its profile, but not with
+	 * fewer packets than were left, and tell who waits how long it takes.
+	 */
+	a->advert = field[0][0] == 'A';
+	if (created || count > a->left) {
+		a->left = count;
+	}
+	arp_sched_start(&a->sched, &profile);
+	if (!created) {
+		char	text[32];
+		long	ms = 0;
+
+		for (j = 1; j < a->left; j++) {
+			ms += arp_profile_delay(&profile, j);
+		}
+		snprintf(text, sizeof(text), "%ld", ms);
+		for (j = 0; j < a->nwaiters; j++) {
+			reply(a->waiters[j], 2, a, NULL, text);
+		}
+	}
+}
+
+/* Send what is due, and finish the announcements which are over */
+static long
+run_due(void)
+{
+	struct timespec	now;
+	long		wait = -1;
+	int		j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (j = nanns - 1; j >= 0; j--) {
+		struct announcement	*a = &anns[j];
+		struct ann_iface	*ifc = &ann_ifaces[a->iface];
+		long			left;
+		int			rc;
+
+		if ((left = arp_sched_ms_left(&a->sched, &now)) > 0) {
+			if (wait < 0 || left < wait) {
+				wait = left;
+			}
+			continue;
+		}
+		if (!ifc->open) {
+			rc = -1;
+		}else if (a->family == AF_INET) {
+			rc = send_arp_packet(ifc, a->addr, a->advert);
+		}else{
+			rc = send_na_packet(ifc, a->addr);
+		}
+		if (rc < 0) {
+			/* reopened by the next request naming it */
+			a->error = ifc->open ? strerror(errno)
+			:	"interface went away";
+			iface_close(ifc);
+			announcement_done(j);
+			continue;
+		}
+		a->sent++;
+		if (--a->left == 0) {
+			announcement_done(j);
+			continue;
+		}
+		arp_sched_advance(&a->sched);
+		left = arp_sched_ms_left(&a->sched, &now);
+		if (wait < 0 || left < wait) {
+			wait = left;
+		}
+	}
+	return wait;
+}
+
+/* A client went away: nobody is to be told about its announcements */
+static void
+forget_client(int fd)
+{
+	int	j, k;
+
+	for (j = 0; j < nanns; j++) {
+		struct announcement	*a = &anns[j];
+
+		for (k = 0; k < a->nwaiters; k++) {
+			if (a->waiters[k] == fd) {
+				a->waiters[k--] = a->waiters[--a->nwaiters];
+			}
+		}
+	}
+}
+
+static int
+client_input(struct ann_client *cl)
+{
+	char	*nl;
+	ssize_t	n;
+
+	n = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len);
+	if (n <= 0) {
+		return (n < 0 && errno == EAGAIN) ? 0 : -1;
+	}
+	cl->len += n;
+	cl->buf[cl->len] = '\0';
+	while ((nl = strchr(cl->buf, '\n')) != NULL) {
+		size_t	used = nl + 1 - cl->buf;
+
+		*nl = '\0';
+		request(cl->fd, cl->buf);
+		memmove(cl->buf, nl + 1, cl->len - used + 1);
+		cl->len -= used;
+	}
+	/* a line longer than any request */
+	return cl->len == sizeof(cl->buf) - 1 ? -1 : 0;
+}
+
+static volatile sig_atomic_t	daemon_stop = 0;
+
+static void
+daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+int
+arp_daemon_run(const char *path)
+{
+	static struct ann_client	clients[MAXCLIENTS];
+	struct pollfd		pfd[MAXCLIENTS + 1];
+	struct sockaddr_un	sun;
+	struct sigaction	sa;
+	struct stat		st;
+	mode_t			mask;
+	long			wait = -1;
+	int			lsock, err;
+	int			j;
+
+	path = socket_path(path);
+	if (fill_sockaddr(&sun, path) < 0) {
+		fprintf(stderr, "send_arp: socket path too long: %s\n", path);
+		return 2;
+	}
+	/* only the socket of an earlier announcer is taken over */
+	if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "send_arp: %s exists and is not a socket\n"
+		,	path);
+		return 2;
+	}
+	unlink(path);
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "send_arp: cannot listen on %s: %s\n"
+		,	path, strerror(errno));
+		return 2;
+	}
+	/* created private, rather than chmod()ed after the fact */
+	mask = umask(S_IRWXG|S_IRWXO);
+	err = bind(lsock, (struct sockaddr *)&sun, sizeof(sun));
+	umask(mask);
+	if (err < 0 || listen(lsock, 16) < 0) {
+		fprintf(stderr, "send_arp: cannot listen on %s: %s\n"
+		,	path, strerror(errno));
+		return 2;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	for (j = 0; j < MAXCLIENTS; j++) {
+		clients[j].fd = -1;
+	}
+
+	while (!daemon_stop) {
+		pfd[0].fd = lsock;
+		pfd[0].events = POLLIN;
+		for (j = 0; j < MAXCLIENTS; j++) {
+			pfd[j + 1].fd = clients[j].fd;
+			pfd[j + 1].events = POLLIN;
+			pfd[j + 1].revents = 0;
+		}
+		if (poll(pfd, MAXCLIENTS + 1, (int)wait) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "send_arp: poll: %s\n", strerror(errno));
+			break;
+		}
+
+		for (j = 0; j < MAXCLIENTS; j++) {
+			struct ann_client	*cl = &clients[j];
+
+			if (cl->fd != -1 && pfd[j + 1].revents
+			&&	client_input(cl) < 0) {
+				forget_client(cl->fd);
+				close(cl->fd);
+				cl->fd = -1;
+			}
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			int	fd = accept(lsock, NULL, NULL);
+
+			for (j = 0; fd >= 0 && j < MAXCLIENTS
+			&&	clients[j].fd != -1; j++) {
+			}
+			if (j == MAXCLIENTS) {
+				/* busy: the client will announce by itself */
+				close(fd);
+			}else if (fd >= 0) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)
+				|	O_NONBLOCK);
+				clients[j].fd = fd;
+				clients[j].len = 0;
+			}
+		}
+
+		wait = run_due();
+	}
+
+	for (j = 0; j < MAXCLIENTS; j++) {
+		if (clients[j].fd != -1) {
+			close(clients[j].fd);
+		}
+	}
+	for (j = 0; j < ann_nifaces; j++) {
+		iface_close(&ann_ifaces[j]);
+	}
+	close(lsock);
+	unlink(path);
+	return daemon_stop ? 0 : 2;
+}
+
+/*
+ * Append the request lines of a list to req.  Returns the number of
+ * lines, or -1 for anything the announcer would not take, such as a
+ * host name: that is left to the caller.
+ */
+static int
+add_requests(char *req, size_t size, const char *list, const char *device
+,	int advert, int count, const struct arp_profile *p)
+{
+	char	copy[MAXREQ * 4];
+	char	*item, *save = NULL;
+	int	n = 0;
+
+	if (strlen(list) >= sizeof(copy)) {
+		return -1;
+	}
+	strcpy(copy, list);
+	for (item = strtok_r(copy, ",", &save); item != NULL
+	;	item = strtok_r(NULL, ",", &save)) {
+		unsigned char	addr[16];
+		const char	*dev = device;
+		char		*at = strchr(item, '@');
+		size_t		len = strlen(req);
+
+		if (at != NULL) {
+			*at = '\0';
+			dev = at + 1;
+		}
+		if (dev == NULL || *dev == '\0'
+		||	strpbrk(dev, " \t\r\n") != NULL
+		||	(inet_pton(AF_INET, item, addr) != 1
+		&&	inet_pton(AF_INET6, item, addr) != 1)) {
+			return -1;
+		}
+		if ((size_t)snprintf(req + len, size - len, "%c %s %s %d %d:%ld:%ld\n"
+		,	advert ? 'A' : 'U', item, dev, count
+		,	p->burst, p->first, p->max) >= size - len) {
+			return -1;
+		}
+		n++;
+	}
+	return n;
+}
+
+/* The request lines of a client, to tell which of them are answered */
+struct ann_request {
+	char		*addr;
+	char		*dev;
+	int		done;
+};
+
+static int
+same_addr(const char *a, const char *b)
+{
+	unsigned char	x[16], y[16];
+
+	if (inet_pton(AF_INET, a, x) == 1) {
+		return inet_pton(AF_INET, b, y) == 1 && memcmp(x, y, 4) == 0;
+	}
+	if (inet_pton(AF_INET6, a, x) == 1) {
+		return inet_pton(AF_INET6, b, y) == 1 && memcmp(x, y, 16) == 0;
+	}
+	return strcmp(a, b) == 0;
+}
+
+static void
+set_timeout(int sock, long ms)
+{
+	struct timeval	tv;
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int
+arp_daemon_announce(const char *path, char **lists, int nlists
+,	const char *device, int advert, int count
+,	const struct arp_profile *p, char *redo, size_t redosize)
+{
+	static char		req[MAXREQ * 64];
+	static char		copy[MAXREQ * 64];
+	char			reply[MAXREQ * 4];
+	struct sockaddr_un	sun;
+	struct ann_request	*rq;
+	char			*line, *save = NULL;
+	long			ms = CLIENT_SLACK;
+	size_t			len = 0;
+	ssize_t			n;
+	int			nreq = 0, left, sent = 0;
+	int			sock, j;
+
+	if (count < 1 || count > MAXCOUNT) {
+		return -1;
+	}
+	req[0] = '\0';
+	for (j = 0; j < nlists; j++) {
+		int	k = add_requests(req, sizeof(req), lists[j], device
+		,	advert, count, p);
+
+		if (k < 0) {
+			return -1;
+		}
+		nreq += k;
+	}
+	if (nreq == 0 || (rq = calloc(nreq, sizeof(*rq))) == NULL) {
+		return -1;
+	}
+	/* "<U|A> <address> <interface> ...": the fields are single words */
+	strcpy(copy, req);
+	for (j = 0, line = strtok_r(copy, "\n", &save); line != NULL
+	;	j++, line = strtok_r(NULL, "\n", &save)) {
+		char	*f;
+
+		rq[j].addr = strtok_r(line + 2, " ", &f);
+		rq[j].dev = strtok_r(NULL, " ", &f);
+	}
+	for (j = 1; j < count; j++) {
+		ms += arp_profile_delay(p, j);
+	}
+
+	if (fill_sockaddr(&sun, socket_path(path)) < 0
+	||	(sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		free(rq);
+		return -1;
+	}
+	set_timeout(sock, ms);
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0
+	||	write(sock, req, strlen(req)) != (ssize_t)strlen(req)) {
+		close(sock);
+		free(rq);
+		return -1;
+	}
+
+	/* one reply per request, in the order they finish */
+	left = nreq;
+	while (left > 0
+	&&	(n = read(sock, reply + len, sizeof(reply) - 1 - len)) > 0) {
+		char	*nl;
+
+		len += n;
+		reply[len] = '\0';
+		for (line = reply; (nl = strchr(line, '\n')) != NULL
+		;	line = nl + 1) {
+			char	*text;
+
+			*nl = '\0';
+			if ((line[0] != '0' && line[0] != '1' && line[0] != '2')
+			||	line[1] != ' '
+			||	(text = strchr(line, '\t')) == NULL) {
+				continue;
+			}
+			*text++ = '\0';
+			/* restarted by someone else: wait for the new run */
+			if (line[0] == '2') {
+				set_timeout(sock, atol(text) + CLIENT_SLACK);
+				continue;
+			}
+			for (j = 0; j < nreq; j++) {
+				if (!rq[j].done && same_addr(rq[j].addr, line + 2)) {
+					break;
+				}
+			}
+			if (j == nreq) {
+				continue;
+			}
+			/* a failure is left to the caller, along with the rest */
+			if (line[0] == '0') {
+				rq[j].done = 1;
+				sent += atoi(text);
+			}else{
+				rq[j].done = -1;
+			}
+			left--;
+		}
+		len -= line - reply;
+		memmove(reply, line, len);
+		if (len == sizeof(reply) - 1) {
+			break;
+		}
+	}
+	close(sock);
+
+	/* what the announcer did not do, for the caller to send itself */
+	redo[0] = '\0';
+	for (j = 0; j < nreq; j++) {
+		size_t	used = strlen(redo);
+
+		if (rq[j].done == 1) {
+			continue;
+		}
+		if ((size_t)snprintf(redo + used, redosize - used, "%s%s@%s"
+		,	used ? "," : "", rq[j].addr, rq[j].dev) >= redosize - used) {
+			free(rq);
+			return -1;
+		}
+	}
+	free(rq);
+	return sent;
+}
@@ -0,0 +1,44 @@
+/*
+ * send_arp_daemon.h: resident ARP/NA announcer for send_arp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SEND_ARP_DAEMON_H
+#define SEND_ARP_DAEMON_H
+
+#include "send_arp_sched.h"
+
+#define SEND_ARP_SOCKET	HA_VARRUNDIR "/" PACKAGE "/rsctmp/send_arp.sock"
+
+/*
+ * Run the announcer on the Unix socket path (NULL for $SEND_ARP_SOCKET or
+ * SEND_ARP_SOCKET) until SIGTERM.  Returns the exit code.
+ */
+int arp_daemon_run(const char *path);
+
+/*
+ * Have the announcer send count packets for each address of the lists,
+ * "ip[@device],...", on the given profile, and wait until it is done.
+ * Returns the number of packets it sent, with the addresses it could not
+ * announce (or did not in time) left in redo as "ip@device,...", empty
+ * if none; or -1 if there is no announcer.  The caller then announces
+ * redo, or all of the lists for -1, itself.
+ */
+int arp_daemon_announce(const char *path, char **lists, int nlists
+,	const char *device, int advert, int count
+,	const struct arp_profile *p, char *redo, size_t redosize);
+
+#endif /* SEND_ARP_DAEMON_H */
@@ -0,0 +1,271 @@
+/*
+ * send_arp_sched.c: announcement scheduler for send_arp
+ *
+ *	Both send_arp variants used to pace themselves with sleeps (mssleep()
+ *	or alarm(1), the latter with a 500 ms floor), so the second packet of
+ *	a failover went out half a second or a second after the first.  Here
+ *	the announcements follow a burst profile, on absolute deadlines of
+ *	the monotonic clock, waited for with a timerfd under epoll, or with
+ *	nanosleep() where there is no timerfd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#if defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_EPOLL_H)
+#	define USE_TIMERFD
+#	include <stdint.h>
+#	include <sys/timerfd.h>
+#	include <sys/epoll.h>
+#endif
+#include "send_arp_sched.h"
+
+#define MAX_GAP	3600000L	/* ms */
+
+int
+arp_profile_parse(struct arp_profile *p, const char *spec, long interval)
+{
+	char	*end;
+
+	p->burst = 1;
+	p->first = interval;
+	if (spec != NULL) {
+		p->burst = strtol(spec, &end, 10);
+		if (*end == ':') {
+			p->first = strtol(end + 1, &end, 10);
+			if (*end == ':') {
+				p->max = strtol(end + 1, &end, 10);
+				goto check;
+			}
+		}
+	}
+	p->max = p->first;
+check:
+	if ((spec != NULL && *end != '\0') || p->burst < 1
+	||	p->first < 0 || p->first > MAX_GAP
+	||	p->max < p->first || p->max > MAX_GAP) {
+		return -1;
+	}
+	return 0;
+}
+
+/* The gap in ms between announcement n-1 and announcement n */
+long
+arp_profile_delay(const struct arp_profile *p, int n)
+{
+	long	d = p->first;
+	int	j;
+
+	if (n < p->burst) {
+		return 0;
+	}
+	for (j = p->burst; j < n && d < p->max; j++) {
+		d = d ? 2 * d : 1;
+	}
+	return d < p->max ? d : p->max;
+}
+
+static void
+ts_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int
+ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec
+	||	(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Start the deadlines of a profile from now, without a timer of their own:
+ * for a caller which waits for several schedules at once.
+ */
+int
+arp_sched_start(struct arp_sched *s, const struct arp_profile *p)
+{
+	memset(s, 0, sizeof(*s));
+	s->profile = *p;
+	s->tfd = s->epfd = -1;
+	if (clock_gettime(CLOCK_MONOTONIC, &s->start) < 0) {
+		return -1;
+	}
+	s->next = s->start;
+	return 0;
+}
+
+/* Milliseconds until the next announcement is due, rounded up; 0 if due */
+long
+arp_sched_ms_left(const struct arp_sched *s, const struct timespec *now)
+{
+	long	ms;
+
+	if (!ts_before(now, &s->next)) {
+		return 0;
+	}
+	ms = (s->next.tv_sec - now->tv_sec) * 1000
+	+	(s->next.tv_nsec - now->tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 1;
+}
+
+int
+arp_sched_init(struct arp_sched *s, const struct arp_profile *p)
+{
+	if (arp_sched_start(s, p) < 0) {
+		return -1;
+	}
+#ifdef USE_TIMERFD
+	{
+		struct epoll_event	ev;
+
+		if ((s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0
+		||	(s->epfd = epoll_create(4)) < 0) {
+			arp_sched_close(s);
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = s->tfd;
+		if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->tfd, &ev) < 0) {
+			arp_sched_close(s);
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/* Stop at ms after the start, whatever is still to be sent */
+void
+arp_sched_set_limit(struct arp_sched *s, long ms)
+{
+	s->limit = s->start;
+	ts_add_ms(&s->limit, ms);
+	s->has_limit = 1;
+}
+
+int
+arp_sched_watch(struct arp_sched *s, int fd)
+{
+#ifdef USE_TIMERFD
+	struct epoll_event	ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Wait for the next announcement, the overall deadline or a watched
+ * descriptor, whichever comes first.  Returns one of ARP_SCHED_*, with
+ * the descriptor in *fd for ARP_SCHED_FD, or -1 (EINTR included).
+ */
+int
+arp_sched_wait(struct arp_sched *s, int *fd)
+{
+	for (;;) {
+		struct timespec		now, deadline = s->next;
+		int			limit = 0;
+
+		if (s->has_limit && !ts_before(&deadline, &s->limit)) {
+			deadline = s->limit;
+			limit = 1;
+		}
+		if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+			return -1;
+		}
+		if (!ts_before(&now, &deadline)) {
+			return limit ? ARP_SCHED_LIMIT : ARP_SCHED_SEND;
+		}
+#ifdef USE_TIMERFD
+		{
+			struct itimerspec	its;
+			struct epoll_event	ev;
+			uint64_t		ticks;
+
+			memset(&its, 0, sizeof(its));
+			its.it_value = deadline;
+			if (timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &its
+			,	NULL) < 0) {
+				return -1;
+			}
+			switch (epoll_wait(s->epfd, &ev, 1, -1)) {
+			case -1:
+				return -1;
+			case 0:
+				continue;
+			}
+			if (ev.data.fd != s->tfd) {
+				*fd = ev.data.fd;
+				return ARP_SCHED_FD;
+			}
+			if (read(s->tfd, &ticks, sizeof(ticks)) < 0
+			&&	errno != EAGAIN) {
+				return -1;
+			}
+		}
+#else
+		{
+			struct timespec	gap;
+
+			gap.tv_sec = deadline.tv_sec - now.tv_sec;
+			gap.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (gap.tv_nsec < 0) {
+				gap.tv_sec--;
+				gap.tv_nsec += 1000000000L;
+			}
+			if (nanosleep(&gap, NULL) < 0) {
+				return -1;
+			}
+		}
+#endif
+	}
+}
+
+/* The announcement due has been sent: schedule the one after it */
+void
+arp_sched_advance(struct arp_sched *s)
+{
+	s->n++;
+	ts_add_ms(&s->next, arp_profile_delay(&s->profile, s->n));
+}
+
+void
+arp_sched_close(struct arp_sched *s)
+{
+	if (s->epfd >= 0) {
+		close(s->epfd);
+	}
+	if (s->tfd >= 0) {
+		close(s->tfd);
+	}
+	s->tfd = s->epfd = -1;
+}
@@ -0,0 +1,72 @@
+/*
+ * send_arp_sched.h: announcement scheduler for send_arp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SEND_ARP_SCHED_H
+#define SEND_ARP_SCHED_H
+
+#include <time.h>
+
+/*
+ * A burst profile, written "burst[:first[:max]]": burst announcements at
+ * once, then gaps starting at first milliseconds and doubling up to max.
+ * "5:50:1000" sends five at once, then at +50, +100, +200, ... ms, and
+ * every second from then on.  first defaults to the repeat interval and
+ * max to first, so that "1" is the plain fixed interval.
+ */
+struct arp_profile {
+	int	burst;
+	long	first;		/* ms */
+	long	max;		/* ms */
+};
+
+int arp_profile_parse(struct arp_profile *p, const char *spec, long interval);
+long arp_profile_delay(const struct arp_profile *p, int n);
+
+/*
+ * The deadlines of a profile, counted from the start, so that the time
+ * spent sending does not push the later ones back.  Where timerfd and
+ * epoll are available, the scheduler also watches descriptors, for a
+ * caller which listens for replies in the meantime.
+ */
+struct arp_sched {
+	struct arp_profile	profile;
+	struct timespec		start;
+	struct timespec		next;	/* deadline of the next announcement */
+	struct timespec		limit;	/* overall deadline, if has_limit */
+	int			has_limit;
+	int			n;	/* announcements scheduled so far */
+	int			tfd;	/* timerfd, or -1 */
+	int			epfd;	/* epoll, or -1 */
+};
+
+enum {
+	ARP_SCHED_SEND,		/* the next announcement is due */
+	ARP_SCHED_LIMIT,	/* the overall deadline has passed */
+	ARP_SCHED_FD		/* a watched descriptor is readable */
+};
+
+int arp_sched_init(struct arp_sched *s, const struct arp_profile *p);
+int arp_sched_start(struct arp_sched *s, const struct arp_profile *p);
+long arp_sched_ms_left(const struct arp_sched *s, const struct timespec *now);
+void arp_sched_set_limit(struct arp_sched *s, long ms);
+int arp_sched_watch(struct arp_sched *s, int fd);
+int arp_sched_wait(struct arp_sched *s, int *fd);
+void arp_sched_advance(struct arp_sched *s);
+void arp_sched_close(struct arp_sched *s);
+
+#endif /* SEND_ARP_SCHED_H */
@@ -92,6 +92,12 @@
  * is from 1 to 999. This must be left-justify, null(0x00) padding, and make 
  * a last byte null. This is the number of locks following this control data.
  *
+ * journal blocks --- 8 bytes. This is printable integer number and range
+ * is from 0 to 9999999. This must be left-justify, null(0x00) padding, and
+ * make a last byte null. This is the number of blocks of the transition
+ * journal reserved for each lock behind the lock data. 0 (or an empty field
+ * written by older versions) means that there is no journal.
+ *
  * padding --- The size of this member depend on blocksize. It is adjusted so 
  * that the whole of the control data including this padding area becomes 
  * blocksize.  The contents of padding area are all 0x00.
@@ -102,6 +108,7 @@ typedef struct sfex_controldata {
   int revision;			/*  revision number */
   size_t blocksize;		/*  block size */
   int numlocks;			/*  number of locks */
+  int journalblocks;		/*  journal blocks per lock */
 } sfex_controldata;
 
 typedef struct sfex_controldata_ondisk {
@@ -110,6 +117,7 @@ typedef struct sfex_controldata_ondisk {
   uint8_t revision[4];
   uint8_t blocksize[8];
   uint8_t numlocks[4];
+  uint8_t journalblocks[8];
 } sfex_controldata_ondisk;
 
 /*
@@ -153,6 +161,68 @@ typedef struct sfex_lockdata_ondisk {
 	uint8_t nodename[256];
 } sfex_lockdata_ondisk;
 
+/*
+ * sfex_journal --- transition journal record
+ *
+ * When the control data has a non-zero number of journal blocks, each lock
+ * owns a circular journal of that many blocks. The journal of the lock
+ * with index i starts at block (numlocks + 1 + (i - 1) * journalblocks).
+ * Only the node holding the lock writes its journal, so no additional
+ * exclusion is needed. Each block holds blocksize / sizeof(on-disk record)
+ * records, and the newest record is the one with the largest sequence
+ * number. The meaning of each member is following;
+ *
+ * type --- 1 byte. printable character. One of SFEX_JOURNAL_ACQUIRE,
+ * SFEX_JOURNAL_RELEASE or SFEX_JOURNAL_HANDOVER. 0x00 means an unused slot.
+ *
+ * sequence number --- 11 bytes. printable integer number, starting from 1
+ * and incremented for each record of the lock.
+ *
+ * increment counter --- 4 bytes. The counter of the lock data when the
+ * record was made.
+ *
+ * wall clock time --- 12 bytes. printable integer number of the seconds
+ * since the Epoch on the writing node.
+ *
+ * monotonic time --- 20 bytes. printable integer number of nanoseconds of
+ * CLOCK_MONOTONIC on the writing node. This orders records of one node
+ * regardless of the changes of the wall clock.
+ *
+ * node name --- 40 bytes. The node which made the record, truncated.
+ *
+ * previous node name --- 40 bytes. For SFEX_JOURNAL_HANDOVER, the node
+ * which held the lock before. Otherwise empty.
+ *
+ * Every printable field must be left-justify, null(0x00) padding, and make
+ * a last byte null.
+ */
+typedef struct sfex_journal {
+  char type;				/* type of transition */
+  unsigned long seq;			/* sequence number */
+  int count;				/* increment counter */
+  unsigned long long wallclock;		/* seconds since the Epoch */
+  unsigned long long monotonic;		/* nanoseconds of CLOCK_MONOTONIC */
+  char nodename[40];			/* node name */
+  char prevnode[40];			/* previous holder */
+} sfex_journal;
+
+typedef struct sfex_journal_ondisk {
+  uint8_t type;
+  uint8_t seq[11];
+  uint8_t count[4];
+  uint8_t wallclock[12];
+  uint8_t monotonic[20];
+  uint8_t nodename[40];
+  uint8_t prevnode[40];
+} sfex_journal_ondisk;
+
+/* character for journal record type. This is used in sfex_journal.type */
+#define SFEX_JOURNAL_ACQUIRE 'a'	/* lock acquired from unlock */
+#define SFEX_JOURNAL_RELEASE 'r'	/* lock released */
+#define SFEX_JOURNAL_HANDOVER 'h'	/* lock taken over from another node */
+
+#define SFEX_MAX_JOURNALBLOCKS 9999999
+
 /* character for lock status. This is used in sfex_lockdata.status */
 #define SFEX_STATUS_UNLOCK 'u' /* unlock */
 #define SFEX_STATUS_LOCK 'l'	/* lock */
@@ -41,13 +41,18 @@ static void usage(FILE *dist) {
 
 static void acquire_lock(void)
 {
+	char journal_type = SFEX_JOURNAL_ACQUIRE;
+	char prevnode[sizeof(ldata.nodename)] = "";
+	unsigned int t = lock_timeout;
+
 	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
 		exit(EXIT_FAILURE);
 	}
 
 	if ((ldata.status == SFEX_STATUS_LOCK) && (strncmp(nodename, (const char*)(ldata.nodename), sizeof(ldata.nodename)))) {
-		unsigned int t = lock_timeout;
+		journal_type = SFEX_JOURNAL_HANDOVER;
+		strncpy(prevnode, (const char*)(ldata.nodename), sizeof(prevnode));
 		while (t > 0)
 			t = sleep(t);
 		read_lockdata(&cdata, &ldata_new, lock_index);
@@ -95,6 +100,16 @@ static void acquire_lock(void)
 		exit(EXIT_FAILURE);
 	}
 	cl_log(LOG_INFO, "lock acquired\n");
+
+	/* record the transition. The journal is written only by the holder,
+	   and a failure here must not cost the lock. */
+	if (journal_open(&cdata, lock_index) == -1) {
+		cl_log(LOG_WARNING, "journal_open failed, transitions are not recorded\n");
+		return;
+	}
+	journal_append(journal_type, ldata.count, nodename,
+		journal_type == SFEX_JOURNAL_HANDOVER ? prevnode : NULL);
+	journal_flush();
 }
 
 static void error_todo (void)
@@ -168,6 +183,13 @@ static void release_lock(void)
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	 * Record the release while the lock is still ours: once it is
+	 * unlocked, the next holder may open the journal and write to it.
+	 */
+	journal_append(SFEX_JOURNAL_RELEASE, ldata.count, nodename, NULL);
+	journal_flush();
+
 	/* lock release */
 	ldata.status = SFEX_STATUS_UNLOCK;
 	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
@@ -341,5 +363,8 @@ int main(int argc, char *argv[])
 	while (1) {
 		sleep (monitor_interval);
 		update_lock();
+		/* journal records left by a failed write are retried after
+		   the lock update, never before it */
+		journal_flush();
 	}
 }
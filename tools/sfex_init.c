@@ -25,7 +25,7 @@
  *
  *-------------------------------------------------------------------------
  *
- * sfex_init [-b <blocksize>] [-n <numlocks>] <device>
+ * sfex_init [-b <blocksize>] [-n <numlocks>] [-j <journal_blocks>] <device>
  *
  * -b <blocksize> --- The size of the block is specified by the number of 
  * bytes. In general, to prevent a partial writing to the disk, the size 
@@ -41,6 +41,13 @@
  * meta-data, you set the value of two or more to numlocks. A necessary disk 
  * area for meta data are (blocksize*(1+numlocks))bytes. Default is 1.
  *
+ * -j <journal_blocks> --- The number of blocks of the transition journal
+ * reserved for each lock. sfex_daemon records every acquire, release and
+ * handover of the lock there, and "sfex_stat -j" displays them. With the
+ * journal, a necessary disk area for meta data are
+ * (blocksize*(1+numlocks*(1+journal_blocks)))bytes. Default is 0, that is
+ * no journal.
+ *
  * <device> --- This is file path which stored meta-data. It is usually 
  * expressed in "/dev/...", because it is partition on the shared disk.
  *
@@ -75,7 +82,7 @@ char *nodename;
  * return value --- void
  */
 static void usage(FILE *dist) {
-  fprintf(dist, "usage: %s [-n <numlocks>] <device>\n", progname);
+  fprintf(dist, "usage: %s [-n <numlocks>] [-j <journal_blocks>] <device>\n", progname);
 }
 
 /*
@@ -94,6 +101,7 @@ main(int argc, char *argv[]) {
 
   /* command line parameter */
   int numlocks = 1;		/* default 1 locks  */
+  int journalblocks = 0;	/* default no journal */
   const char *device;
 
   /*
@@ -111,7 +119,7 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hn:");
+    int c = getopt(argc, argv, "hn:j:");
     if (c == -1)
       break;
     switch (c) {
@@ -132,6 +140,21 @@ main(int argc, char *argv[]) {
 	numlocks = l;
       }
       break;
+    case 'j':			/* -j <journal_blocks> */
+      {
+	char *end;
+	unsigned long l = strtoul(optarg, &end, 10);
+	if (*end != '\0' || l > SFEX_MAX_JOURNALBLOCKS) {
+	  fprintf(stderr,
+		  "%s: ERROR: journal_blocks %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+		  progname, optarg,
+		  (unsigned long)0,
+		  (unsigned long)SFEX_MAX_JOURNALBLOCKS);
+	  exit(4);
+	}
+	journalblocks = l;
+      }
+      break;
     case '?':			/* error */
       usage(stderr);
       exit(4);
@@ -158,7 +181,7 @@ main(int argc, char *argv[]) {
   nodename = get_nodename();
 
   /* create and control data and lock data */
-  init_controldata(&cdata, sector_size, numlocks);
+  init_controldata(&cdata, sector_size, numlocks, journalblocks);
   init_lockdata(&ldata);
 
   /* write out control data and lock data */
@@ -167,6 +190,9 @@ main(int argc, char *argv[]) {
     int index;
     for (index = 1; index <= numlocks; index++)
       write_lockdata(&cdata, &ldata, index);
+    for (index = 1; index <= numlocks; index++)
+      if (clear_journal(&cdata, index) == -1)
+	exit(3);
   }
 
   exit(0);
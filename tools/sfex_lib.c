@@ -37,6 +37,7 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
 #include <syslog.h>
@@ -49,6 +50,22 @@ static void *locked_mem;
 static int dev_fd;
 unsigned long sector_size = 0;
 
+/* largest single read or write of the journal */
+#define JOURNAL_CHUNK (1024 * 1024)
+
+/* state of the transition journal of the lock held by this process */
+static void *journal_mem;	/* image of the blocks being written */
+static size_t journal_blocksize;
+static off_t journal_offset;	/* offset of the journal on the device */
+static int journal_blocks;	/* 0 if the journal is not open */
+static int journal_slots;	/* number of records in the journal */
+static int journal_next;	/* slot of the next record */
+static unsigned long journal_seq;	/* sequence number of the last record */
+static int window_first;	/* journal block of the image's first block */
+static int window_blocks;	/* blocks in the image */
+static int window_room;		/* blocks the image has room for */
+static int window_dirty;	/* the image has records not yet written */
+
 int
 prepare_lock (const char *device)
 {
@@ -138,13 +155,15 @@ get_nodename (void)
  * We initialize each member of sfex_controldata structure.
  */
 void
-init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks)
+init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks,
+		  int journalblocks)
 {
   memcpy (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic));
   cdata->version = SFEX_VERSION;
   cdata->revision = SFEX_REVISION;
   cdata->blocksize = blocksize;
   cdata->numlocks = numlocks;
+  cdata->journalblocks = journalblocks;
 }
 
 /*
@@ -194,6 +213,8 @@ write_controldata (const sfex_controldata * cdata)
 	    (unsigned)cdata->blocksize);
   snprintf ((char *) (block->numlocks), sizeof (block->numlocks), "%d",
 	    cdata->numlocks);
+  snprintf ((char *) (block->journalblocks), sizeof (block->journalblocks),
+	    "%d", cdata->journalblocks);
 
   fd = dev_fd;
   if (lseek (fd, 0, SEEK_SET) == -1) {
@@ -336,7 +357,8 @@ read_controldata (sfex_controldata * cdata)
   if (block->version[sizeof (block->version)-1]
       || block->revision[sizeof (block->revision)-1]
       || block->blocksize[sizeof (block->blocksize)-1]
-      || block->numlocks[sizeof (block->numlocks)-1]) {
+      || block->numlocks[sizeof (block->numlocks)-1]
+      || block->journalblocks[sizeof (block->journalblocks)-1]) {
     cl_log(LOG_ERR, "control data format error.\n");
     return -1;
   }
@@ -350,7 +372,48 @@ read_controldata (sfex_controldata * cdata)
   cdata->revision = atoi ((char *) (block->revision));
   cdata->blocksize = atoi ((char *) (block->blocksize));
   cdata->numlocks = atoi ((char *) (block->numlocks));
+  /* an empty field, written by older versions, reads as no journal */
+  cdata->journalblocks = atoi ((char *) (block->journalblocks));
+
+  return 0;
+}
+
+/*
+ * parse_lockdata --- decode one on-disk lock data block
+ *
+ * block --- pointer for the on-disk image of the lock data
+ *
+ * ldata --- pointer for lock data. Decoded lock data are stored into this
+ * pointed area.
+ */
+static int
+parse_lockdata (const sfex_lockdata_ondisk * block, sfex_lockdata * ldata)
+{
+  /* read lock data from buffer */
+  /* 1. check null terminator of each field 2. check the status */
+  /* We write the offset value of each field of the control data directly.
+   * Because a point using this value is limited to two places, we do not 
+   * use macro. If you chage the following offset values, you must change 
+   * values in the write_lockdata() function.
+   */
+  if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
+    cl_log(LOG_ERR, "lock data format error.\n");
+    return -1;
+  }
+  ldata->status = block->status;
+  if (ldata->status != SFEX_STATUS_UNLOCK
+      && ldata->status != SFEX_STATUS_LOCK) {
+    cl_log(LOG_ERR, "lock data format error.\n");
+    return -1;
+  }
+  ldata->count = atoi ((const char *) (block->count));
+  strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(block->nodename));
 
+#ifdef SFEX_DEBUG
+  cl_log(LOG_INFO, "status: %c\n", ldata->status);
+  cl_log(LOG_INFO, "count: %d\n", ldata->count);
+  cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
+#endif
   return 0;
 }
 
@@ -405,31 +468,495 @@ read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
   }
   while (1);
 
-  /* read control data form buffer */
-  /* 1. check null terminator of each field 2. check the status */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the write_lockdata() function.
-   */
-  if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
-    cl_log(LOG_ERR, "lock data format error.\n");
+  return parse_lockdata (block, ldata);
+}
+
+/*
+ * read_all_lockdata --- read every lock data with a single read
+ *
+ * All the lock data following the control data are read from the file
+ * in one request and decoded into the given array. This is used by
+ * callers which poll all the locks periodically, so that one poll costs
+ * one I/O regardless of the number of locks.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of cdata->numlocks lock data. ldata[0] receives the
+ * lock data of index 1.
+ */
+int
+read_all_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata)
+{
+  static void *bulk_mem;
+  static size_t bulk_size;
+  size_t size = cdata->blocksize * cdata->numlocks;
+  int i;
+
+  if (bulk_size < size) {
+    free (bulk_mem);
+    bulk_mem = NULL;
+    bulk_size = 0;
+    if (posix_memalign (&bulk_mem, SFEX_ODIRECT_ALIGNMENT, size) != 0) {
+      cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
+      bulk_mem = NULL;
+      return -1;
+    }
+    bulk_size = size;
+  }
+
+  /* read from file */
+  do {
+    ssize_t s = pread (dev_fd, bulk_mem, size, cdata->blocksize);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't read lockdata meta-data: %s\n",
+		    strerror (errno));
+      return -1;
+    }
+    else if (s != size) {
+      cl_log(LOG_ERR, "can't read meta-data atomically.\n");
+      return -1;
+    }
+    break;
+  }
+  while (1);
+
+  for (i = 0; i < cdata->numlocks; i++) {
+    const sfex_lockdata_ondisk *block = (const sfex_lockdata_ondisk *)
+      ((const char *) bulk_mem + cdata->blocksize * i);
+    if (parse_lockdata (block, &ldata[i]) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * journal_capacity --- number of records in the journal of one lock
+ *
+ * cdata --- pointer for control data
+ */
+int
+journal_capacity (const sfex_controldata * cdata)
+{
+  return cdata->journalblocks
+    * (int) (cdata->blocksize / sizeof (sfex_journal_ondisk));
+}
+
+/*
+ * journal_position --- offset of the journal of a lock on the device
+ */
+static off_t
+journal_position (const sfex_controldata * cdata, int index)
+{
+  return cdata->blocksize
+    * ((off_t) cdata->numlocks + 1 + (off_t) (index - 1) * cdata->journalblocks);
+}
+
+/*
+ * journal_io --- read or write a part of the journal
+ *
+ * The transfer is split into pieces of JOURNAL_CHUNK bytes at most, as
+ * a single read or write of a large journal would come up short.
+ */
+static int
+journal_io (int out, void *mem, size_t size, off_t offset)
+{
+  while (size > 0) {
+    size_t n = size < JOURNAL_CHUNK ? size : JOURNAL_CHUNK;
+    ssize_t s;
+
+    s = out ? pwrite (dev_fd, mem, n, offset) : pread (dev_fd, mem, n, offset);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't %s journal: %s\n", out ? "write" : "read",
+	     strerror (errno));
+      return -1;
+    }
+    else if (s != n) {
+      cl_log(LOG_ERR, "can't %s journal: short %s.\n",
+	     out ? "write" : "read", out ? "write" : "read");
+      return -1;
+    }
+    mem = (char *) mem + n;
+    offset += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/*
+ * journal_slot --- address of the on-disk record of a slot
+ *
+ * Records never straddle a block boundary, so the tail of a block which
+ * does not hold a whole record is left unused.
+ */
+static sfex_journal_ondisk *
+journal_slot (void *mem, size_t blocksize, int slot)
+{
+  int per_block = blocksize / sizeof (sfex_journal_ondisk);
+
+  return (sfex_journal_ondisk *) ((char *) mem
+				  + blocksize * (slot / per_block))
+    + slot % per_block;
+}
+
+/*
+ * parse_journal --- decode one on-disk journal record
+ *
+ * Return value is 1 for a valid record, 0 for an unused slot and -1 for
+ * a broken record.
+ */
+static int
+parse_journal (const sfex_journal_ondisk * rec, sfex_journal * jdata)
+{
+  if (rec->type == 0)
+    return 0;
+  if ((rec->type != SFEX_JOURNAL_ACQUIRE
+       && rec->type != SFEX_JOURNAL_RELEASE
+       && rec->type != SFEX_JOURNAL_HANDOVER)
+      || rec->seq[sizeof (rec->seq)-1]
+      || rec->count[sizeof (rec->count)-1]
+      || rec->wallclock[sizeof (rec->wallclock)-1]
+      || rec->monotonic[sizeof (rec->monotonic)-1]
+      || rec->nodename[sizeof (rec->nodename)-1]
+      || rec->prevnode[sizeof (rec->prevnode)-1])
+    return -1;
+
+  jdata->type = rec->type;
+  jdata->seq = strtoul ((const char *) rec->seq, NULL, 10);
+  jdata->count = atoi ((const char *) rec->count);
+  jdata->wallclock = strtoull ((const char *) rec->wallclock, NULL, 10);
+  jdata->monotonic = strtoull ((const char *) rec->monotonic, NULL, 10);
+  memcpy (jdata->nodename, rec->nodename, sizeof (jdata->nodename));
+  memcpy (jdata->prevnode, rec->prevnode, sizeof (jdata->prevnode));
+  return jdata->seq ? 1 : -1;
+}
+
+static int
+compare_journal (const void *a, const void *b)
+{
+  const sfex_journal *x = a, *y = b;
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * journal_scan --- pass the valid records of a journal to a function
+ *
+ * The journal is read a piece at a time, so that a journal of any size
+ * is scanned in a buffer of JOURNAL_CHUNK bytes. found is called with
+ * each valid record and its slot. Return value is -1 on error.
+ */
+static int
+journal_scan (const sfex_controldata * cdata, int index,
+	      void (*found) (const sfex_journal *, int, void *), void *arg)
+{
+  int per_block = cdata->blocksize / sizeof (sfex_journal_ondisk);
+  int chunk = JOURNAL_CHUNK / cdata->blocksize;
+  off_t offset = journal_position (cdata, index);
+  sfex_journal jdata;
+  void *mem;
+  int b, i;
+
+  if (chunk < 1)
+    chunk = 1;
+  if (chunk > cdata->journalblocks)
+    chunk = cdata->journalblocks;
+  if (posix_memalign (&mem, SFEX_ODIRECT_ALIGNMENT,
+		      cdata->blocksize * chunk) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
     return -1;
   }
-  ldata->status = block->status;
-  if (ldata->status != SFEX_STATUS_UNLOCK
-      && ldata->status != SFEX_STATUS_LOCK) {
-    cl_log(LOG_ERR, "lock data format error.\n");
+
+  for (b = 0; b < cdata->journalblocks; b += chunk) {
+    int n = cdata->journalblocks - b < chunk ? cdata->journalblocks - b : chunk;
+
+    if (journal_io (0, mem, cdata->blocksize * n,
+		    offset + (off_t) cdata->blocksize * b) == -1) {
+      free (mem);
+      return -1;
+    }
+    for (i = 0; i < n * per_block; i++) {
+      if (parse_journal (journal_slot (mem, cdata->blocksize, i), &jdata) == 1)
+	found (&jdata, b * per_block + i, arg);
+    }
+  }
+  free (mem);
+  return 0;
+}
+
+struct journal_list {
+  sfex_journal *jdata;
+  int n;
+};
+
+static void
+journal_collect (const sfex_journal * jdata, int slot, void *arg)
+{
+  struct journal_list *list = arg;
+
+  list->jdata[list->n++] = *jdata;
+}
+
+/*
+ * read_journal --- read the transition journal of a lock
+ *
+ * The valid records are stored into jdata in order of sequence number.
+ * Broken records, such as the ones torn by a crash, are skipped.
+ *
+ * cdata --- pointer for control data
+ *
+ * index --- index number. 1 origin.
+ *
+ * jdata --- array of journal_capacity(cdata) records
+ *
+ * return value --- number of records, or -1 on error.
+ */
+int
+read_journal (const sfex_controldata * cdata, int index, sfex_journal * jdata)
+{
+  struct journal_list list;
+
+  if (journal_capacity (cdata) == 0)
+    return 0;
+  list.jdata = jdata;
+  list.n = 0;
+  if (journal_scan (cdata, index, journal_collect, &list) == -1)
+    return -1;
+
+  qsort (jdata, list.n, sizeof (*jdata), compare_journal);
+  return list.n;
+}
+
+/*
+ * clear_journal --- erase the transition journal of a lock
+ *
+ * cdata --- pointer for control data
+ *
+ * index --- index number. 1 origin.
+ */
+int
+clear_journal (const sfex_controldata * cdata, int index)
+{
+  size_t size = cdata->blocksize * (size_t) cdata->journalblocks;
+  size_t chunk = size < JOURNAL_CHUNK ? size : JOURNAL_CHUNK;
+  off_t offset = journal_position (cdata, index);
+  void *mem;
+
+  if (size == 0)
+    return 0;
+  /* JOURNAL_CHUNK is a multiple of any block size */
+  if (posix_memalign (&mem, SFEX_ODIRECT_ALIGNMENT, chunk) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
     return -1;
   }
-  ldata->count = atoi ((char *) (block->count));
-  strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(block->nodename));
+  memset (mem, 0, chunk);
 
-#ifdef SFEX_DEBUG
-  cl_log(LOG_INFO, "status: %c\n", ldata->status);
-  cl_log(LOG_INFO, "count: %d\n", ldata->count);
-  cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
-#endif
+  for (; size > 0; size -= chunk, offset += chunk) {
+    if (size < chunk)
+      chunk = size;
+    if (journal_io (1, mem, chunk, offset) == -1) {
+      free (mem);
+      return -1;
+    }
+  }
+  free (mem);
+  return 0;
+}
+
+static void
+journal_newest (const sfex_journal * jdata, int slot, void *arg)
+{
+  if (jdata->seq > journal_seq) {
+    journal_seq = jdata->seq;
+    journal_next = (slot + 1) % journal_slots;
+  }
+}
+
+/*
+ * journal_open --- prepare to append records to the journal of a lock
+ *
+ * This must be called only while this node holds the lock, because the
+ * holder is the only writer of the journal. The journal is scanned once
+ * here for the newest record, and only the block the next record goes to
+ * is kept in memory; after that, records are appended to the memory image
+ * and written out by journal_flush() without reading the device again.
+ * When the device has no journal, this and the other journal functions do
+ * nothing.
+ *
+ * cdata --- pointer for control data
+ *
+ * index --- index number. 1 origin.
+ */
+int
+journal_open (const sfex_controldata * cdata, int index)
+{
+  free (journal_mem);
+  journal_mem = NULL;
+  journal_blocks = 0;
+  window_dirty = 0;
+
+  if (journal_capacity (cdata) == 0)
+    return 0;
+
+  /* the next slot follows the newest record */
+  journal_slots = journal_capacity (cdata);
+  journal_seq = 0;
+  journal_next = 0;
+  if (journal_scan (cdata, index, journal_newest, NULL) == -1)
+    return -1;
+
+  if (posix_memalign (&journal_mem, SFEX_ODIRECT_ALIGNMENT,
+		      cdata->blocksize) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
+    journal_mem = NULL;
+    return -1;
+  }
+  journal_blocksize = cdata->blocksize;
+  journal_offset = journal_position (cdata, index);
+  window_first = journal_next / (journal_blocksize / sizeof (sfex_journal_ondisk));
+  window_blocks = window_room = 1;
+  if (journal_io (0, journal_mem, journal_blocksize,
+		  journal_offset + (off_t) journal_blocksize * window_first) == -1) {
+    free (journal_mem);
+    journal_mem = NULL;
+    return -1;
+  }
+  journal_blocks = cdata->journalblocks;
+  return 0;
+}
+
+/*
+ * journal_advance --- add the next block of the journal to the image
+ *
+ * The block is started empty rather than read, so the oldest records of
+ * the journal are overwritten a block at a time. When nothing is left to
+ * write, the block replaces the image; otherwise the image grows, and
+ * once it covers the whole journal its oldest block is dropped.
+ */
+static int
+journal_advance (void)
+{
+  char *mem = journal_mem;
+
+  if (!window_dirty) {
+    window_first = (window_first + window_blocks) % journal_blocks;
+    window_blocks = 1;
+  }
+  else if (window_blocks == journal_blocks) {
+    memmove (mem, mem + journal_blocksize,
+	     journal_blocksize * (window_blocks - 1));
+    window_first = (window_first + 1) % journal_blocks;
+  }
+  else {
+    if (window_blocks == window_room) {
+      int room = window_room * 2 < journal_blocks
+	? window_room * 2 : journal_blocks;
+      void *grown;
+
+      if (posix_memalign (&grown, SFEX_ODIRECT_ALIGNMENT,
+			  journal_blocksize * room) != 0)
+	return -1;
+      memcpy (grown, journal_mem, journal_blocksize * window_blocks);
+      free (journal_mem);
+      journal_mem = mem = grown;
+      window_room = room;
+    }
+    window_blocks++;
+  }
+  memset (mem + journal_blocksize * (window_blocks - 1), 0, journal_blocksize);
+  return 0;
+}
+
+/*
+ * journal_append --- queue a record for the journal
+ *
+ * The record is only put into the memory image. It reaches the device by
+ * the next journal_flush(), so that the caller can decide when the I/O is
+ * done, and several records can be written by one write.
+ *
+ * type --- SFEX_JOURNAL_ACQUIRE, SFEX_JOURNAL_RELEASE or
+ * SFEX_JOURNAL_HANDOVER
+ *
+ * count --- increment counter of the lock data
+ *
+ * node --- node name of this node
+ *
+ * prevnode --- previous holder for SFEX_JOURNAL_HANDOVER, or NULL
+ */
+void
+journal_append (char type, int count, const char *node, const char *prevnode)
+{
+  sfex_journal_ondisk *rec;
+  struct timespec mono;
+  int per_block, block;
+
+  if (journal_blocks == 0)
+    return;
+
+  /* the record goes to the last block of the image, moving on if full */
+  per_block = journal_slots / journal_blocks;
+  block = journal_next / per_block;
+  if (block != (window_first + window_blocks - 1) % journal_blocks
+      && journal_advance () == -1) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory, journal record lost\n");
+    return;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &mono);
+  rec = journal_slot (journal_mem, journal_blocksize,
+		      (window_blocks - 1) * per_block + journal_next % per_block);
+  memset (rec, 0, sizeof (*rec));
+  rec->type = type;
+  snprintf ((char *) (rec->seq), sizeof (rec->seq), "%lu", ++journal_seq);
+  snprintf ((char *) (rec->count), sizeof (rec->count), "%d", count);
+  snprintf ((char *) (rec->wallclock), sizeof (rec->wallclock), "%llu",
+	    (unsigned long long) time (NULL));
+  snprintf ((char *) (rec->monotonic), sizeof (rec->monotonic), "%llu",
+	    (unsigned long long) mono.tv_sec * 1000000000ULL + mono.tv_nsec);
+  snprintf ((char *) (rec->nodename), sizeof (rec->nodename), "%s", node);
+  snprintf ((char *) (rec->prevnode), sizeof (rec->prevnode), "%s",
+	    prevnode ? prevnode : "");
+
+  window_dirty = 1;
+  journal_next = (journal_next + 1) % journal_slots;
+}
+
+/*
+ * journal_flush --- write the queued journal records
+ *
+ * The blocks of the image are written by one write, or two when they
+ * wrap around the end of the journal. Only the last block, which the next
+ * record goes to, is kept afterwards. On error the records stay queued
+ * and the next call tries again. Callers must keep this away from the
+ * lock data updates whose timing matters.
+ */
+int
+journal_flush (void)
+{
+  int n;
+
+  if (journal_blocks == 0 || !window_dirty)
+    return 0;
+
+  n = journal_blocks - window_first < window_blocks
+    ? journal_blocks - window_first : window_blocks;
+  if (journal_io (1, journal_mem, journal_blocksize * n,
+		  journal_offset + (off_t) journal_blocksize * window_first) == -1
+      || (n < window_blocks
+	  && journal_io (1, (char *) journal_mem + journal_blocksize * n,
+			 journal_blocksize * (window_blocks - n),
+			 journal_offset) == -1))
+    return -1;
+
+  memmove (journal_mem,
+	   (char *) journal_mem + journal_blocksize * (window_blocks - 1),
+	   journal_blocksize);
+  window_first = (window_first + window_blocks - 1) % journal_blocks;
+  window_blocks = 1;
+  window_dirty = 0;
   return 0;
 }
 
@@ -30,13 +30,20 @@
 
 const char *get_progname(const char *argv0);
 char *get_nodename(void);
-void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks);
+void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks, int journalblocks);
 void init_lockdata(sfex_lockdata *ldata);
 void write_controldata(const sfex_controldata *cdata);
 int write_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
 int read_controldata(sfex_controldata *cdata);
 int read_lockdata(const sfex_controldata *cdata, sfex_lockdata *ldata, int index);
+int read_all_lockdata(const sfex_controldata *cdata, sfex_lockdata *ldata);
 int prepare_lock(const char *device);
+int journal_capacity(const sfex_controldata *cdata);
+int clear_journal(const sfex_controldata *cdata, int index);
+int read_journal(const sfex_controldata *cdata, int index, sfex_journal *jdata);
+int journal_open(const sfex_controldata *cdata, int index);
+void journal_append(char type, int count, const char *node, const char *prevnode);
+int journal_flush(void);
 int lock_index_check(sfex_controldata * cdata, int index);
 
 #endif /* LIB_H */
@@ -26,11 +26,29 @@
  *-------------------------------------------------------------------------
  *
  * sfex_stat [-i <index>] <device>
+ * sfex_stat -w [-i <index>] [-p <poll_interval>] [-t <lock_timeout>] <device>
+ * sfex_stat -j [-i <index>] <device>
  *
  * -i <index> --- The index is number of the resource that display the lock.
  * This number is specified by the integer of one or more. When two or more 
  * resources are exclusively controlled by one meta-data, this option is used. 
- * Default is 1.
+ * Default is 1. In the watch mode, all locks are watched unless this option
+ * is given.
+ *
+ * -w, --watch --- Keep the device open and poll the lock data every
+ * poll_interval seconds with one read for all locks. Only the transitions
+ * (holder change, counter stall, unlock) are displayed, together with an
+ * estimated remaining lease time of the lock. This mode runs until it is
+ * killed.
+ *
+ * -j, --journal --- Display the transition journal (see sfex_init -j) of
+ * the locks instead of the lock status. All locks are displayed unless -i
+ * is given.
+ *
+ * -p <poll_interval> --- Interval of the watch mode in seconds. Default is 1.
+ *
+ * -t <lock_timeout> --- The lock_timeout given to sfex_daemon. It is used to
+ * estimate the remaining lease time in the watch mode. Default is 60.
  *
  * <device> --- This is file path which stored meta-data. It is usually 
  * expressed in "/dev/...", because it is partition on the shared disk.
@@ -48,7 +66,10 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
 #include <limits.h>
+#include <time.h>
+#include <getopt.h>
 #if HAVE_UNISTD_H
 #  include <unistd.h>
 #endif
@@ -62,6 +83,27 @@ char *nodename;
 void print_controldata(const sfex_controldata *cdata);
 void print_lockdata(const sfex_lockdata *ldata, int index);
 
+/*
+ * watch_state --- what the watch mode remembers about one lock
+ *
+ * last_change is the monotonic time when the counter was last seen to
+ * move, period is the observed interval between two increments (0 while
+ * it is still unknown).
+ */
+typedef struct watch_state {
+  sfex_lockdata ldata;
+  double last_change;
+  double period;
+  int stalled;
+} watch_state;
+
+static void print_transition(const watch_state *ws, int index, double now,
+			     const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static unsigned int poll_interval = 1;	/* default 1 sec */
+static unsigned int lock_timeout = 60;	/* default of sfex_daemon */
+
 /*
  * print_controldata --- print sfex control data to the display
  *
@@ -79,6 +121,7 @@ print_controldata(const sfex_controldata *cdata)
   printf("  revision: %d\n", cdata->revision);
   printf("  blocksize: %d\n", (int)cdata->blocksize);
   printf("  numlocks: %d\n", cdata->numlocks);
+  printf("  journalblocks: %d\n", cdata->journalblocks);
 }
 
 /*
@@ -99,6 +142,220 @@ print_lockdata(const sfex_lockdata *ldata, int index)
   printf("  nodename: %s\n",ldata->nodename);
 }
 
+/*
+ * print_journal --- print the transition journal of a lock
+ *
+ * The records are printed from the oldest one. Both the wall clock time
+ * and the monotonic time of the writing node are shown, since the wall
+ * clocks of the nodes may disagree.
+ *
+ * jdata --- array of journal records, sorted by sequence number
+ *
+ * n --- number of records
+ *
+ * index --- index number
+ */
+static void
+print_journal(const sfex_journal *jdata, int n, int index)
+{
+  int i;
+
+  printf("journal of lock data #%d: %d records\n", index, n);
+  for (i = 0; i < n; i++) {
+    const sfex_journal *j = &jdata[i];
+    char stamp[32];
+    time_t t = (time_t)j->wallclock;
+
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("  #%lu %s mono %llu.%09llu count %d ", j->seq, stamp,
+	   j->monotonic / 1000000000ULL, j->monotonic % 1000000000ULL,
+	   j->count);
+    switch (j->type) {
+    case SFEX_JOURNAL_ACQUIRE:
+      printf("acquire by %s\n", j->nodename);
+      break;
+    case SFEX_JOURNAL_RELEASE:
+      printf("release by %s\n", j->nodename);
+      break;
+    case SFEX_JOURNAL_HANDOVER:
+      printf("handover %s -> %s\n", j->prevnode, j->nodename);
+      break;
+    }
+  }
+}
+
+/*
+ * now_monotonic --- current time of the monotonic clock in seconds
+ */
+static double
+now_monotonic(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * print_transition --- print one transition of a lock in the watch mode
+ *
+ * The line is prefixed by the wall clock time and, when the lock is held,
+ * suffixed by the estimated remaining lease time. The lease is considered
+ * to end lock_timeout seconds after the last observed counter increment,
+ * since that is when another sfex_daemon would take the lock over.
+ */
+static void
+print_transition(const watch_state *ws, int index, double now,
+		 const char *fmt, ...)
+{
+  char stamp[32];
+  time_t t = time(NULL);
+  va_list ap;
+
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+  printf("%s lock #%d: ", stamp, index);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf(" (count %d", ws->ldata.count);
+  if (ws->ldata.status == SFEX_STATUS_LOCK) {
+    double remain = lock_timeout - (now - ws->last_change);
+    if (ws->period > 0)
+      printf(", update every %.1fs", ws->period);
+    if (remain > 0)
+      printf(", lease ~%.0fs left", remain);
+    else
+      printf(", lease expired");
+  }
+  printf(")\n");
+}
+
+/*
+ * watch_update --- compare new lock data against the previous poll
+ *
+ * ws --- state of the lock, updated in place
+ *
+ * ldata --- lock data read by this poll
+ *
+ * first --- nonzero on the first poll, which prints the initial state
+ */
+static void
+watch_update(watch_state *ws, const sfex_lockdata *ldata, int index,
+	     double now, int first)
+{
+  const sfex_lockdata *old = &ws->ldata;
+  int delta;
+
+  if (first) {
+    ws->ldata = *ldata;
+    ws->last_change = now;
+    ws->period = 0;
+    ws->stalled = 0;
+    if (ldata->status == SFEX_STATUS_LOCK)
+      print_transition(ws, index, now, "held by %s", ldata->nodename);
+    else
+      print_transition(ws, index, now, "unlocked");
+    return;
+  }
+
+  delta = (ldata->count - old->count + SFEX_MAX_COUNT + 1)
+    % (SFEX_MAX_COUNT + 1);
+
+  if (old->status == SFEX_STATUS_LOCK && ldata->status == SFEX_STATUS_UNLOCK) {
+    ws->ldata = *ldata;
+    ws->last_change = now;
+    ws->period = 0;
+    ws->stalled = 0;
+    print_transition(ws, index, now, "unlocked by %s", old->nodename);
+    return;
+  }
+
+  if (ldata->status == SFEX_STATUS_LOCK
+      && (old->status != SFEX_STATUS_LOCK
+	  || strcmp(old->nodename, ldata->nodename))) {
+    char prev[sizeof(old->nodename)];
+
+    snprintf(prev, sizeof(prev), "%s",
+	     old->status == SFEX_STATUS_LOCK ? old->nodename : "(none)");
+    ws->ldata = *ldata;
+    ws->last_change = now;
+    ws->period = 0;
+    ws->stalled = 0;
+    print_transition(ws, index, now, "holder changed %s -> %s",
+		     prev, ldata->nodename);
+    return;
+  }
+
+  ws->ldata = *ldata;
+  if (ldata->status != SFEX_STATUS_LOCK)
+    return;
+
+  if (delta > 0) {
+    /* the counter moved: refine the observed update period */
+    double sample = (now - ws->last_change) / delta;
+    ws->period = ws->period > 0 ? (ws->period * 3 + sample) / 4 : sample;
+    ws->last_change = now;
+    if (ws->stalled) {
+      ws->stalled = 0;
+      print_transition(ws, index, now, "counter resumed on %s",
+		       ldata->nodename);
+    }
+  } else if (!ws->stalled) {
+    /* a holder is late once it misses two of its own updates; until the
+     * period is known, only lock_timeout can tell */
+    double limit = ws->period > 0
+      ? ws->period * 2 + poll_interval : (double)lock_timeout;
+    if (now - ws->last_change > limit) {
+      ws->stalled = 1;
+      print_transition(ws, index, now, "counter stalled on %s",
+		       ldata->nodename);
+    }
+  }
+}
+
+/*
+ * watch_locks --- the watch mode main loop
+ *
+ * The device stays open and all locks are read with a single read per
+ * poll_interval. When index is nonzero, only that lock is reported.
+ * This function returns only on a read error.
+ */
+static void
+watch_locks(const sfex_controldata *cdata, int index)
+{
+  sfex_lockdata *ldata;
+  watch_state *ws;
+  int first = 1;
+
+  ldata = calloc(cdata->numlocks, sizeof(*ldata));
+  ws = calloc(cdata->numlocks, sizeof(*ws));
+  if (ldata == NULL || ws == NULL) {
+    cl_log(LOG_ERR, "%s\n", strerror(errno));
+    exit(3);
+  }
+
+  while (1) {
+    double now;
+    unsigned int t;
+    int i;
+
+    if (read_all_lockdata(cdata, ldata) == -1)
+      exit(3);
+    now = now_monotonic();
+    for (i = 0; i < cdata->numlocks; i++) {
+      if (index && i + 1 != index)
+	continue;
+      watch_update(&ws[i], &ldata[i], i + 1, now, first);
+    }
+    fflush(stdout);
+    first = 0;
+
+    t = poll_interval;
+    while (t > 0)
+      t = sleep(t);
+  }
+}
+
 /*
  * usage --- display command line syntax
  *
@@ -111,6 +368,8 @@ print_lockdata(const sfex_lockdata *ldata, int index)
  */
 static void usage(FILE *dist) {
   fprintf(dist, "usage: %s [-i <index>] <device>\n", progname);
+  fprintf(dist, "       %s -w [-i <index>] [-p <poll_interval>] [-t <lock_timeout>] <device>\n", progname);
+  fprintf(dist, "       %s -j [-i <index>] <device>\n", progname);
 }
 
 /*
@@ -131,7 +390,16 @@ main(int argc, char *argv[]) {
 
   /* command line parameter */
   int index = 1;		/* default 1st lock */
+  int index_given = 0;
+  int watch = 0;
+  int journal = 0;
   const char *device;
+  static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"watch", no_argument, NULL, 'w'},
+    {"journal", no_argument, NULL, 'j'},
+    {NULL, 0, NULL, 0}
+  };
 
   /*
    * startup process
@@ -148,7 +416,7 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hi:");
+    int c = getopt_long(argc, argv, "hi:wjp:t:", long_options, NULL);
     if (c == -1)
       break;
     switch (c) {
@@ -167,6 +435,37 @@ main(int argc, char *argv[]) {
 	  exit(4);
 	}
 	index = l;
+	index_given = 1;
+      }
+      break;
+    case 'w':			/* -w, --watch */
+      watch = 1;
+      break;
+    case 'j':			/* -j, --journal */
+      journal = 1;
+      break;
+    case 'p':			/* -p <poll_interval> */
+      {
+	unsigned long l = strtoul(optarg, NULL, 10);
+	if (l < 1 || l > INT_MAX) {
+	  fprintf(stderr,
+		  "%s: ERROR: poll_interval %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+		  progname, optarg, (unsigned long)1, (unsigned long)INT_MAX);
+	  exit(4);
+	}
+	poll_interval = l;
+      }
+      break;
+    case 't':			/* -t <lock_timeout> */
+      {
+	unsigned long l = strtoul(optarg, NULL, 10);
+	if (l < 1 || l > INT_MAX) {
+	  fprintf(stderr,
+		  "%s: ERROR: lock_timeout %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+		  progname, optarg, (unsigned long)1, (unsigned long)INT_MAX);
+	  exit(4);
+	}
+	lock_timeout = l;
       }
       break;
     case '?':			/* error */
@@ -200,6 +499,38 @@ main(int argc, char *argv[]) {
   if (ret == -1)
     exit(EXIT_FAILURE);
 
+  if (journal) {
+    sfex_journal *jdata;
+    int i;
+
+    if (journal_capacity(&cdata) == 0) {
+      fprintf(stderr, "%s: ERROR: %s has no journal.\n", progname, device);
+      exit(3);
+    }
+    jdata = calloc(journal_capacity(&cdata), sizeof(*jdata));
+    if (jdata == NULL) {
+      cl_log(LOG_ERR, "%s\n", strerror(errno));
+      exit(3);
+    }
+    for (i = 1; i <= cdata.numlocks; i++) {
+      int n;
+
+      if (index_given && i != index)
+	continue;
+      n = read_journal(&cdata, i, jdata);
+      if (n == -1)
+	exit(3);
+      print_journal(jdata, n, i);
+    }
+    exit(0);
+  }
+
+  if (watch) {
+    print_controldata(&cdata);
+    fflush(stdout);
+    watch_locks(&cdata, index_given ? index : 0);
+  }
+
   /* read lock data */
   read_lockdata(&cdata, &ldata, index);
 
@@ -0,0 +1,282 @@
+/* 
+   Socket enumeration for tickle_tcp through NETLINK_SOCK_DIAG
+
+   This replaces `netstat -tn | awk` for the connection snapshots of the
+   portblock agent: one dump request per address family, with a bytecode
+   filter on the local address, and the answers read as binary records.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef HAVE_LINUX_INET_DIAG_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#endif
+
+#include "tickle_diag.h"
+
+#ifdef HAVE_LINUX_INET_DIAG_H
+
+static const unsigned char v4mapped[12] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+/*
+ * The connection of a socket, as one of the family of the local address
+ * asked for.  Returns -1 for an IPv6 socket's own connection where that
+ * is IPv4.
+ */
+static int conn_of(const struct inet_diag_msg *d, int cond_family,
+		   struct tickle_diag_conn *c)
+{
+	int alen = cond_family == AF_INET ? 4 : 16;
+
+	memset(c, 0, sizeof(*c));
+	if (d->idiag_family == AF_INET6 && cond_family == AF_INET) {
+		/* an IPv4 connection of a dual stack socket */
+		if (memcmp(d->id.idiag_src, v4mapped, 12))
+			return -1;
+		c->family = AF_INET;
+		memcpy(c->laddr, &d->id.idiag_src[3], 4);
+		memcpy(c->raddr, &d->id.idiag_dst[3], 4);
+	} else if (d->idiag_family == cond_family) {
+		c->family = d->idiag_family;
+		memcpy(c->laddr, d->id.idiag_src, alen);
+		memcpy(c->raddr, d->id.idiag_dst, alen);
+	} else
+		return -1;
+	c->lport = ntohs(d->id.idiag_sport);
+	c->rport = ntohs(d->id.idiag_dport);
+	return 0;
+}
+
+/*
+ * Dump the established TCP sockets of one family whose local address
+ * matches cond, the family of the address itself.
+ */
+static long dump_family(int family, int cond_family, const unsigned char *addr,
+			tickle_diag_fn fn, void *arg)
+{
+	int alen = cond_family == AF_INET ? 4 : 16;
+	struct {
+		struct nlmsghdr		nh;
+		struct inet_diag_req_v2	req;
+		struct rtattr		rta;
+		struct inet_diag_bc_op	op;
+		struct inet_diag_hostcond cond;
+		unsigned char		addr[16];
+	} msg;
+	struct sockaddr_nl nladdr;
+	static char buf[32768];
+	struct nlmsghdr *nh;
+	int s, len, bclen, ret, done = 0;
+	long n = 0;
+
+	bclen = sizeof(msg.op) + sizeof(msg.cond) + alen;
+	memset(&msg, 0, sizeof(msg));
+	msg.nh.nlmsg_len = NLMSG_LENGTH(sizeof(msg.req)) + RTA_LENGTH(bclen);
+	msg.nh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	msg.nh.nlmsg_seq = 1;
+	msg.req.sdiag_family = family;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states = 1 << TCP_ESTABLISHED;
+	msg.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+	msg.rta.rta_len = RTA_LENGTH(bclen);
+	/* the one condition: on to the end if it holds, past it if not */
+	msg.op.code = INET_DIAG_BC_S_COND;
+	msg.op.yes = bclen;
+	msg.op.no = bclen + 4;
+	msg.cond.family = cond_family;
+	msg.cond.prefix_len = alen * 8;
+	msg.cond.port = -1;
+	memcpy(msg.addr, addr, alen);
+
+	s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(s, &msg, msg.nh.nlmsg_len, 0,
+		   (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		fprintf(stderr, "Failed to send sock_diag request (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	while (!done && (len = recv(s, buf, sizeof(buf), 0)) > 0) {
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			struct inet_diag_msg *d = NLMSG_DATA(nh);
+			struct tickle_diag_conn c;
+
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nh);
+
+				fprintf(stderr, "sock_diag dump failed (%s)\n", strerror(-e->error));
+				close(s);
+				return -1;
+			}
+			if (nh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+				continue;
+
+			if (conn_of(d, cond_family, &c))
+				continue;
+			n++;
+			ret = fn(&c, arg);
+			if (ret < 0) {
+				close(s);
+				return -1;
+			}
+			if (ret) {
+				done = 1;
+				break;
+			}
+		}
+	}
+	close(s);
+	if (!done) {
+		fprintf(stderr, "Failed to read the sock_diag dump (%s)\n", strerror(errno));
+		return -1;
+	}
+	return n;
+}
+
+long tickle_diag_dump(const char *ip, tickle_diag_fn fn, void *arg)
+{
+	unsigned char addr[16];
+	long n4, n6;
+
+	if (inet_pton(AF_INET6, ip, addr) == 1)
+		return dump_family(AF_INET6, AF_INET6, addr, fn, arg);
+	if (inet_pton(AF_INET, ip, addr) != 1) {
+		fprintf(stderr, "Failed to translate %s into an address\n", ip);
+		return -1;
+	}
+	/* IPv6 sockets take IPv4 connections too */
+	n4 = dump_family(AF_INET, AF_INET, addr, fn, arg);
+	if (n4 < 0)
+		return -1;
+	n6 = dump_family(AF_INET6, AF_INET, addr, fn, arg);
+	if (n6 < 0)
+		return -1;
+	return n4 + n6;
+}
+
+/*
+ * The destroy notifications of TCP sockets, of both families.  Joining
+ * their groups takes CAP_NET_ADMIN and Linux 4.9 or later.
+ */
+int tickle_diag_events_open(void)
+{
+	struct sockaddr_nl nladdr;
+	int s;
+
+	s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_SOCK_DIAG);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = 1 << (SKNLGRP_INET_TCP_DESTROY - 1)
+			 | 1 << (SKNLGRP_INET6_TCP_DESTROY - 1);
+	if (bind(s, (struct sockaddr *)&nladdr, sizeof(nladdr)) == -1) {
+		fprintf(stderr, "Failed to join the sock_diag destroy groups (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * Call fn for each socket of the local address ip which the pending
+ * notifications on fd say is gone.  Returns how many, or -1.
+ */
+long tickle_diag_events_read(int fd, const char *ip, tickle_diag_fn fn, void *arg)
+{
+	static char buf[32768];
+	unsigned char addr[16];
+	struct nlmsghdr *nh;
+	int family, alen, len;
+	long n = 0;
+
+	family = inet_pton(AF_INET6, ip, addr) == 1 ? AF_INET6 : AF_INET;
+	if (family == AF_INET && inet_pton(AF_INET, ip, addr) != 1) {
+		fprintf(stderr, "Failed to translate %s into an address\n", ip);
+		return -1;
+	}
+	alen = family == AF_INET ? 4 : 16;
+
+	while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			struct tickle_diag_conn c;
+
+			if (nh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+				continue;
+			if (conn_of(NLMSG_DATA(nh), family, &c)
+			    || memcmp(c.laddr, addr, alen))
+				continue;
+			n++;
+			if (fn(&c, arg) < 0)
+				return -1;
+		}
+	}
+	/* a burst of them may overrun the socket; the next scan catches up */
+	if (len < 0 && errno != EAGAIN && errno != ENOBUFS && errno != EINTR) {
+		fprintf(stderr, "Failed to read sock_diag events (%s)\n", strerror(errno));
+		return -1;
+	}
+	return n;
+}
+
+#else
+
+int tickle_diag_events_open(void)
+{
+	fprintf(stderr, "sock_diag is not supported on this platform\n");
+	return -1;
+}
+
+long tickle_diag_events_read(int fd, const char *ip, tickle_diag_fn fn, void *arg)
+{
+	return -1;
+}
+
+long tickle_diag_dump(const char *ip, tickle_diag_fn fn, void *arg)
+{
+	fprintf(stderr, "sock_diag is not supported on this platform\n");
+	return -1;
+}
+
+#endif
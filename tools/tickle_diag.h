@@ -0,0 +1,53 @@
+/* 
+   Socket enumeration for tickle_tcp through NETLINK_SOCK_DIAG
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TICKLE_DIAG_H
+#define TICKLE_DIAG_H
+
+#include <stdint.h>
+
+/*
+ * An established TCP connection of the local address.  IPv4 connections
+ * of IPv6 sockets (v4-mapped) are given as IPv4 ones.
+ */
+struct tickle_diag_conn {
+	int		family;		/* AF_INET or AF_INET6 */
+	unsigned char	laddr[16];	/* network order, 4 bytes for IPv4 */
+	unsigned char	raddr[16];
+	uint16_t	lport;		/* host order */
+	uint16_t	rport;
+};
+
+typedef int (*tickle_diag_fn)(const struct tickle_diag_conn *c, void *arg);
+
+/*
+ * Call fn for each established TCP connection whose local address is ip.
+ * The kernel does the matching, so that the cost is that of the matching
+ * sockets rather than of the whole table.  A positive return from fn
+ * stops the dump, a negative one fails it.  Returns the number of
+ * connections, or -1.
+ */
+long tickle_diag_dump(const char *ip, tickle_diag_fn fn, void *arg);
+
+/*
+ * Sockets going away: a descriptor to poll, and the reading of what it
+ * has, calling fn for each connection of ip among them.
+ */
+int tickle_diag_events_open(void);
+long tickle_diag_events_read(int fd, const char *ip, tickle_diag_fn fn, void *arg);
+
+#endif /* TICKLE_DIAG_H */
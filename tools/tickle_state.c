@@ -0,0 +1,195 @@
+/* 
+   Connection lists of tickle_tcp, and their binary state file format
+
+   A state file is loaded by pointing the list at the records where they
+   are, in the mapped file, so that loading a million connections costs
+   the checksum over them and nothing per connection.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "tickle_state.h"
+
+void tickle_list_init(struct tickle_list *l)
+{
+	memset(l, 0, sizeof(*l));
+}
+
+static int grow(void **recs, size_t *size, size_t n, size_t recsize)
+{
+	size_t newsize;
+	void *p;
+
+	if (n < *size)
+		return 0;
+	newsize = *size ? 2 * *size : 1024;
+	p = realloc(*recs, newsize * recsize);
+	if (!p) {
+		fprintf(stderr, "Failed realloc()\n");
+		return -1;
+	}
+	*recs = p;
+	*size = newsize;
+	return 0;
+}
+
+int tickle_list_add4(struct tickle_list *l, const struct tickle_rec4 *r)
+{
+	void *recs = l->r4;
+
+	if (grow(&recs, &l->size4, l->n4, sizeof(*r)))
+		return -1;
+	l->r4 = recs;
+	l->r4[l->n4++] = *r;
+	return 0;
+}
+
+int tickle_list_add6(struct tickle_list *l, const struct tickle_rec6 *r)
+{
+	void *recs = l->r6;
+
+	if (grow(&recs, &l->size6, l->n6, sizeof(*r)))
+		return -1;
+	l->r6 = recs;
+	l->r6[l->n6++] = *r;
+	return 0;
+}
+
+void tickle_list_free(struct tickle_list *l)
+{
+	if (l->size4)
+		free(l->r4);
+	if (l->size6)
+		free(l->r6);
+	tickle_list_init(l);
+}
+
+/* Adler-32, carried on over several pieces from sum, which starts at 1 */
+static uint32_t adler32(uint32_t sum, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t a = sum & 0xffff, b = sum >> 16;
+	size_t n;
+
+	while (len) {
+		/* as many as can be added up without overflowing */
+		n = len < 5552 ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+int tickle_state_is_binary(const void *buf, size_t len)
+{
+	return len >= 4 && memcmp(buf, TICKLE_STATE_MAGIC, 4) == 0;
+}
+
+/*
+ * Check a state file of len bytes at buf, and point l at its records.
+ * buf must stay until l is done with.  Returns -1 if it is not valid.
+ */
+int tickle_state_parse(void *buf, size_t len, struct tickle_list *l)
+{
+	struct tickle_state_hdr hdr;
+	size_t hdrlen, n4, n6;
+	uint32_t sum;
+
+	if (len < sizeof(hdr) || !tickle_state_is_binary(buf, len)) {
+		fprintf(stderr, "Not a tickle state file\n");
+		return -1;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (ntohs(hdr.version) != TICKLE_STATE_VERSION) {
+		fprintf(stderr, "Unknown tickle state file version %u\n", ntohs(hdr.version));
+		return -1;
+	}
+	hdrlen = ntohs(hdr.hdrlen);
+	n4 = ntohl(hdr.n4);
+	n6 = ntohl(hdr.n6);
+	/* the header length keeps the records 4 byte aligned */
+	if (hdrlen < sizeof(hdr) || hdrlen % 4
+	    || len != hdrlen + n4 * sizeof(struct tickle_rec4)
+			     + n6 * sizeof(struct tickle_rec6)) {
+		fprintf(stderr, "Truncated or corrupt tickle state file\n");
+		return -1;
+	}
+	sum = adler32(1, (char *)buf + hdrlen, len - hdrlen);
+	if (sum != ntohl(hdr.checksum)) {
+		fprintf(stderr, "Bad checksum of the tickle state file\n");
+		return -1;
+	}
+
+	tickle_list_init(l);
+	l->r4 = (struct tickle_rec4 *)(void *)((char *)buf + hdrlen);
+	l->n4 = n4;
+	l->r6 = (struct tickle_rec6 *)(void *)(l->r4 + n4);
+	l->n6 = n6;
+	return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Write l as a state file to fd.  Returns -1 with errno set on failure. */
+int tickle_state_write(int fd, const struct tickle_list *l)
+{
+	struct tickle_state_hdr hdr;
+	uint32_t sum;
+
+	sum = adler32(1, l->r4, l->n4 * sizeof(*l->r4));
+	sum = adler32(sum, l->r6, l->n6 * sizeof(*l->r6));
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TICKLE_STATE_MAGIC, 4);
+	hdr.version = htons(TICKLE_STATE_VERSION);
+	hdr.hdrlen = htons(sizeof(hdr));
+	hdr.n4 = htonl(l->n4);
+	hdr.n6 = htonl(l->n6);
+	hdr.checksum = htonl(sum);
+
+	if (write_all(fd, &hdr, sizeof(hdr))
+	    || write_all(fd, l->r4, l->n4 * sizeof(*l->r4))
+	    || write_all(fd, l->r6, l->n6 * sizeof(*l->r6)))
+		return -1;
+	return 0;
+}
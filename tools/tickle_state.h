@@ -0,0 +1,81 @@
+/* 
+   Connection lists of tickle_tcp, and their binary state file format
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TICKLE_STATE_H
+#define TICKLE_STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The connections, one packed record each, all in network byte order, so
+ * that a state file can be used as it is, on whichever node.
+ */
+struct tickle_rec4 {
+	uint32_t	laddr;
+	uint32_t	raddr;
+	uint16_t	lport;
+	uint16_t	rport;
+};
+
+struct tickle_rec6 {
+	uint8_t		laddr[16];
+	uint8_t		raddr[16];
+	uint16_t	lport;
+	uint16_t	rport;
+};
+
+/*
+ * The state file: this header, then the n4 IPv4 records and the n6 IPv6
+ * ones.  The checksum is the Adler-32 of the records.  The first byte of
+ * the magic never starts a line of the text format, which is told apart
+ * from it by that.
+ */
+#define TICKLE_STATE_MAGIC	"\177TKL"
+#define TICKLE_STATE_VERSION	1
+
+struct tickle_state_hdr {
+	uint8_t		magic[4];
+	uint16_t	version;
+	uint16_t	hdrlen;		/* of this version, or more */
+	uint32_t	n4;
+	uint32_t	n6;
+	uint32_t	checksum;
+	uint32_t	reserved;
+};
+
+/*
+ * A list of connections.  The records either belong to the list (size4,
+ * size6 non-zero) or point into a state file mapped or read by the caller.
+ */
+struct tickle_list {
+	struct tickle_rec4	*r4;
+	size_t			n4, size4;
+	struct tickle_rec6	*r6;
+	size_t			n6, size6;
+};
+
+void tickle_list_init(struct tickle_list *l);
+int tickle_list_add4(struct tickle_list *l, const struct tickle_rec4 *r);
+int tickle_list_add6(struct tickle_list *l, const struct tickle_rec6 *r);
+void tickle_list_free(struct tickle_list *l);
+
+int tickle_state_is_binary(const void *buf, size_t len);
+int tickle_state_parse(void *buf, size_t len, struct tickle_list *l);
+int tickle_state_write(int fd, const struct tickle_list *l);
+
+#endif /* TICKLE_STATE_H */
@@ -0,0 +1,651 @@
+/* 
+   Streaming replication of the connections of an address, for tickle_tcp
+
+   The snapshot files of the portblock agent are only as fresh as its last
+   monitor, so the node taking over tickles a stale list.  Here a sender
+   follows the connections of the address, scanning them through sock_diag
+   every interval and hearing of the closed ones as they go, and ships the
+   changes as they happen, to a file or to a receiver on the other node.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tickle_stream.h"
+
+struct tickle_set_ent {
+	struct tickle_diag_conn	c;
+	unsigned int		gen;	/* of the last scan it was seen by */
+	int			used;
+};
+
+struct tickle_set {
+	struct tickle_set_ent	*tab;
+	size_t			size;	/* a power of 2, at least 2 * n */
+	size_t			n;
+	unsigned int		gen;
+};
+
+/* FNV-1a of the connection; the unused address bytes are zero */
+static size_t conn_hash(const struct tickle_diag_conn *c)
+{
+	const unsigned char *p = (const unsigned char *)c;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(*c); i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static struct tickle_set_ent *lookup(const struct tickle_set *s,
+				     const struct tickle_diag_conn *c)
+{
+	size_t h = conn_hash(c) & (s->size - 1);
+
+	while (s->tab[h].used && memcmp(&s->tab[h].c, c, sizeof(*c)))
+		h = (h + 1) & (s->size - 1);
+	return &s->tab[h];
+}
+
+static int resize(struct tickle_set *s, size_t size)
+{
+	struct tickle_set_ent *old = s->tab;
+	size_t oldsize = s->size, i;
+
+	s->tab = calloc(size, sizeof(*s->tab));
+	if (!s->tab) {
+		fprintf(stderr, "Failed calloc()\n");
+		s->tab = old;
+		return -1;
+	}
+	s->size = size;
+	for (i = 0; i < oldsize; i++)
+		if (old[i].used)
+			*lookup(s, &old[i].c) = old[i];
+	free(old);
+	return 0;
+}
+
+struct tickle_set *tickle_set_new(void)
+{
+	struct tickle_set *s = calloc(1, sizeof(*s));
+
+	if (!s || resize(s, 1024)) {
+		fprintf(stderr, "Failed calloc()\n");
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* Returns 1 if c is new, 0 if it was there already, -1 if out of memory */
+int tickle_set_add(struct tickle_set *s, const struct tickle_diag_conn *c)
+{
+	struct tickle_set_ent *e;
+
+	if (2 * (s->n + 1) > s->size && resize(s, 2 * s->size))
+		return -1;
+	e = lookup(s, c);
+	e->gen = s->gen;
+	if (e->used)
+		return 0;
+	e->c = *c;
+	e->used = 1;
+	s->n++;
+	return 1;
+}
+
+/* Empty slot i, moving up the entries after it which belong before it */
+static void remove_at(struct tickle_set *s, size_t i)
+{
+	size_t mask = s->size - 1, j = i, k;
+
+	s->tab[i].used = 0;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!s->tab[j].used)
+			break;
+		k = conn_hash(&s->tab[j].c) & mask;
+		/* k, where it wants to be, is not cyclically in (i, j] */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			s->tab[i] = s->tab[j];
+			s->tab[j].used = 0;
+			i = j;
+		}
+	}
+	s->n--;
+}
+
+/* Returns 1 if c was there */
+int tickle_set_del(struct tickle_set *s, const struct tickle_diag_conn *c)
+{
+	struct tickle_set_ent *e = lookup(s, c);
+
+	if (!e->used)
+		return 0;
+	remove_at(s, e - s->tab);
+	return 1;
+}
+
+void tickle_set_clear(struct tickle_set *s)
+{
+	memset(s->tab, 0, s->size * sizeof(*s->tab));
+	s->n = 0;
+}
+
+size_t tickle_set_count(const struct tickle_set *s)
+{
+	return s->n;
+}
+
+int tickle_set_foreach(struct tickle_set *s, tickle_diag_fn fn, void *arg)
+{
+	size_t i;
+
+	for (i = 0; i < s->size; i++)
+		if (s->tab[i].used && fn(&s->tab[i].c, arg))
+			return -1;
+	return 0;
+}
+
+void tickle_set_free(struct tickle_set *s)
+{
+	if (s) {
+		free(s->tab);
+		free(s);
+	}
+}
+
+void tickle_set_begin(struct tickle_set *s)
+{
+	s->gen++;
+}
+
+int tickle_set_sweep(struct tickle_set *s, tickle_diag_fn fn, void *arg)
+{
+	struct tickle_diag_conn *gone;
+	size_t i, n = 0;
+	int ret = 0;
+
+	/* removing moves entries about: find them all first */
+	for (i = 0; i < s->size; i++)
+		if (s->tab[i].used && s->tab[i].gen != s->gen)
+			n++;
+	if (!n)
+		return 0;
+	gone = malloc(n * sizeof(*gone));
+	if (!gone) {
+		fprintf(stderr, "Failed malloc()\n");
+		return -1;
+	}
+	for (i = n = 0; i < s->size; i++)
+		if (s->tab[i].used && s->tab[i].gen != s->gen)
+			gone[n++] = s->tab[i].c;
+	for (i = 0; i < n; i++) {
+		tickle_set_del(s, &gone[i]);
+		if (fn(&gone[i], arg))
+			ret = -1;
+	}
+	free(gone);
+	return ret;
+}
+
+static int put_delta(FILE *f, int op, const struct tickle_diag_conn *c)
+{
+	char laddr[INET6_ADDRSTRLEN], raddr[INET6_ADDRSTRLEN];
+
+	inet_ntop(c->family, c->laddr, laddr, sizeof(laddr));
+	inet_ntop(c->family, c->raddr, raddr, sizeof(raddr));
+	return fprintf(f, "%c %s:%u\t%s:%u\n", op, laddr, c->lport, raddr, c->rport) < 0 ? -1 : 0;
+}
+
+static int put_add(const struct tickle_diag_conn *c, void *arg)
+{
+	return put_delta(arg, TICKLE_DELTA_ADD, c);
+}
+
+static int put_snapshot(FILE *f, struct tickle_set *s)
+{
+	if (fprintf(f, "%c\n", TICKLE_DELTA_RESET) < 0
+	    || tickle_set_foreach(s, put_add, f)
+	    || fprintf(f, "%c\n", TICKLE_DELTA_END) < 0)
+		return -1;
+	return 0;
+}
+
+static int is_socket(const char *spec)
+{
+	return !strncmp(spec, "tcp:", 4) || !strncmp(spec, "unix:", 5);
+}
+
+/*
+ * A stream socket connected to, or listening on, "tcp:[host:]port" or
+ * "unix:path".  Returns -1 on failure, saying why unless quiet.
+ */
+static int endpoint(const char *spec, int listening, int quiet)
+{
+	struct addrinfo hints, *res, *ai;
+	char *copy, *host = NULL, *port;
+	int s = -1, one = 1, err;
+
+	if (!strncmp(spec, "unix:", 5)) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(spec + 5) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "Socket path too long: %s\n", spec + 5);
+			return -1;
+		}
+		strcpy(sun.sun_path, spec + 5);
+		s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (s == -1) {
+			fprintf(stderr, "Failed to open a socket (%s)\n", strerror(errno));
+			return -1;
+		}
+		if (listening) {
+			unlink(sun.sun_path);
+			err = bind(s, (struct sockaddr *)&sun, sizeof(sun)) || listen(s, 4);
+		} else
+			err = connect(s, (struct sockaddr *)&sun, sizeof(sun));
+		if (err) {
+			if (!quiet)
+				fprintf(stderr, "Failed to %s %s (%s)\n",
+					listening ? "listen on" : "connect to", spec, strerror(errno));
+			close(s);
+			return -1;
+		}
+		return s;
+	}
+
+	copy = strdup(spec + 4);
+	if (!copy) {
+		fprintf(stderr, "Failed strdup()\n");
+		return -1;
+	}
+	port = rindex(copy, ':');
+	if (port) {
+		*port++ = 0;
+		host = copy;
+		/* [v6 address] */
+		if (*host == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = 0;
+			host++;
+		}
+	} else
+		port = copy;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "Bad address %s (%s)\n", spec, gai_strerror(err));
+		free(copy);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (s == -1)
+			continue;
+		if (listening) {
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (!bind(s, ai->ai_addr, ai->ai_addrlen) && !listen(s, 4))
+				break;
+		} else if (!connect(s, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(s);
+		s = -1;
+	}
+	if (s == -1 && !quiet)
+		fprintf(stderr, "Failed to %s %s (%s)\n",
+			listening ? "listen on" : "connect to", spec, strerror(errno));
+	freeaddrinfo(res);
+	free(copy);
+	return s;
+}
+
+struct stream {
+	const char		*ip;
+	const char		*dest;
+	int			to_file;
+	FILE			*out;		/* NULL while not connected */
+	int			failed;		/* writing to out failed */
+	int			warned;		/* of not getting through */
+	struct tickle_set	*set;
+	unsigned long		deltas;		/* since the last snapshot */
+};
+
+static void emit(struct stream *st, int op, const struct tickle_diag_conn *c)
+{
+	if (!st->out)
+		return;
+	if (put_delta(st->out, op, c))
+		st->failed = 1;
+	st->deltas++;
+}
+
+static int scan_conn(const struct tickle_diag_conn *c, void *arg)
+{
+	struct stream *st = arg;
+	int ret = tickle_set_add(st->set, c);
+
+	if (ret > 0)
+		emit(st, TICKLE_DELTA_ADD, c);
+	return ret < 0 ? -1 : 0;
+}
+
+static int swept_conn(const struct tickle_diag_conn *c, void *arg)
+{
+	emit(arg, TICKLE_DELTA_DEL, c);
+	return 0;
+}
+
+static int closed_conn(const struct tickle_diag_conn *c, void *arg)
+{
+	struct stream *st = arg;
+
+	if (tickle_set_del(st->set, c) > 0)
+		emit(st, TICKLE_DELTA_DEL, c);
+	return 0;
+}
+
+/*
+ * Flush what was written.  A receiver which cannot be written to is let
+ * go of, to be connected to again; a file which cannot is a failure.
+ */
+static int flush_out(struct stream *st)
+{
+	if (!st->out || (!fflush(st->out) && !st->failed))
+		return 0;
+	if (st->to_file) {
+		fprintf(stderr, "Failed to write %s (%s)\n", st->dest, strerror(errno));
+		return -1;
+	}
+	fprintf(stderr, "Lost %s (%s)\n", st->dest, strerror(errno));
+	fclose(st->out);
+	st->out = NULL;
+	st->failed = 0;
+	return 0;
+}
+
+static int snapshot(struct stream *st)
+{
+	char *tmp;
+	FILE *f;
+
+	st->deltas = 0;
+	if (!st->to_file) {
+		if (st->out && put_snapshot(st->out, st->set))
+			st->failed = 1;
+		return flush_out(st);
+	}
+
+	/* a new file, to replace the one with all the history at once */
+	tmp = malloc(strlen(st->dest) + sizeof(".new"));
+	if (!tmp) {
+		fprintf(stderr, "Failed malloc()\n");
+		return -1;
+	}
+	sprintf(tmp, "%s.new", st->dest);
+	f = fopen(tmp, "w");
+	if (!f || put_snapshot(f, st->set) || fflush(f) || fsync(fileno(f))
+	    || fclose(f) || rename(tmp, st->dest)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	if (st->out)
+		fclose(st->out);
+	st->out = fopen(st->dest, "a");
+	if (!st->out) {
+		fprintf(stderr, "Failed to open %s (%s)\n", st->dest, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void connect_out(struct stream *st)
+{
+	int s = endpoint(st->dest, 0, st->warned);
+
+	if (s == -1) {
+		st->warned = 1;
+		return;
+	}
+	st->out = fdopen(s, "w");
+	if (!st->out) {
+		close(s);
+		return;
+	}
+	st->warned = 0;
+}
+
+/* Take the notifications of closed sockets until interval_ms from now */
+static int wait_events(struct stream *st, int evfd, int interval_ms)
+{
+	struct timespec now, end;
+	struct pollfd pfd;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += interval_ms / 1000;
+	end.tv_nsec += (interval_ms % 1000) * 1000000L;
+	if (end.tv_nsec >= 1000000000L) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000L;
+	}
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0)
+			return 0;
+		pfd.fd = evfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, evfd == -1 ? 0 : 1, ms) <= 0)
+			continue;
+		if (tickle_diag_events_read(evfd, st->ip, closed_conn, st) < 0)
+			return -1;
+		if (flush_out(st))
+			return -1;
+	}
+}
+
+int tickle_stream_run(const char *ip, const char *dest, int interval_ms)
+{
+	struct stream st;
+	int evfd, resync = 1;
+
+	memset(&st, 0, sizeof(st));
+	st.ip = ip;
+	st.dest = dest;
+	st.to_file = !is_socket(dest);
+	st.set = tickle_set_new();
+	if (!st.set)
+		return -1;
+	signal(SIGPIPE, SIG_IGN);
+
+	evfd = tickle_diag_events_open();
+	if (evfd == -1)
+		fprintf(stderr, "Closed connections are only found by the scans\n");
+
+	for (;;) {
+		if (!st.to_file && !st.out) {
+			connect_out(&st);
+			resync = st.out != NULL;
+		}
+		tickle_set_begin(st.set);
+		if (tickle_diag_dump(ip, scan_conn, &st) < 0
+		    || tickle_set_sweep(st.set, swept_conn, &st))
+			return -1;
+		/* a snapshot once the log of changes outgrows the set */
+		if (resync || st.deltas > 2 * tickle_set_count(st.set) + 1024) {
+			if (snapshot(&st))
+				return -1;
+			resync = 0;
+		}
+		if (flush_out(&st) || wait_events(&st, evfd, interval_ms))
+			return -1;
+	}
+}
+
+/* Where the lines received go: the file, or the snapshot to replace it */
+struct receiver {
+	const char	*path;
+	char		*tmp;
+	FILE		*out;
+	FILE		*snap;		/* while a snapshot comes in */
+};
+
+static void drop_snapshot(struct receiver *r)
+{
+	if (r->snap) {
+		fclose(r->snap);
+		unlink(r->tmp);
+		r->snap = NULL;
+	}
+}
+
+static int take_line(struct receiver *r, const char *line, size_t len)
+{
+	if (line[0] == TICKLE_DELTA_RESET) {
+		drop_snapshot(r);
+		r->snap = fopen(r->tmp, "w");
+		if (!r->snap) {
+			fprintf(stderr, "Failed to open %s (%s)\n", r->tmp, strerror(errno));
+			return -1;
+		}
+	}
+	if (fwrite(line, 1, len, r->snap ? r->snap : r->out) != len) {
+		fprintf(stderr, "Failed to write %s (%s)\n", r->snap ? r->tmp : r->path, strerror(errno));
+		return -1;
+	}
+	if (line[0] == TICKLE_DELTA_END && r->snap) {
+		if (fflush(r->snap) || fsync(fileno(r->snap))
+		    || fclose(r->snap) || rename(r->tmp, r->path)) {
+			fprintf(stderr, "Failed to replace %s (%s)\n", r->path, strerror(errno));
+			r->snap = NULL;
+			return -1;
+		}
+		r->snap = NULL;
+		fclose(r->out);
+		r->out = fopen(r->path, "a");
+		if (!r->out) {
+			fprintf(stderr, "Failed to open %s (%s)\n", r->path, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int tickle_stream_receive(const char *listen_on, const char *path)
+{
+	struct receiver r;
+	struct pollfd pfd[2];
+	static char buf[65536];
+	size_t len = 0, i, start;
+	ssize_t n;
+	int lfd, cfd = -1, fd;
+
+	memset(&r, 0, sizeof(r));
+	r.path = path;
+	r.tmp = malloc(strlen(path) + sizeof(".new"));
+	if (!r.tmp) {
+		fprintf(stderr, "Failed malloc()\n");
+		return -1;
+	}
+	sprintf(r.tmp, "%s.new", path);
+	r.out = fopen(path, "a");
+	if (!r.out) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	lfd = endpoint(listen_on, 1, 0);
+	if (lfd == -1)
+		return -1;
+
+	for (;;) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = cfd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, cfd == -1 ? 1 : 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed poll() (%s)\n", strerror(errno));
+			return -1;
+		}
+		/* a new sender takes over from the one before */
+		if (pfd[0].revents & POLLIN) {
+			fd = accept(lfd, NULL, NULL);
+			if (fd != -1) {
+				if (cfd != -1)
+					close(cfd);
+				drop_snapshot(&r);
+				cfd = fd;
+				len = 0;
+				continue;
+			}
+		}
+		if (cfd == -1 || !pfd[1].revents)
+			continue;
+
+		n = read(cfd, buf + len, sizeof(buf) - len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			close(cfd);
+			cfd = -1;
+			drop_snapshot(&r);
+			continue;
+		}
+		len += n;
+		for (i = start = 0; i < len; i++) {
+			if (buf[i] != '\n')
+				continue;
+			if (take_line(&r, buf + start, i + 1 - start))
+				return -1;
+			start = i + 1;
+		}
+		memmove(buf, buf + start, len - start);
+		len -= start;
+		/* no line is that long */
+		if (len == sizeof(buf))
+			len = 0;
+		if (fflush(r.out)) {
+			fprintf(stderr, "Failed to write %s (%s)\n", path, strerror(errno));
+			return -1;
+		}
+	}
+}
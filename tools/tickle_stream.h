@@ -0,0 +1,74 @@
+/* 
+   Streaming replication of the connections of an address, for tickle_tcp
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TICKLE_STREAM_H
+#define TICKLE_STREAM_H
+
+#include "tickle_diag.h"
+
+/*
+ * The delta log is text, one change a line:
+ *
+ *	=				a snapshot follows: forget the rest
+ *	+ local_ip:port	remote_ip:port	a connection was opened
+ *	- local_ip:port	remote_ip:port	a connection is gone
+ *	.				the end of a snapshot
+ *
+ * tickle_tcp reads a delta log as it reads a plain list, and tickles the
+ * connections left at its end.
+ */
+#define TICKLE_DELTA_RESET	'='
+#define TICKLE_DELTA_ADD	'+'
+#define TICKLE_DELTA_DEL	'-'
+#define TICKLE_DELTA_END	'.'
+
+/* A set of connections, hashed, for following them over time */
+struct tickle_set;
+
+struct tickle_set *tickle_set_new(void);
+int tickle_set_add(struct tickle_set *s, const struct tickle_diag_conn *c);
+int tickle_set_del(struct tickle_set *s, const struct tickle_diag_conn *c);
+void tickle_set_clear(struct tickle_set *s);
+size_t tickle_set_count(const struct tickle_set *s);
+int tickle_set_foreach(struct tickle_set *s, tickle_diag_fn fn, void *arg);
+void tickle_set_free(struct tickle_set *s);
+
+/*
+ * Between tickle_set_begin() and tickle_set_sweep(), the connections
+ * added again are marked; the sweep removes the others, calling fn for
+ * each.
+ */
+void tickle_set_begin(struct tickle_set *s);
+int tickle_set_sweep(struct tickle_set *s, tickle_diag_fn fn, void *arg);
+
+/*
+ * Follow the connections of ip, and send the changes to dest:
+ * "tcp:host:port", "unix:path", or a file path.  A file is replaced by a
+ * fresh snapshot whenever the log of changes grows larger than the set
+ * itself; a peer is sent one on each connection and on the same terms.
+ * Runs until killed, or returns -1 on a failure.
+ */
+int tickle_stream_run(const char *ip, const char *dest, int interval_ms);
+
+/*
+ * Take the delta logs sent to "tcp:[host:]port" or "unix:path", one
+ * sender at a time, into the file path, with each snapshot replacing it
+ * at once when complete.  Runs until killed, or returns -1.
+ */
+int tickle_stream_receive(const char *listen_on, const char *path);
+
+#endif /* TICKLE_STREAM_H */
@@ -19,19 +19,38 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* sendmmsg() */
+#endif
+#include <config.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "tickle_diag.h"
+#include "tickle_state.h"
+#include "tickle_stream.h"
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
@@ -41,6 +60,93 @@ typedef union {
 	struct sockaddr_in6 ip6;
 } sock_addr;
 
+typedef union {
+	struct {
+		struct iphdr ip;
+		struct tcphdr tcp;
+	} ip4pkt;
+	struct {
+		struct ip6_hdr ip6;
+		struct tcphdr tcp;
+	} ip6pkt;
+} tickle_pkt;
+
+/*
+ * The tickles go out through one raw socket per address family, opened
+ * when first needed and kept for the whole run, and are handed to the
+ * kernel TICKLE_BATCH at a time, with sendmmsg() where there is one.
+ */
+#define TICKLE_BATCH	64
+#define TICKLE_WAIT_MS	1000	/* for room in the socket buffer */
+
+struct tickle_queue {
+	int		s;		/* raw socket, or -1 */
+	int		family;
+	int		n;		/* packets queued */
+	tickle_pkt	pkt[TICKLE_BATCH];
+	size_t		len[TICKLE_BATCH];
+	sock_addr	dst[TICKLE_BATCH];
+};
+
+struct tickle_batch {
+	struct tickle_queue q4, q6;
+	unsigned long	sent, failed;
+};
+
+/*
+ * A token bucket: rate packets per second, at most burst of them back to
+ * back.  Whatever is queued is sent before waiting for tokens, so that a
+ * batch is never larger than the burst.
+ */
+struct tickle_bucket {
+	double		rate;	/* packets per second, or 0 */
+	double		burst;
+	double		tokens;
+	struct timespec	last;
+};
+
+/*
+ * With -t, the connections, IPv4 then IPv6 ones, are split into one
+ * contiguous shard per thread.  Each thread tickles its shard with sockets and batches of its
+ * own, pinned to a CPU of the -a list if there is one, with its share of
+ * the -r rate and -b burst.
+ */
+#define MAX_THREADS	256
+
+struct tickle_worker {
+	pthread_t		tid;
+	const struct tickle_list *list;
+	size_t			first;	/* index of the shard, into the list */
+	size_t			nconns;
+	int			num;	/* tickles per connection */
+	int			rounds;	/* -s: num rounds over all of them */
+	int			cpu;	/* to pin to, or -1 */
+	struct tickle_bucket	bucket;
+	struct tickle_batch	batch;
+	int			ret;
+};
+
+/*
+ * With -k, the challenge ACKs the tickles draw from the clients are caught
+ * on a packet socket, ahead of any firewall rule on the address, and each
+ * connection is reset at the sequence number its ACK acknowledges.  The
+ * client drops it then and there, instead of once its retransmissions to
+ * the old node time out.
+ */
+#define TICKLE_REAP_LEN	128	/* of a packet: the headers are enough */
+
+struct tickle_reaper {
+	pthread_t		tid;
+	int			s;		/* packet socket */
+	int			pipe[2];	/* closed once the tickles are sent */
+	int			wait_ms;	/* for ACKs after the last tickle */
+	struct tickle_set	*pending;	/* connections not reset yet */
+	struct tickle_batch	batch;
+	size_t			nconns;
+	unsigned long		reset;
+	int			ret;
+};
+
 uint32_t uint16_checksum(uint16_t *data, size_t n);
 void set_nonblocking(int fd);
 void set_close_on_exec(int fd);
@@ -51,6 +157,15 @@ int parse_ip_port(const char *addr, sock_addr *saddr);
 int send_tickle_ack(const sock_addr *dst, 
 		    const sock_addr *src, 
 		    uint32_t seq, uint32_t ack, int rst);
+void tickle_batch_init(struct tickle_batch *b);
+int tickle_queue(struct tickle_batch *b, const sock_addr *dst,
+		 const sock_addr *src, uint32_t seq, uint32_t ack, int rst);
+int tickle_flush(struct tickle_batch *b);
+void tickle_batch_close(struct tickle_batch *b);
+static void *tickle_worker_run(void *arg);
+static void *tickle_reaper_run(void *arg);
+static int collect_conn(const struct tickle_diag_conn *c, void *arg);
+static int save_conns(const char *ip, const char *path, int binary);
 static void usage(void);
 
 uint32_t uint16_checksum(uint16_t *data, size_t n)
@@ -88,16 +203,19 @@ static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
 
 static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
 {
-	uint32_t phdr[2];
 	uint32_t sum = 0;
 	uint16_t sum2;
 
 	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
 	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
 
-	phdr[0] = htonl(n);
-	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
+	/*
+	 * The length and next header of the pseudo-header, added as numbers
+	 * the way tcp_checksum() does: reading them back from a uint32_t
+	 * array through a uint16_t pointer was undefined behaviour, which
+	 * the optimiser is free to turn into a wrong checksum.
+	 */
+	sum += n + ip6->ip6_nxt;
 
 	sum += uint16_checksum(data, n);
 
@@ -204,142 +322,1019 @@ int parse_ip_port(const char *addr, sock_addr *saddr)
 	return ret;
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+/*
+ * Build a tickle ACK (or RST) from src to dst into pkt.  Returns its
+ * length, or -1 if the addresses are not IPv4 or IPv6 ones.
+ */
+static int build_tickle(tickle_pkt *pkt, const sock_addr *dst,
+			const sock_addr *src, uint32_t seq, uint32_t ack, int rst)
 {
-	int s;
-	int ret;
-	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
-	struct {
-		struct iphdr ip;
-		struct tcphdr tcp;
-	} ip4pkt;
-	struct {
-		struct ip6_hdr ip6;
-		struct tcphdr tcp;
-	} ip6pkt;
-
+	memset(pkt, 0, sizeof(*pkt));
 	switch (src->ip.sin_family) {
 	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		ip4pkt.tcp.source  = src->ip.sin_port;
-		ip4pkt.tcp.dest    = dst->ip.sin_port;
-		ip4pkt.tcp.seq     = seq;
-		ip4pkt.tcp.ack_seq = ack;
-		ip4pkt.tcp.ack     = 1;
+		pkt->ip4pkt.ip.version  = 4;
+		pkt->ip4pkt.ip.ihl      = sizeof(pkt->ip4pkt.ip)/4;
+		pkt->ip4pkt.ip.tot_len  = htons(sizeof(pkt->ip4pkt));
+		pkt->ip4pkt.ip.ttl      = 255;
+		pkt->ip4pkt.ip.protocol = IPPROTO_TCP;
+		pkt->ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
+		pkt->ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
+		pkt->ip4pkt.ip.check    = 0;
+
+		pkt->ip4pkt.tcp.source  = src->ip.sin_port;
+		pkt->ip4pkt.tcp.dest    = dst->ip.sin_port;
+		pkt->ip4pkt.tcp.seq     = seq;
+		pkt->ip4pkt.tcp.ack_seq = ack;
+		pkt->ip4pkt.tcp.ack     = 1;
+		if (rst)
+			pkt->ip4pkt.tcp.rst = 1;
+		pkt->ip4pkt.tcp.doff    = sizeof(pkt->ip4pkt.tcp)/4;
+		pkt->ip4pkt.tcp.window  = htons(1234);
+		pkt->ip4pkt.tcp.check   = tcp_checksum((uint16_t *)&pkt->ip4pkt.tcp, sizeof(pkt->ip4pkt.tcp), &pkt->ip4pkt.ip);
+		return sizeof(pkt->ip4pkt);
+
+	case AF_INET6:
+		pkt->ip6pkt.ip6.ip6_vfc  = 0x60;
+		pkt->ip6pkt.ip6.ip6_plen = htons(20);
+		pkt->ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
+		pkt->ip6pkt.ip6.ip6_hlim = 64;
+		pkt->ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
+		pkt->ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
+
+		pkt->ip6pkt.tcp.source   = src->ip6.sin6_port;
+		pkt->ip6pkt.tcp.dest     = dst->ip6.sin6_port;
+		pkt->ip6pkt.tcp.seq      = seq;
+		pkt->ip6pkt.tcp.ack_seq  = ack;
+		pkt->ip6pkt.tcp.ack      = 1;
 		if (rst)
-			ip4pkt.tcp.rst = 1;
-		ip4pkt.tcp.doff    = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.window   = htons(1234);
-		ip4pkt.tcp.check    = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
+			pkt->ip6pkt.tcp.rst  = 1;
+		pkt->ip6pkt.tcp.doff     = sizeof(pkt->ip6pkt.tcp)/4;
+		pkt->ip6pkt.tcp.window   = htons(1234);
+		pkt->ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&pkt->ip6pkt.tcp, sizeof(pkt->ip6pkt.tcp), &pkt->ip6pkt.ip6);
+		return sizeof(pkt->ip6pkt);
 
-		s = socket(AF_INET, SOCK_RAW, htons(IPPROTO_RAW));
+	default:
+		fprintf(stderr, "Not an ipv4/v6 address\n");
+		return -1;
+	}
+}
+
+static int open_raw(int family)
+{
+	int s;
+	uint32_t one = 1;
+
+	if (family == AF_INET) {
+		s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 		if (s == -1) {
 			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
 			return -1;
 		}
-
-		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
-		if (ret != 0) {
+		if (setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one)) != 0) {
 			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
 			close(s);
 			return -1;
 		}
+	} else {
+		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
+		if (s == -1) {
+			fprintf(stderr, "Failed to open sending socket\n");
+			return -1;
+		}
+	}
+	/*
+	 * Packets to neighbours not resolved yet hold on to the socket
+	 * buffer; a blocking socket would hang on them.
+	 */
+	set_nonblocking(s);
+	set_close_on_exec(s);
+	return s;
+}
 
-		set_nonblocking(s);
-		set_close_on_exec(s);
+static int wait_writable(int s)
+{
+	struct pollfd pfd;
 
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
-		close(s);
-		if (ret != sizeof(ip4pkt)) {
+	pfd.fd = s;
+	pfd.events = POLLOUT;
+	return poll(&pfd, 1, TICKLE_WAIT_MS) > 0;
+}
+
+/*
+ * Send the packets of a queue.  A packet which cannot be sent is reported
+ * and skipped, so that one bad address does not hold up the others.
+ */
+static void flush_queue(struct tickle_queue *q, struct tickle_batch *b)
+{
+	int done = 0;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[TICKLE_BATCH];
+	struct iovec iov[TICKLE_BATCH];
+	int i;
+
+	for (i = 0; i < q->n; i++) {
+		iov[i].iov_base = &q->pkt[i];
+		iov[i].iov_len = q->len[i];
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &q->dst[i];
+		msgs[i].msg_hdr.msg_namelen = q->family == AF_INET ?
+			sizeof(q->dst[i].ip) : sizeof(q->dst[i].ip6);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (done < q->n) {
+		int ret = sendmmsg(q->s, msgs + done, q->n - done, 0);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && wait_writable(q->s))
+				continue;
+			if (errno == ENOSYS)
+				break;
+			/* the first one of the rest failed */
+			fprintf(stderr, "Failed sendmmsg (%s)\n", strerror(errno));
+			b->failed++;
+			ret = 1;
+		} else
+			b->sent += ret;
+		done += ret;
+	}
+#endif
+	/* no sendmmsg(): one call per packet */
+	for (; done < q->n; done++) {
+		socklen_t len = q->family == AF_INET ?
+			sizeof(q->dst[done].ip) : sizeof(q->dst[done].ip6);
+		ssize_t ret;
+
+		while ((ret = sendto(q->s, &q->pkt[done], q->len[done], 0,
+				     &q->dst[done].sa, len)) < 0
+		       && (errno == EINTR
+			   || (errno == EAGAIN && wait_writable(q->s))))
+			;
+		if (ret != (ssize_t)q->len[done]) {
 			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
-		}
+			b->failed++;
+		} else
+			b->sent++;
+	}
+	q->n = 0;
+}
+
+void tickle_batch_init(struct tickle_batch *b)
+{
+	memset(b, 0, sizeof(*b));
+	b->q4.s = b->q6.s = -1;
+	b->q4.family = AF_INET;
+	b->q6.family = AF_INET6;
+}
+
+/*
+ * Queue a tickle, sending the queue of its family when that is full.
+ * Returns -1 if the packet cannot be built or there is no socket for it.
+ */
+int tickle_queue(struct tickle_batch *b, const sock_addr *dst,
+		 const sock_addr *src, uint32_t seq, uint32_t ack, int rst)
+{
+	struct tickle_queue *q;
+	int len;
+
+	switch (src->ip.sin_family) {
+	case AF_INET:
+		q = &b->q4;
+		break;
+	case AF_INET6:
+		q = &b->q6;
 		break;
+	default:
+		fprintf(stderr, "Not an ipv4/v6 address\n");
+		return -1;
+	}
+	if (q->s == -1 && (q->s = open_raw(q->family)) == -1)
+		return -1;
 
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		ip6pkt.tcp.source   = src->ip6.sin6_port;
-		ip6pkt.tcp.dest     = dst->ip6.sin6_port;
-		ip6pkt.tcp.seq      = seq;
-		ip6pkt.tcp.ack_seq  = ack;
-		ip6pkt.tcp.ack      = 1;
-		if (rst)
-			ip6pkt.tcp.rst      = 1;
-		ip6pkt.tcp.doff     = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.window   = htons(1234);
-		ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
+	len = build_tickle(&q->pkt[q->n], dst, src, seq, ack, rst);
+	if (len < 0)
+		return -1;
+	q->len[q->n] = len;
+	q->dst[q->n] = *dst;
+	/* the port of a raw IPv6 destination must be 0 */
+	if (q->family == AF_INET6)
+		q->dst[q->n].ip6.sin6_port = 0;
+	if (++q->n == TICKLE_BATCH)
+		flush_queue(q, b);
+	return 0;
+}
 
-		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open sending socket\n");
+/* Send whatever is queued.  Returns -1 if any tickle failed so far. */
+int tickle_flush(struct tickle_batch *b)
+{
+	if (b->q4.n)
+		flush_queue(&b->q4, b);
+	if (b->q6.n)
+		flush_queue(&b->q6, b);
+	return b->failed ? -1 : 0;
+}
+
+void tickle_batch_close(struct tickle_batch *b)
+{
+	if (b->q4.s != -1)
+		close(b->q4.s);
+	if (b->q6.s != -1)
+		close(b->q6.s);
+	b->q4.s = b->q6.s = -1;
+}
+
+int send_tickle_ack(const sock_addr *dst, 
+		    const sock_addr *src, 
+		    uint32_t seq, uint32_t ack, int rst)
+{
+	static struct tickle_batch *b;
+
+	if (!b) {
+		b = malloc(sizeof(*b));
+		if (!b) {
+			fprintf(stderr, "Failed malloc()\n");
 			return -1;
-                }
+		}
+		tickle_batch_init(b);
+	}
+	b->failed = 0;
+	if (tickle_queue(b, dst, src, seq, ack, rst))
+		return -1;
+	return tickle_flush(b);
+}
+
+static void bucket_init(struct tickle_bucket *tb, double rate, double burst)
+{
+	tb->rate = rate;
+	tb->burst = burst < 1 ? 1 : burst;
+	tb->tokens = tb->burst;
+	clock_gettime(CLOCK_MONOTONIC, &tb->last);
+}
+
+/* Wait for a token, sending what is queued in b first if there is none */
+static void bucket_take(struct tickle_bucket *tb, struct tickle_batch *b)
+{
+	struct timespec now, gap;
+	double t;
+
+	if (tb->rate <= 0)
+		return;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		tb->tokens += ((now.tv_sec - tb->last.tv_sec)
+			       + (now.tv_nsec - tb->last.tv_nsec) / 1e9) * tb->rate;
+		if (tb->tokens > tb->burst)
+			tb->tokens = tb->burst;
+		tb->last = now;
+		if (tb->tokens >= 1)
+			break;
+		tickle_flush(b);
+		t = (1 - tb->tokens) / tb->rate;
+		gap.tv_sec = (time_t)t;
+		gap.tv_nsec = (long)((t - (time_t)t) * 1e9);
+		nanosleep(&gap, NULL);
+	}
+	tb->tokens -= 1;
+}
+
+/* The addresses of connection i of the list */
+static void conn_at(const struct tickle_list *l, size_t i, sock_addr *src, sock_addr *dst)
+{
+	memset(src, 0, sizeof(*src));
+	memset(dst, 0, sizeof(*dst));
+	if (i < l->n4) {
+		const struct tickle_rec4 *r = &l->r4[i];
+
+		src->ip.sin_family = dst->ip.sin_family = AF_INET;
+		src->ip.sin_addr.s_addr = r->laddr;
+		src->ip.sin_port = r->lport;
+		dst->ip.sin_addr.s_addr = r->raddr;
+		dst->ip.sin_port = r->rport;
+	} else {
+		const struct tickle_rec6 *r = &l->r6[i - l->n4];
+
+		src->ip6.sin6_family = dst->ip6.sin6_family = AF_INET6;
+		memcpy(&src->ip6.sin6_addr, r->laddr, 16);
+		src->ip6.sin6_port = r->lport;
+		memcpy(&dst->ip6.sin6_addr, r->raddr, 16);
+		dst->ip6.sin6_port = r->rport;
+	}
+}
 
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+static void *tickle_worker_run(void *arg)
+{
+	struct tickle_worker *w = arg;
+	size_t k;
+	int i, r;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "Failed to pin a thread to CPU %d\n", w->cpu);
+	}
+	tickle_batch_init(&w->batch);
+
+	for (r = 0; r < w->rounds; r++) {
+		for (k = w->first; k < w->first + w->nconns; k++) {
+			sock_addr src, dst;
+
+			conn_at(w->list, k, &src, &dst);
+			for (i = 1; i <= w->num; i++) {
+				bucket_take(&w->bucket, &w->batch);
+				if (tickle_queue(&w->batch, &dst, &src, 0, 0, 0)) {
+					fprintf(stderr, "Error while sending tickle ack\n");
+					w->ret = -1;
+					goto out;
+				}
+			}
+		}
+	}
+out:
+	if (tickle_flush(&w->batch))
+		w->ret = -1;
+	tickle_batch_close(&w->batch);
+	return NULL;
+}
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
+/*
+ * A packet socket for the ACKs of the clients: IPv4 and IPv6 TCP to this
+ * host, unfragmented and without extension headers, with ACK set but not
+ * SYN or RST.
+ */
+static int open_reaper(void)
+{
+	struct sock_filter code[] = {
+		/* 0 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF+SKF_AD_PKTTYPE),
+		/* 1 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_HOST, 0, 16),
+		/* 2 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF+SKF_AD_PROTOCOL),
+		/* 3 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, 7),
+		/* 4 */ BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 9),	/* protocol */
+		/* 5 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_TCP, 0, 12),
+		/* 6 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6),	/* frag_off */
+		/* 7 */ BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x3fff, 10, 0),
+		/* 8 */ BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),	/* ihl */
+		/* 9 */ BPF_STMT(BPF_LD|BPF_B|BPF_IND, 13),	/* TCP flags */
+		/* 10 */ BPF_JUMP(BPF_JMP|BPF_JA, 4, 0, 0),
+		/* 11 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IPV6, 0, 6),
+		/* 12 */ BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 6),	/* ip6_nxt */
+		/* 13 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_TCP, 0, 4),
+		/* 14 */ BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 40 + 13),	/* TCP flags */
+		/* 15 */ BPF_STMT(BPF_ALU|BPF_AND|BPF_K, TH_ACK|TH_SYN|TH_RST),
+		/* 16 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, TH_ACK, 0, 1),
+		/* 17 */ BPF_STMT(BPF_RET|BPF_K, TICKLE_REAP_LEN),
+		/* 18 */ BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_fprog prog;
+	int s;
+
+	s = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_ALL));
+	if (s == -1) {
+		fprintf(stderr, "Failed to open a packet socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fprintf(stderr, "Failed to filter the packet socket (%s)\n", strerror(errno));
 		close(s);
+		return -1;
+	}
+	return s;
+}
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
+/* Reset the connection an ACK of a client belongs to, if it is pending */
+static int reap_ack(struct tickle_reaper *rp, const unsigned char *buf, size_t len)
+{
+	struct tickle_diag_conn c;
+	const struct tcphdr *tcp;
+	sock_addr src, dst;
+
+	memset(&c, 0, sizeof(c));
+	memset(&src, 0, sizeof(src));
+	memset(&dst, 0, sizeof(dst));
+	if ((buf[0] >> 4) == 4) {
+		const struct iphdr *ip = (const struct iphdr *)buf;
+
+		if (len < ip->ihl * 4 + sizeof(*tcp))
+			return 0;
+		tcp = (const struct tcphdr *)(buf + ip->ihl * 4);
+		c.family = src.ip.sin_family = dst.ip.sin_family = AF_INET;
+		memcpy(c.laddr, &ip->daddr, 4);
+		memcpy(c.raddr, &ip->saddr, 4);
+		src.ip.sin_addr.s_addr = ip->daddr;
+		src.ip.sin_port = tcp->dest;
+		dst.ip.sin_addr.s_addr = ip->saddr;
+		dst.ip.sin_port = tcp->source;
+	} else {
+		const struct ip6_hdr *ip6 = (const struct ip6_hdr *)buf;
+
+		if (len < sizeof(*ip6) + sizeof(*tcp))
+			return 0;
+		tcp = (const struct tcphdr *)(buf + sizeof(*ip6));
+		c.family = src.ip6.sin6_family = dst.ip6.sin6_family = AF_INET6;
+		memcpy(c.laddr, &ip6->ip6_dst, 16);
+		memcpy(c.raddr, &ip6->ip6_src, 16);
+		src.ip6.sin6_addr = ip6->ip6_dst;
+		src.ip6.sin6_port = tcp->dest;
+		dst.ip6.sin6_addr = ip6->ip6_src;
+		dst.ip6.sin6_port = tcp->source;
+	}
+	c.lport = ntohs(tcp->dest);
+	c.rport = ntohs(tcp->source);
+	if (tickle_set_del(rp->pending, &c) <= 0)
+		return 0;
+
+	/* what the client acknowledges is the one sequence number it takes */
+	rp->reset++;
+	return tickle_queue(&rp->batch, &dst, &src, tcp->ack_seq, tcp->seq, 1);
+}
+
+static long ms_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/*
+ * Reset the connections as their ACKs come in, until all of them are, or
+ * until wait_ms after the tickles are all sent.
+ */
+static void *tickle_reaper_run(void *arg)
+{
+	struct tickle_reaper *rp = arg;
+	unsigned char buf[TICKLE_REAP_LEN];
+	struct pollfd pfd[2];
+	struct timespec sent;
+	int done = 0, timeout = -1;
+	ssize_t len;
+	char c;
+
+	tickle_batch_init(&rp->batch);
+	while (tickle_set_count(rp->pending)) {
+		if (done) {
+			timeout = rp->wait_ms - ms_since(&sent);
+			if (timeout <= 0)
+				break;
 		}
-		break;
+		pfd[0].fd = rp->s;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = rp->pipe[0];
+		pfd[1].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+		if (poll(pfd, done ? 1 : 2, timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "Failed poll() (%s)\n", strerror(errno));
+			rp->ret = -1;
+			break;
+		}
+		if (!done && pfd[1].revents && read(rp->pipe[0], &c, 1) <= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &sent);
+			done = 1;
+		}
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		while ((len = recv(rp->s, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+			if (reap_ack(rp, buf, len)) {
+				rp->ret = -1;
+				goto out;
+			}
+		}
+		if (tickle_flush(&rp->batch))
+			rp->ret = -1;
+	}
+out:
+	if (tickle_flush(&rp->batch))
+		rp->ret = -1;
+	tickle_batch_close(&rp->batch);
+	return NULL;
+}
 
-	default:
-		fprintf(stderr, "Not an ipv4/v6 address\n");
+static int cmp_raddr4(const void *a, const void *b)
+{
+	return memcmp(&((const struct tickle_rec4 *)a)->raddr,
+		      &((const struct tickle_rec4 *)b)->raddr, 4);
+}
+
+static int cmp_raddr6(const void *a, const void *b)
+{
+	return memcmp(((const struct tickle_rec6 *)a)->raddr,
+		      ((const struct tickle_rec6 *)b)->raddr, 16);
+}
+
+/*
+ * Reorder the n records of size bytes at recs for -s: one of each remote
+ * host in turn, so that the tickles to a host with many connections are
+ * spread over the whole run rather than sent back to back, where they
+ * would run into its challenge ACK limit.  Returns -1 if out of memory.
+ */
+static int spread_recs(void *recs, size_t n, size_t size,
+		       int (*cmp)(const void *, const void *))
+{
+	char *base = recs, *out;
+	size_t *next, *end, ngroups = 0, nactive, i, j, k = 0;
+
+	if (n < 2)
+		return 0;
+	out = malloc(n * size);
+	next = malloc(n * sizeof(*next));
+	end = malloc(n * sizeof(*end));
+	if (!out || !next || !end) {
+		fprintf(stderr, "Failed malloc()\n");
+		free(out);
+		free(next);
+		free(end);
 		return -1;
 	}
+	qsort(base, n, size, cmp);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && !cmp(base + i * size, base + j * size); j++)
+			;
+		next[ngroups] = i;
+		end[ngroups++] = j;
+	}
+	/* a round takes one from each host left, and drops the exhausted */
+	for (nactive = ngroups; nactive; ) {
+		for (i = j = 0; i < nactive; i++) {
+			memcpy(out + k++ * size, base + next[i]++ * size, size);
+			if (next[i] < end[i]) {
+				next[j] = next[i];
+				end[j++] = end[i];
+			}
+		}
+		nactive = j;
+	}
+	memcpy(base, out, n * size);
+	free(out);
+	free(next);
+	free(end);
+	return 0;
+}
+
+/* Parse a CPU list such as "0,2-5".  Returns the number of CPUs, or -1. */
+static int parse_cpus(const char *list, int *cpus, int max)
+{
+	const char *p = list;
+	char *endp;
+	int n = 0;
+	long lo, hi;
+
+	while (*p) {
+		lo = hi = strtol(p, &endp, 10);
+		if (endp == p || lo < 0 || lo >= CPU_SETSIZE)
+			return -1;
+		p = endp;
+		if (*p == '-') {
+			hi = strtol(p+1, &endp, 10);
+			if (endp == p+1 || hi < lo || hi >= CPU_SETSIZE)
+				return -1;
+			p = endp;
+		}
+		for (; lo <= hi && n < max; lo++)
+			cpus[n++] = lo;
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+	return n;
+}
+
+static void diag_conn(const sock_addr *src, const sock_addr *dst,
+		      struct tickle_diag_conn *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->family = src->sa.sa_family;
+	if (c->family == AF_INET) {
+		memcpy(c->laddr, &src->ip.sin_addr, 4);
+		memcpy(c->raddr, &dst->ip.sin_addr, 4);
+		c->lport = ntohs(src->ip.sin_port);
+		c->rport = ntohs(dst->ip.sin_port);
+	} else {
+		memcpy(c->laddr, &src->ip6.sin6_addr, 16);
+		memcpy(c->raddr, &dst->ip6.sin6_addr, 16);
+		c->lport = ntohs(src->ip6.sin6_port);
+		c->rport = ntohs(dst->ip6.sin6_port);
+	}
+}
 
+/* Add the connections of l to set.  Returns -1 if out of memory. */
+static int add_list(struct tickle_set *set, const struct tickle_list *l)
+{
+	struct tickle_diag_conn c;
+	size_t i;
+
+	for (i = 0; i < l->n4; i++) {
+		memset(&c, 0, sizeof(c));
+		c.family = AF_INET;
+		memcpy(c.laddr, &l->r4[i].laddr, 4);
+		memcpy(c.raddr, &l->r4[i].raddr, 4);
+		c.lport = ntohs(l->r4[i].lport);
+		c.rport = ntohs(l->r4[i].rport);
+		if (tickle_set_add(set, &c) < 0)
+			return -1;
+	}
+	for (i = 0; i < l->n6; i++) {
+		memset(&c, 0, sizeof(c));
+		c.family = AF_INET6;
+		memcpy(c.laddr, l->r6[i].laddr, 16);
+		memcpy(c.raddr, l->r6[i].raddr, 16);
+		c.lport = ntohs(l->r6[i].lport);
+		c.rport = ntohs(l->r6[i].rport);
+		if (tickle_set_add(set, &c) < 0)
+			return -1;
+	}
 	return 0;
 }
 
+/* Move the records read so far into a set, for the changes to apply to */
+static struct tickle_set *list_to_set(struct tickle_list *l)
+{
+	struct tickle_set *set = tickle_set_new();
+
+	if (!set)
+		return NULL;
+	if (add_list(set, l)) {
+		tickle_set_free(set);
+		return NULL;
+	}
+	tickle_list_free(l);
+	tickle_list_init(l);
+	return set;
+}
+
+/*
+ * Read the "local_ip:port remote_ip:port" lines into l.  Returns -1 on a
+ * bad line.  The log of --stream, where the lines start with '+' or '-'
+ * and a snapshot between '=' and '.' starts over, is played back as well.
+ */
+static int read_conns(FILE *f, struct tickle_list *l)
+{
+	char addrline[128], addr1[64], addr2[64], *p;
+	sock_addr src, dst;
+	struct tickle_set *set = NULL;
+	struct tickle_diag_conn c;
+	int op, ret = -1;
+
+	while(fgets(addrline, sizeof(addrline), f)) {
+		p = addrline;
+		op = TICKLE_DELTA_ADD;
+		if (*p == TICKLE_DELTA_ADD || *p == TICKLE_DELTA_DEL
+		    || *p == TICKLE_DELTA_RESET || *p == TICKLE_DELTA_END) {
+			op = *p++;
+			if (!set && !(set = list_to_set(l)))
+				return -1;
+			if (op == TICKLE_DELTA_RESET)
+				tickle_set_clear(set);
+		}
+		if (sscanf(p, "%63s %63s", addr1, addr2) != 2)
+			continue;
+		if (parse_ip_port(addr1, &src)) {
+			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
+			goto out;
+		}
+		if (parse_ip_port(addr2, &dst)) {
+			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+			goto out;
+		}
+		if (src.sa.sa_family != dst.sa.sa_family) {
+			fprintf(stderr, "Mixed address families in '%s %s'\n", addr1, addr2);
+			goto out;
+		}
+		if (set) {
+			diag_conn(&src, &dst, &c);
+			if (op == TICKLE_DELTA_DEL)
+				tickle_set_del(set, &c);
+			else if (tickle_set_add(set, &c) < 0)
+				goto out;
+		} else if (src.sa.sa_family == AF_INET) {
+			struct tickle_rec4 r;
+
+			r.laddr = src.ip.sin_addr.s_addr;
+			r.lport = src.ip.sin_port;
+			r.raddr = dst.ip.sin_addr.s_addr;
+			r.rport = dst.ip.sin_port;
+			if (tickle_list_add4(l, &r))
+				goto out;
+		} else {
+			struct tickle_rec6 r;
+
+			memcpy(r.laddr, &src.ip6.sin6_addr, 16);
+			r.lport = src.ip6.sin6_port;
+			memcpy(r.raddr, &dst.ip6.sin6_addr, 16);
+			r.rport = dst.ip6.sin6_port;
+			if (tickle_list_add6(l, &r))
+				goto out;
+		}
+	}
+	ret = set ? tickle_set_foreach(set, collect_conn, l) : 0;
+out:
+	tickle_set_free(set);
+	return ret;
+}
+
+/*
+ * Load the list from fd, a state file or text.  A regular file is mapped,
+ * anything else is read in full; *map and *maplen are what is to be
+ * unmapped (or freed, for maplen 0) once the list is done with.
+ */
+static int load_conns(int fd, struct tickle_list *l, void **map, size_t *maplen)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+	ssize_t ret;
+	FILE *f;
+
+	*map = NULL;
+	*maplen = 0;
+	tickle_list_init(l);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		/* private and writable: -s sorts the records in place */
+		buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			fprintf(stderr, "Failed mmap() (%s)\n", strerror(errno));
+			return -1;
+		}
+		len = *maplen = st.st_size;
+	} else {
+		for (;;) {
+			if (len == size) {
+				char *p = realloc(buf, size = size ? 2 * size : 65536);
+
+				if (!p) {
+					fprintf(stderr, "Failed realloc()\n");
+					free(buf);
+					return -1;
+				}
+				buf = p;
+			}
+			ret = read(fd, buf + len, size - len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				fprintf(stderr, "Failed read() (%s)\n", strerror(errno));
+				free(buf);
+				return -1;
+			}
+			if (ret == 0)
+				break;
+			len += ret;
+		}
+	}
+	*map = buf;
+
+	if (tickle_state_is_binary(buf, len))
+		return tickle_state_parse(buf, len, l);
+	if (!len)
+		return 0;
+	f = fmemopen(buf, len, "r");
+	if (!f) {
+		fprintf(stderr, "Failed fmemopen() (%s)\n", strerror(errno));
+		return -1;
+	}
+	ret = read_conns(f, l);
+	fclose(f);
+	return ret;
+}
+
+static void unload_conns(struct tickle_list *l, void *map, size_t maplen)
+{
+	tickle_list_free(l);
+	if (maplen)
+		munmap(map, maplen);
+	else
+		free(map);
+}
+
+static int collect_conn(const struct tickle_diag_conn *c, void *arg)
+{
+	struct tickle_list *l = arg;
+
+	if (c->family == AF_INET) {
+		struct tickle_rec4 r;
+
+		memcpy(&r.laddr, c->laddr, 4);
+		memcpy(&r.raddr, c->raddr, 4);
+		r.lport = htons(c->lport);
+		r.rport = htons(c->rport);
+		return tickle_list_add4(l, &r);
+	} else {
+		struct tickle_rec6 r;
+
+		memcpy(r.laddr, c->laddr, 16);
+		memcpy(r.raddr, c->raddr, 16);
+		r.lport = htons(c->lport);
+		r.rport = htons(c->rport);
+		return tickle_list_add6(l, &r);
+	}
+}
+
+static int save_conn(const struct tickle_diag_conn *c, void *arg)
+{
+	FILE *f = arg;
+	char laddr[INET6_ADDRSTRLEN], raddr[INET6_ADDRSTRLEN];
+
+	inet_ntop(c->family, c->laddr, laddr, sizeof(laddr));
+	inet_ntop(c->family, c->raddr, raddr, sizeof(raddr));
+	return fprintf(f, "%s:%u\t%s:%u\n", laddr, c->lport, raddr, c->rport) < 0;
+}
+
+/*
+ * Write the established connections of ip as the list the tickles are
+ * read from, as text or as a state file, to stdout, or to path: into
+ * path.new first, synced and then renamed over path, so that a reader
+ * never finds half a list.
+ */
+static int save_conns(const char *ip, const char *path, int binary)
+{
+	struct tickle_list l;
+	char *tmp = NULL;
+	FILE *f = stdout;
+	long n;
+	int ret = -1;
+
+	tickle_list_init(&l);
+	if (path) {
+		tmp = malloc(strlen(path) + sizeof(".new"));
+		if (!tmp) {
+			fprintf(stderr, "Failed malloc()\n");
+			return -1;
+		}
+		sprintf(tmp, "%s.new", path);
+		f = fopen(tmp, "w");
+		if (!f) {
+			fprintf(stderr, "Failed to open %s (%s)\n", tmp, strerror(errno));
+			free(tmp);
+			return -1;
+		}
+	}
+
+	if (binary) {
+		n = tickle_diag_dump(ip, collect_conn, &l);
+		if (n >= 0 && tickle_state_write(fileno(f), &l)) {
+			fprintf(stderr, "Failed to write %s (%s)\n", tmp ? tmp : "stdout", strerror(errno));
+			n = -1;
+		}
+	} else
+		n = tickle_diag_dump(ip, save_conn, f);
+	if (n >= 0 && (fflush(f) || (path && fsync(fileno(f))))) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp ? tmp : "stdout", strerror(errno));
+		n = -1;
+	}
+	if (!path) {
+		ret = n < 0 ? -1 : 0;
+	} else if (n < 0) {
+		fclose(f);
+		unlink(tmp);
+	} else if (fclose(f) || rename(tmp, path)) {
+		fprintf(stderr, "Failed to replace %s (%s)\n", path, strerror(errno));
+		unlink(tmp);
+	} else
+		ret = 0;
+	free(tmp);
+	tickle_list_free(&l);
+	return ret;
+}
+
 static void usage(void)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -t threads ] [ -a cpus ] [ -r rate ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp --save ip [ --binary ] [ file ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp --stream ip --to dest [ --interval ms ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp --receive listen file\n");
 	printf("Please note that this program need to read the list of\n");
-	printf("{local_ip:port remote_ip:port} from stdin.\n");
+	printf("{local_ip:port remote_ip:port} from stdin, or from -f file;\n");
+	printf("a state file written with --binary is taken as well.\n");
+	printf("  -f file     read the list from file\n");
+	printf("  -n num      tickles per connection (1)\n");
+	printf("  -t threads  threads to share the connections between (1)\n");
+	printf("  -a cpus     CPUs to pin the threads to, e.g. 0,2-5\n");
+	printf("  -r rate     at most rate packets per second in all\n");
+	printf("  -b burst    at most burst packets back to back with -r (%d)\n", TICKLE_BATCH);
+	printf("  -s          spread the tickles: one connection of each remote\n");
+	printf("              host in turn, and the num tickles in num rounds\n");
+	printf("  -k          reset each connection as soon as its client answers\n");
+	printf("              a tickle, with the sequence number it acknowledges\n");
+	printf("  -w ms       with -k, wait for the answers after the last tickle (1000)\n");
+	printf("  --save ip   write the list of the established connections of ip\n");
+	printf("              to file, replacing it at once, or to stdout\n");
+	printf("  --binary    with --save, write a state file instead of text\n");
+	printf("  --stream ip follow the connections of ip, sending the changes to\n");
+	printf("              dest: tcp:host:port, unix:path or a file\n");
+	printf("  --interval ms  between the scans of --stream (1000)\n");
+	printf("  --receive   take the changes sent to listen, tcp:[host:]port or\n");
+	printf("              unix:path, into file; -f file tickles from it\n");
 	exit(1);
 }
 
-#define OPTION_STRING "n:h"
+#define OPTION_STRING "n:t:a:r:b:skw:f:h"
+
+static const struct option long_options[] = {
+	{ "save", required_argument, NULL, 'S' },
+	{ "binary", no_argument, NULL, 'B' },
+	{ "stream", required_argument, NULL, 'T' },
+	{ "to", required_argument, NULL, 'O' },
+	{ "interval", required_argument, NULL, 'I' },
+	{ "receive", required_argument, NULL, 'R' },
+	{ NULL, 0, NULL, 0 }
+};
 
 int main(int argc, char *argv[])
 {
 	int optchar, i, num = 1, cont = 1;
-	sock_addr src, dst;
-	char addrline[128], addr1[64], addr2[64];
+	int nthreads = 1, ncpus = 0, cpus[MAX_THREADS];
+	double rate = 0, burst = TICKLE_BATCH;
+	int spread = 0, reap = 0, wait_ms = 1000;
+	struct tickle_reaper reaper;
+	const char *save_ip = NULL, *file = NULL;
+	const char *stream_ip = NULL, *stream_to = NULL, *listen_on = NULL;
+	int interval = 1000;
+	int binary = 0, fd = 0;
+	struct tickle_list list;
+	void *map;
+	size_t maplen, n;
+	struct tickle_worker *workers;
+	unsigned long sent = 0, failed = 0;
+	int ret = 0;
 
 	while(cont) {
-		optchar = getopt(argc, argv, OPTION_STRING);
+		optchar = getopt_long(argc, argv, OPTION_STRING, long_options, NULL);
 		switch(optchar) {
 		case 'n':
 			num = atoi(optarg);
 			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_THREADS) {
+				fprintf(stderr, "The number of threads must be 1 to %d\n", MAX_THREADS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'a':
+			ncpus = parse_cpus(optarg, cpus, MAX_THREADS);
+			if (ncpus <= 0) {
+				fprintf(stderr, "Bad CPU list '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			rate = atof(optarg);
+			if (rate < 0) {
+				fprintf(stderr, "Bad rate '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			burst = atof(optarg);
+			if (burst < 1) {
+				fprintf(stderr, "Bad burst '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			spread = 1;
+			break;
+		case 'k':
+			reap = 1;
+			break;
+		case 'w':
+			wait_ms = atoi(optarg);
+			if (wait_ms < 0) {
+				fprintf(stderr, "Bad wait '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'S':
+			save_ip = optarg;
+			break;
+		case 'B':
+			binary = 1;
+			break;
+		case 'T':
+			stream_ip = optarg;
+			break;
+		case 'O':
+			stream_to = optarg;
+			break;
+		case 'I':
+			interval = atoi(optarg);
+			if (interval < 1) {
+				fprintf(stderr, "Bad interval '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			listen_on = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -354,26 +1349,115 @@ int main(int argc, char *argv[])
 		};
 	}
 
-	while(fgets(addrline, sizeof(addrline), stdin)) {
-		sscanf(addrline, "%s %s", addr1, addr2);
+	if (save_ip) {
+		if (argc - optind > 1) {
+			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
+			exit(EXIT_FAILURE);
+		}
+		return save_conns(save_ip, optind < argc ? argv[optind] : NULL, binary);
+	}
+	if (stream_ip) {
+		if (!stream_to || optind != argc) {
+			fprintf(stderr, "--stream needs --to, please use '-h' for usage.\n");
+			exit(EXIT_FAILURE);
+		}
+		return tickle_stream_run(stream_ip, stream_to, interval);
+	}
+	if (listen_on) {
+		if (argc - optind != 1) {
+			fprintf(stderr, "--receive needs a file, please use '-h' for usage.\n");
+			exit(EXIT_FAILURE);
+		}
+		return tickle_stream_receive(listen_on, argv[optind]);
+	}
 
-		if (parse_ip_port(addr1, &src)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
+	if (file && (fd = open(file, O_RDONLY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "Failed to open %s (%s)\n", file, strerror(errno));
+		return -1;
+	}
+	if (load_conns(fd, &list, &map, &maplen))
+		return -1;
+	if (spread
+	    && (spread_recs(list.r4, list.n4, sizeof(*list.r4), cmp_raddr4)
+		|| spread_recs(list.r6, list.n6, sizeof(*list.r6), cmp_raddr6)))
+		return -1;
+	n = list.n4 + list.n6;
+	if ((size_t)nthreads > n)
+		nthreads = n ? n : 1;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Failed calloc()\n");
+		return -1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		workers[i].list = &list;
+		workers[i].first = n * i / nthreads;
+		workers[i].nconns = n * (i + 1) / nthreads - workers[i].first;
+		workers[i].num = spread ? 1 : num;
+		workers[i].rounds = spread ? num : 1;
+		workers[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+		bucket_init(&workers[i].bucket, rate / nthreads, burst / nthreads);
+	}
+
+	/* the ACKs are listened for before the first tickle draws one */
+	if (reap) {
+		memset(&reaper, 0, sizeof(reaper));
+		reaper.wait_ms = wait_ms;
+		reaper.nconns = n;
+		reaper.s = open_reaper();
+		if (reaper.s == -1)
+			return -1;
+		reaper.pending = tickle_set_new();
+		if (!reaper.pending || add_list(reaper.pending, &list))
+			return -1;
+		if (pipe2(reaper.pipe, O_CLOEXEC)) {
+			fprintf(stderr, "Failed pipe() (%s)\n", strerror(errno));
 			return -1;
 		}
-		if (parse_ip_port(addr2, &dst)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+		if (pthread_create(&reaper.tid, NULL, tickle_reaper_run, &reaper)) {
+			fprintf(stderr, "Failed to start a thread\n");
 			return -1;
 		}
-	
-		for (i = 1; i <= num; i++) {
-			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
-				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
-					addr1, addr2);
+	}
+
+	/* one thread is this one */
+	if (nthreads == 1)
+		tickle_worker_run(&workers[0]);
+	else {
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&workers[i].tid, NULL, tickle_worker_run, &workers[i])) {
+				fprintf(stderr, "Failed to start a thread\n");
 				return -1;
 			}
 		}
+		for (i = 0; i < nthreads; i++)
+			pthread_join(workers[i].tid, NULL);
+	}
 
+	for (i = 0; i < nthreads; i++) {
+		sent += workers[i].batch.sent;
+		failed += workers[i].batch.failed;
+		if (workers[i].ret)
+			ret = -1;
 	}
-	return 0;
+	if (failed)
+		fprintf(stderr, "Failed to send %lu of %lu tickle acks\n",
+			failed, failed + sent);
+	if (reap) {
+		close(reaper.pipe[1]);
+		pthread_join(reaper.tid, NULL);
+		if (reaper.ret)
+			ret = -1;
+		if (reaper.reset < reaper.nconns)
+			fprintf(stderr, "No answer to reset %lu of %lu connections within %d ms\n",
+				(unsigned long)(reaper.nconns - reaper.reset),
+				(unsigned long)reaper.nconns, reaper.wait_ms);
+		close(reaper.pipe[0]);
+		close(reaper.s);
+		tickle_set_free(reaper.pending);
+	}
+	free(workers);
+	unload_conns(&list, map, maplen);
+	return ret;
 }